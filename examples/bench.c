@@ -0,0 +1,942 @@
+#include <time.h>
+#include "gl.h"
+#include "obj.h"
+#include "meshgen.h"
+#include "scene.h"
+#include "cmdbuf.h"
+#include "lights.h"
+#include "pipeline.h"
+#include "post.h"
+#include "trace.h"
+#include "example_shaders.h"
+
+// Headless benchmark. Renders a deterministic camera orbit around a mesh
+// into offscreen buffers and reports frame time statistics.
+//
+// Usage: bench [options] file.obj
+//        bench [options] -g spec
+//   -n frames     number of frames to render (default 200)
+//   -s WxH        resolution (default 800x600)
+//   -S shader     phong, normal, uv or lights (default phong)
+//   -z format     depth format z, z16 or z32f (default z)
+//   -f            render into a float target and resolve each frame
+//   -o file.ppm   write the last frame as a binary PPM
+//   -j file.json  write per-frame pipeline statistics (build with STATS=1)
+//   -t file.json  write a Chrome trace of the run (build with TRACE=1)
+//   -F            let shaders use fast approximate math, see fastmath.h
+//   -H mode       render a heatmap instead of shading: coverage, depth or
+//                 cost (fragment shader timer ticks)
+//   -I count      draw count instances of the mesh on a grid with 
+//                 draw_model_instanced()
+//   -B            draw the -I instances through a Scene and its BVH instead
+//   -O            with -B, add a wall occluder through the grid and enable
+//                 occlusion culling
+//   -D            draw front to back: face clusters of the mesh, and with
+//                 -B the instances, sorted by view depth every frame
+//   -J threads    start a job pool with that many threads, 0 for one per
+//                 CPU. Runs the vertex stage and resolve as jobs
+//   -C            record each frame into a command buffer and execute it in
+//                 bands on the -J pool
+//   -L            draw with DRAW_SORT_LAST on the -J pool
+//   -K count      point lights of the lights shader (default 256)
+//   -X            phong without -I: draw through a pipeline specialized on
+//                 the shader and buffer formats, see pipeline.h
+//   -W            phong without -I: render a shadow map of the mesh from
+//                 the light every frame and shade with it
+//   -p            post process every frame with full-screen passes, a 3x3
+//                 blur and a vignette fused into it, see post.h. Runs on
+//                 the -J pool
+//   -g spec       render a generated mesh instead of an OBJ file, see
+//                 meshgen_parse() in src/meshgen.h for the spec format
+//   -G file.obj   write the mesh as OBJ, e.g. to time load_obj() on it
+//
+// Regression checks, the exit status is 2 if any check fails:
+//   -r ref.ppm    compare the last frame against a reference image. On 
+//                 failure a diff image is written to ref.ppm.diff.ppm
+//   -T tol        max per channel difference of a matching pixel (default 2)
+//   -P percent    percent of pixels allowed to exceed tol (default 0.1)
+//   -b base.txt   compare the p50 frame time against a stored baseline
+//   -x percent    allowed p50 slowdown against the baseline (default 10)
+//   -w            write the reference image and baseline instead of
+//                 comparing against them
+
+static ShaderPhong phong_shader;
+static ShaderNormal normal_shader;
+static ShaderUV uv_shader;
+static ShaderLights lights_shader;
+
+typedef struct {
+    int frames;
+    int width;
+    int height;
+    const char *shader;
+    buffer_type depth_type;
+    int hdr;
+    const char *ppm_path;
+    const char *stats_path;
+    const char *trace_path;
+    int fast_math;
+    debug_mode heatmap;
+    const char *ref_path;
+    int tolerance;
+    float bad_percent;
+    const char *baseline_path;
+    float slack_percent;
+    int write_refs;
+    const char *obj_path;
+    const char *gen_spec;
+    int instances;
+    int use_scene;
+    int occlusion;
+    int sort;
+    int threads;
+    int cmdbuf;
+    int sort_last;
+    int shadows;
+    int lights;
+    int specialized;
+    int post;
+    const char *obj_out_path;
+} BenchOptions;
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000.0 + ts.tv_nsec/1.0e6;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(double *sorted, int n, double p) {
+    int i = (int)(p*(n - 1) + 0.5);
+    return sorted[MIN(MAX(i, 0), n - 1)];
+}
+
+static int parse_args(int argc, char **argv, BenchOptions *opt) {
+    opt->frames = 200;
+    opt->width = 800;
+    opt->height = 600;
+    opt->shader = "phong";
+    opt->depth_type = BUF_Z;
+    opt->hdr = 0;
+    opt->ppm_path = NULL;
+    opt->stats_path = NULL;
+    opt->trace_path = NULL;
+    opt->fast_math = 0;
+    opt->heatmap = DEBUG_NONE;
+    opt->ref_path = NULL;
+    opt->tolerance = 2;
+    opt->bad_percent = 0.1f;
+    opt->baseline_path = NULL;
+    opt->slack_percent = 10.f;
+    opt->write_refs = 0;
+    opt->obj_path = NULL;
+    opt->gen_spec = NULL;
+    opt->instances = 0;
+    opt->use_scene = 0;
+    opt->occlusion = 0;
+    opt->sort = 0;
+    opt->threads = -1;
+    opt->cmdbuf = 0;
+    opt->sort_last = 0;
+    opt->shadows = 0;
+    opt->lights = 256;
+    opt->specialized = 0;
+    opt->post = 0;
+    opt->obj_out_path = NULL;
+
+    for (int i=1; i < argc; i++) {
+        const char *arg = argv[i];
+        int has_val = (i + 1 < argc);
+        if (strcmp(arg, "-n") == 0 && has_val) {
+            opt->frames = atoi(argv[++i]);
+        } else if (strcmp(arg, "-s") == 0 && has_val) {
+            if (sscanf(argv[++i], "%dx%d", &opt->width, &opt->height) != 2) {
+                return 1;
+            }
+        } else if (strcmp(arg, "-S") == 0 && has_val) {
+            opt->shader = argv[++i];
+        } else if (strcmp(arg, "-z") == 0 && has_val) {
+            const char *fmt = argv[++i];
+            if (strcmp(fmt, "z16") == 0) {
+                opt->depth_type = BUF_Z16;
+            } else if (strcmp(fmt, "z32f") == 0) {
+                opt->depth_type = BUF_Z32F;
+            } else {
+                opt->depth_type = BUF_Z;
+            }
+        } else if (strcmp(arg, "-f") == 0) {
+            opt->hdr = 1;
+        } else if (strcmp(arg, "-o") == 0 && has_val) {
+            opt->ppm_path = argv[++i];
+        } else if (strcmp(arg, "-j") == 0 && has_val) {
+            opt->stats_path = argv[++i];
+        } else if (strcmp(arg, "-t") == 0 && has_val) {
+            opt->trace_path = argv[++i];
+        } else if (strcmp(arg, "-F") == 0) {
+            opt->fast_math = 1;
+        } else if (strcmp(arg, "-H") == 0 && has_val) {
+            const char *mode = argv[++i];
+            if (strcmp(mode, "coverage") == 0) {
+                opt->heatmap = DEBUG_COVERAGE;
+            } else if (strcmp(mode, "depth") == 0) {
+                opt->heatmap = DEBUG_DEPTH_PASS;
+            } else if (strcmp(mode, "cost") == 0) {
+                opt->heatmap = DEBUG_SHADER_COST;
+            } else {
+                return 1;
+            }
+        } else if (strcmp(arg, "-r") == 0 && has_val) {
+            opt->ref_path = argv[++i];
+        } else if (strcmp(arg, "-T") == 0 && has_val) {
+            opt->tolerance = atoi(argv[++i]);
+        } else if (strcmp(arg, "-P") == 0 && has_val) {
+            opt->bad_percent = atof(argv[++i]);
+        } else if (strcmp(arg, "-b") == 0 && has_val) {
+            opt->baseline_path = argv[++i];
+        } else if (strcmp(arg, "-x") == 0 && has_val) {
+            opt->slack_percent = atof(argv[++i]);
+        } else if (strcmp(arg, "-g") == 0 && has_val) {
+            opt->gen_spec = argv[++i];
+        } else if (strcmp(arg, "-I") == 0 && has_val) {
+            opt->instances = atoi(argv[++i]);
+        } else if (strcmp(arg, "-B") == 0) {
+            opt->use_scene = 1;
+        } else if (strcmp(arg, "-O") == 0) {
+            opt->occlusion = 1;
+        } else if (strcmp(arg, "-D") == 0) {
+            opt->sort = 1;
+        } else if (strcmp(arg, "-J") == 0 && has_val) {
+            opt->threads = atoi(argv[++i]);
+        } else if (strcmp(arg, "-C") == 0) {
+            opt->cmdbuf = 1;
+        } else if (strcmp(arg, "-L") == 0) {
+            opt->sort_last = 1;
+        } else if (strcmp(arg, "-K") == 0 && has_val) {
+            opt->lights = atoi(argv[++i]);
+        } else if (strcmp(arg, "-X") == 0) {
+            opt->specialized = 1;
+        } else if (strcmp(arg, "-W") == 0) {
+            opt->shadows = 1;
+        } else if (strcmp(arg, "-p") == 0) {
+            opt->post = 1;
+        } else if (strcmp(arg, "-G") == 0 && has_val) {
+            opt->obj_out_path = argv[++i];
+        } else if (strcmp(arg, "-w") == 0) {
+            opt->write_refs = 1;
+        } else if (arg[0] != '-') {
+            opt->obj_path = arg;
+        } else {
+            return 1;
+        }
+    }
+    // Exactly one of an OBJ file or a generator spec.
+    if ((opt->obj_path == NULL) == (opt->gen_spec == NULL) ||
+            opt->frames < 1 || opt->width < 1 || opt->height < 1) {
+        return 1;
+    }
+    return 0;
+}
+
+// Phong pipelines for -X, per depth and color format.
+#define PHONG_VARYINGS \
+    (PIPE_VARYING_POS | PIPE_VARYING_POST | PIPE_VARYING_NORMAL)
+#define PHONG_DEPTH (PIPE_DEPTH_TEST | PIPE_DEPTH_WRITE)
+DEFINE_PIPELINE(draw_phong_z, shader_phong_fragment, PHONG_VARYINGS,
+        PHONG_DEPTH, Z, RGBA)
+DEFINE_PIPELINE(draw_phong_z16, shader_phong_fragment, PHONG_VARYINGS,
+        PHONG_DEPTH, Z16, RGBA)
+DEFINE_PIPELINE(draw_phong_z32f, shader_phong_fragment, PHONG_VARYINGS,
+        PHONG_DEPTH, Z32F, RGBA)
+DEFINE_PIPELINE(draw_phong_z_hdr, shader_phong_fragment, PHONG_VARYINGS,
+        PHONG_DEPTH, Z, RGBAF)
+DEFINE_PIPELINE(draw_phong_z16_hdr, shader_phong_fragment, PHONG_VARYINGS,
+        PHONG_DEPTH, Z16, RGBAF)
+DEFINE_PIPELINE(draw_phong_z32f_hdr, shader_phong_fragment, PHONG_VARYINGS,
+        PHONG_DEPTH, Z32F, RGBAF)
+
+typedef void (*draw_fn)(Mesh, RenderContext*, ScreenBuffer*, ScreenBuffer*);
+
+// Post passes for -p. A 3x3 box blur, clamped at the edges, of each byte of
+// the packed pixels.
+static void blur_kernel(const PostPass *pass, int y0, int y1) {
+    const ScreenBuffer *src = pass->src;
+    int width = MIN(src->width, pass->dst->width);
+    for (int y=y0; y < MIN(y1, src->height); y++) {
+        const uint8_t *rows[3] = {
+            post_row(src, MAX(y - 1, 0)),
+            post_row(src, y),
+            post_row(src, MIN(y + 1, src->height - 1))
+        };
+        uint8_t *out = post_row(pass->dst, y);
+        // Bytes of the edge pixels, then the interior without clamping,
+        // which the compiler vectorizes.
+        int edges[2] = {0, width - 1};
+        for (int e=0; e < 2; e++) {
+            int x = edges[e];
+            int xs[3] = {MAX(x - 1, 0), x, MIN(x + 1, width - 1)};
+            for (int c=0; c < 4; c++) {
+                int sum = 0;
+                for (int j=0; j < 3; j++) {
+                    for (int k=0; k < 3; k++) {
+                        sum += rows[j][4*xs[k] + c];
+                    }
+                }
+                out[4*x + c] = sum/9;
+            }
+        }
+        for (int i=4; i < 4*(width - 1); i++) {
+            int sum = rows[0][i - 4] + rows[0][i] + rows[0][i + 4] +
+                rows[1][i - 4] + rows[1][i] + rows[1][i + 4] +
+                rows[2][i - 4] + rows[2][i] + rows[2][i + 4];
+            out[i] = sum/9;
+        }
+    }
+}
+
+// Darkens the pixels towards the corners by up to the strength in data,
+// scaling two bytes at a time.
+static inline uint32_t vignette_pixel(const PostPass *pass, int x, int y) {
+    float strength = *(const float *)pass->data;
+    float dx = 2.f*x/pass->dst->width - 1.f;
+    float dy = 2.f*y/pass->dst->height - 1.f;
+    uint32_t f = (uint32_t)(256.f*(1.f - .5f*strength*(dx*dx + dy*dy)));
+    uint32_t in = ((const uint32_t *)post_row(pass->src, y))[x];
+    return ((in & 0x00ff00ff)*f >> 8 & 0x00ff00ff) |
+        ((in >> 8 & 0x00ff00ff)*f & 0xff00ff00);
+}
+DEFINE_POST_PIXEL(vignette_kernel, uint32_t, vignette_pixel)
+
+// Phong pipeline for the buffer formats.
+static draw_fn phong_pipeline(buffer_type depth_type, int hdr) {
+    switch (depth_type) {
+        case BUF_Z16: return hdr ? draw_phong_z16_hdr : draw_phong_z16;
+        case BUF_Z32F: return hdr ? draw_phong_z32f_hdr : draw_phong_z32f;
+        default: return hdr ? draw_phong_z_hdr : draw_phong_z;
+    }
+}
+
+// Sets up the named shader and returns it, and its size in *size.
+static ShaderBase *setup_shader(const char *name, size_t *size) {
+    if (strcmp(name, "normal") == 0) {
+        *size = sizeof(normal_shader);
+        normal_shader.base.vertex_shader = &shader_normal_vertex;
+        normal_shader.base.vertex_shader_batch = &shader_normal_vertex_batch;
+        normal_shader.base.fragment_shader = &shader_normal_fragment;
+        return (ShaderBase *)&normal_shader;
+    } else if (strcmp(name, "uv") == 0) {
+        *size = sizeof(uv_shader);
+        uv_shader.base.vertex_shader = &shader_uv_vertex;
+        uv_shader.base.vertex_shader_batch = &shader_uv_vertex_batch;
+        uv_shader.base.fragment_shader = &shader_uv_fragment;
+        return (ShaderBase *)&uv_shader;
+    } else if (strcmp(name, "lights") == 0) {
+        *size = sizeof(lights_shader);
+        Vec3f ambient_light = {{0.05f, 0.05f, 0.05f}};
+        lights_shader.base.vertex_shader = &shader_lights_vertex;
+        lights_shader.base.vertex_shader_batch = &shader_lights_vertex_batch;
+        lights_shader.base.fragment_shader = &shader_lights_fragment;
+        v3fset(&lights_shader.ambient_light, ambient_light);
+        lights_shader.diffuse_amount = .8f;
+        lights_shader.specular_amount = .2f;
+        lights_shader.specular_falloff = 25.f;
+        return (ShaderBase *)&lights_shader;
+    }
+
+    // Same lighting as examples/objpreview.c
+    *size = sizeof(phong_shader);
+    Vec3f ambient_light = {{0.15f, 0.01f, 0.01f}};
+    Vec3f light = {{0.f, 0.f, .4f}};
+    Vec3f light_pos = {{10.f, 4.f, 6.f}};
+    phong_shader.base.vertex_shader = &shader_phong_vertex;
+    phong_shader.base.vertex_shader_batch = &shader_phong_vertex_batch;
+    phong_shader.base.fragment_shader = &shader_phong_fragment;
+    v3fset(&phong_shader.ambient_light, ambient_light);
+    v3fset(&phong_shader.light, light);
+    v3fset(&phong_shader.light_pos, light_pos);
+    phong_shader.diffuse_amount = .8f;
+    phong_shader.specular_amount = .2f;
+    phong_shader.specular_falloff = 25.f;
+    return (ShaderBase *)&phong_shader;
+}
+
+// Size of the -W shadow map.
+#define SHADOW_MAP_SIZE 1024
+
+// Light space view projection for the -W shadow map. An orthographic view
+// from the Phong light_pos towards the origin, covering the unit mesh.
+static Mat44f shadow_view_proj(Vec3f light_pos) {
+    Vec3f c = {{0.f, 0.f, 0.f}};
+    Vec3f up = {{0.f, 1.f, 0.f}};
+    Mat44f view;
+    lookat(&view, light_pos, c, up);
+    float dist = sqrtf(v3fdot(light_pos, light_pos));
+    return m44fm44f(orthographic(-1.5f, 1.5f, -1.5f, 1.5f, dist - 2.f,
+                dist + 2.f), view);
+}
+
+// Adds n point lights at fixed pseudo random positions around the origin,
+// with random colors and radii. Returns 1 if allocation failed.
+static int random_lights(LightList *lights, int n) {
+    unsigned seed = 1;
+    for (int i=0; i < n; i++) {
+        float r[7];
+        for (int k=0; k < 7; k++) {
+            seed = seed*1103515245u + 12345u;
+            r[k] = ((seed >> 8) & 0xffff)/65535.f;
+        }
+        PointLight light = {
+            {{3.f*r[0] - 1.5f, 3.f*r[1] - 1.5f, 3.f*r[2] - 1.5f}},
+            {{r[3], r[4], r[5]}},
+            .3f + .3f*r[6]
+        };
+        if (lights_add(lights, light) < 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Camera for frame i of n. One full orbit over the run.
+static void set_camera(ShaderBase *shader, int i, int n, float aspect) {
+    float t = 2.f*3.14159265f*i/n;
+    float r = 2.f;
+    Vec3f eye = {{r*sinf(t), cosf(0.5f*t), r*cosf(t)}};
+    Vec3f c = {{0.f, 0.f, 0.f}};
+    Vec3f up = {{0.f, 1.f, 0.f}};
+
+    m44fset(&shader->projection, perspective(80.f, aspect, -2.f, -4.5f));
+    lookat(&shader->modelview, eye, c, up);
+    shader->mvp = m44fm44f(shader->projection, shader->modelview);
+}
+
+// Model matrices for n instances on a square grid in the xz plane, centered
+// on the origin. The grid extends past the view for large n. Returns NULL
+// if allocation failed.
+static Mat44f *grid_instances(int n) {
+    Mat44f *models = malloc(n*sizeof(Mat44f));
+    if (models == NULL) {
+        return NULL;
+    }
+    int side = (int)ceilf(sqrtf((float)n));
+    float scale = 0.25f;
+    float spacing = 0.75f;
+    for (int i=0; i < n; i++) {
+        Mat44f m = m44fmul(m44fident(), scale);
+        m.e[4*0 + 3] = (i % side - 0.5f*(side - 1))*spacing;
+        m.e[4*2 + 3] = (i / side - 0.5f*(side - 1))*spacing;
+        m.e[4*3 + 3] = 1.f;
+        models[i] = m;
+    }
+    return models;
+}
+
+// Wall through the origin in the xy plane, splitting the -I grid in two. 
+// Used as the occluder with -O.
+static float wall_verts[] = {
+    -1.5f, -.75f, 0.f,   1.5f, -.75f, 0.f,   1.5f, .75f, 0.f,   -1.5f, .75f, 0.f
+};
+static float wall_normals[] = {0.f, 0.f, 1.f};
+static int wall_faces[] = {0, 1, 2,   0, 2, 3};
+static int wall_faces_normals[] = {0, 0, 0,   0, 0, 0};
+
+static Mesh wall_mesh(void) {
+    Mesh wall = {0};
+    wall.verts = wall_verts;
+    wall.normals = wall_normals;
+    wall.faces_verts = wall_faces;
+    wall.faces_normals = wall_faces_normals;
+    wall.nverts = 12;
+    wall.nnormals = 3;
+    wall.nfaces_verts = 6;
+    return wall;
+}
+
+// Per-instance uniforms for the Phong shader, varies the light color.
+static void phong_instance_uniforms(ShaderBase *shader, int instance,
+        void *userdata) {
+    (void)userdata;
+    ShaderPhong *phong = (ShaderPhong *)shader;
+    float t = 0.7f*instance;
+    Vec3f light = {{.2f + .2f*sinf(t), .2f + .2f*sinf(t + 2.1f),
+        .2f + .2f*sinf(t + 4.2f)}};
+    v3fset(&phong->light, light);
+}
+
+// Records the instances inside the frustum like draw_model_instanced() 
+// draws them. Returns the number recorded.
+static int record_instances(CommandBuffer *cb, const Mesh *obj, 
+        const Mat44f *models, int count, instance_uniforms_fn uniforms,
+        ScreenBuffer *rgba, ScreenBuffer *z) {
+    ShaderBase *shader = cmdbuf_uniforms(cb);
+    Mat44f view = shader->modelview;
+    Aabb box = mesh_bounds(*obj);
+    int recorded = 0;
+    for (int i=0; i < count; i++) {
+        cmdbuf_set_transform(cb, m44fm44f(view, models[i]));
+        Frustum frustum = frustum_from_matrix(shader->mvp);
+        if (!frustum_test_aabb(&frustum, box)) {
+            continue;
+        }
+        if (uniforms != NULL) {
+            uniforms(cmdbuf_uniforms(cb), i, NULL);
+        }
+        recorded += (cmdbuf_draw(cb, obj, rgba, z) == 0);
+    }
+    cmdbuf_set_transform(cb, view);
+    return recorded;
+}
+
+static int write_ppm(const char *path, ScreenBuffer *buffer) {
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) {
+        printf("Could not open %s for writing.\n", path);
+        return 1;
+    }
+    fprintf(fp, "P6\n%d %d\n255\n", buffer->width, buffer->height);
+    for (int y=0; y < buffer->height; y++) {
+        uint32_t *row = (uint32_t *)((char *)buffer->memory + y*buffer->pitch);
+        for (int x=0; x < buffer->width; x++) {
+            uint8_t rgb[3] = {row[x] >> 16 & 0xff, row[x] >> 8 & 0xff,
+                row[x] & 0xff};
+            fwrite(rgb, 1, 3, fp);
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+// Reads a binary PPM written by write_ppm. Returns rgb bytes or NULL.
+static uint8_t *read_ppm(const char *path, int *width, int *height) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        printf("Could not open %s.\n", path);
+        return NULL;
+    }
+    int maxval;
+    if (fscanf(fp, "P6 %d %d %d", width, height, &maxval) != 3 ||
+            maxval != 255 || fgetc(fp) == EOF) {
+        printf("%s is not a binary 8-bit PPM.\n", path);
+        fclose(fp);
+        return NULL;
+    }
+    size_t size = (size_t)(*width)*(*height)*3;
+    uint8_t *rgb = malloc(size);
+    if (fread(rgb, 1, size, fp) != size) {
+        printf("%s is truncated.\n", path);
+        free(rgb);
+        rgb = NULL;
+    }
+    fclose(fp);
+    return rgb;
+}
+
+// Compares the frame against the reference image. Pixels with a channel
+// differing by more than tol are counted as bad. Writes a diff image, bad 
+// pixels red over the dimmed frame, if too many pixels are bad.
+// Returns 1 on mismatch.
+static int compare_ref(ScreenBuffer *frame, const BenchOptions *opt) {
+    int width, height;
+    uint8_t *ref = read_ppm(opt->ref_path, &width, &height);
+    if (ref == NULL) {
+        return 1;
+    }
+    if (width != frame->width || height != frame->height) {
+        printf("image: FAIL, reference is %dx%d, frame is %dx%d\n", 
+                width, height, frame->width, frame->height);
+        free(ref);
+        return 1;
+    }
+
+    uint8_t *diff = malloc((size_t)width*height*3);
+    long bad = 0;
+    double sq_sum = 0.0;
+    for (int y=0; y < height; y++) {
+        uint32_t *row = (uint32_t *)((char *)frame->memory + y*frame->pitch);
+        for (int x=0; x < width; x++) {
+            uint8_t *r = &ref[3*(y*width + x)];
+            uint8_t *d = &diff[3*(y*width + x)];
+            int c[3] = {row[x] >> 16 & 0xff, row[x] >> 8 & 0xff, 
+                row[x] & 0xff};
+            int max_delta = 0;
+            for (int j=0; j < 3; j++) {
+                int delta = abs(c[j] - r[j]);
+                max_delta = MAX(max_delta, delta);
+                sq_sum += delta*delta;
+            }
+            if (max_delta > opt->tolerance) {
+                bad++;
+                d[0] = 255; d[1] = 0; d[2] = 0;
+            } else {
+                d[0] = c[0]/4; d[1] = c[1]/4; d[2] = c[2]/4;
+            }
+        }
+    }
+    free(ref);
+
+    double bad_percent = 100.0*bad/((double)width*height);
+    double rmse = sqrt(sq_sum/(3.0*width*height));
+    int fail = bad_percent > opt->bad_percent;
+    printf("image: %s, %ld pixels (%.3f%%) over tolerance %d, rmse %.3f\n",
+            fail ? "FAIL" : "ok", bad, bad_percent, opt->tolerance, rmse);
+
+    if (fail) {
+        char path[1024];
+        snprintf(path, sizeof(path), "%s.diff.ppm", opt->ref_path);
+        FILE *fp = fopen(path, "wb");
+        if (fp != NULL) {
+            fprintf(fp, "P6\n%d %d\n255\n", width, height);
+            fwrite(diff, 1, (size_t)width*height*3, fp);
+            fclose(fp);
+            printf("image: diff written to %s\n", path);
+        }
+    }
+    free(diff);
+    return fail;
+}
+
+// Compares the p50 frame time against the stored baseline. 
+// Returns 1 on regression.
+static int compare_baseline(double p50, const BenchOptions *opt) {
+    FILE *fp = fopen(opt->baseline_path, "r");
+    double base;
+    if (fp == NULL || fscanf(fp, "p50_ms %lf", &base) != 1) {
+        printf("Could not read baseline %s.\n", opt->baseline_path);
+        if (fp != NULL) {
+            fclose(fp);
+        }
+        return 1;
+    }
+    fclose(fp);
+
+    double change = 100.0*(p50 - base)/base;
+    int fail = change > opt->slack_percent;
+    printf("timing: %s, p50 %.3f ms against baseline %.3f ms (%+.1f%%)\n",
+            fail ? "FAIL" : "ok", p50, base, change);
+    return fail;
+}
+
+int main(int argc, char **argv) {
+    BenchOptions opt;
+    if (parse_args(argc, argv, &opt) != 0) {
+        printf("Usage: %s [-n frames] [-s WxH] [-S phong|normal|uv|lights] "
+                "[-z z|z16|z32f] [-f] [-o out.ppm] [-j stats.json] "
+                "[-t trace.json] [-F] [-H coverage|depth|cost] [-I count] [-B] "
+                "[-O] [-D] [-J threads] [-C] [-L] [-K count] [-X] [-W] [-p] "
+                "[-r ref.ppm] [-T tol] [-P percent] [-b base.txt] [-x percent] "
+                "[-w] [-G out.obj] file.obj | -g spec\n", argv[0]);
+        return 1;
+    }
+
+    Mesh obj;
+    double load_start = now_ms();
+    if (opt.gen_spec != NULL) {
+        MeshGenParams params;
+        if (meshgen_parse(opt.gen_spec, &params) != 0) {
+            printf("Error: Invalid mesh spec %s.\n", opt.gen_spec);
+            return 1;
+        }
+        if (meshgen_generate(&params, &obj) != 0) {
+            printf("Error: Could not allocate mesh. Exiting.\n");
+            return 1;
+        }
+    } else if (load_obj(opt.obj_path, &obj) != 0) {
+        printf("Error: Could not load file. Exiting.\n");
+        return 1;
+    }
+    double load_ms = now_ms() - load_start;
+
+    if (opt.obj_out_path != NULL) {
+        FILE *fp = fopen(opt.obj_out_path, "w");
+        if (fp == NULL || mesh_write_obj(fp, &obj) != 0) {
+            printf("Could not write %s.\n", opt.obj_out_path);
+        }
+        if (fp != NULL) {
+            fclose(fp);
+        }
+    }
+
+    ScreenBuffer buffers[4];
+    if (buffer_init(&buffers[0], BUF_RGBA, opt.width, opt.height) ||
+            buffer_init(&buffers[1], opt.depth_type, opt.width, opt.height) ||
+            buffer_init(&buffers[2], BUF_RGBAF, opt.width, opt.height) ||
+            buffer_init(&buffers[3], BUF_COUNT, opt.width, opt.height)) {
+        printf("Error: Could not allocate buffers.\n");
+        return 1;
+    }
+    ScreenBuffer *target = opt.hdr ? &buffers[2] : &buffers[0];
+
+    RenderStats stats = {0};
+    RenderContext ctx = {0};
+    ctx.stats = &stats;
+    ctx.buffers = buffers;
+    ctx.num_buffers = 4;
+    ctx.debug = opt.heatmap;
+    ctx.debug_counts = &buffers[3];
+    size_t shader_size;
+    ctx.shader = setup_shader(opt.shader, &shader_size);
+    ctx.shader->fast_math = opt.fast_math;
+    ctx.shader_size = shader_size;
+    JobPool pool;
+    if (opt.threads >= 0) {
+        if (jobs_init(&pool, opt.threads, 0) != 0) {
+            printf("Could not start the job pool threads.\n");
+            return 1;
+        }
+        ctx.jobs = &pool;
+    }
+    if (opt.sort_last) {
+        ctx.draw_strategy = DRAW_SORT_LAST;
+    }
+    m44fset(&ctx.shader->viewport, viewport(0, 0, opt.width, opt.height));
+
+    ScreenBuffer shadow_map = {0};
+    Mat44f light_view_proj = m44fident();
+    if (opt.shadows && ctx.shader == (ShaderBase *)&phong_shader &&
+            opt.instances == 0) {
+        if (buffer_init(&shadow_map, BUF_Z32F, SHADOW_MAP_SIZE, 
+                    SHADOW_MAP_SIZE)) {
+            printf("Error: Could not allocate the shadow map.\n");
+            return 1;
+        }
+        light_view_proj = shadow_view_proj(phong_shader.light_pos);
+        phong_shader.shadow_map = &shadow_map;
+        phong_shader.shadow_matrix = light_view_proj;
+        phong_shader.shadow_bias = .01f;
+    }
+
+    // -p blurs the frame into post_buffer and darkens that in place, it is
+    // then the output image.
+    ScreenBuffer post_buffer = {0};
+    ScreenBuffer *output = &buffers[0];
+    float vignette = .6f;
+    PostPass post_passes[] = {
+        {blur_kernel, &buffers[0], &post_buffer, NULL, 0},
+        {vignette_kernel, &post_buffer, &post_buffer, &vignette,
+            POST_ROW_LOCAL}
+    };
+    if (opt.post) {
+        if (buffer_init(&post_buffer, BUF_RGBA, opt.width, opt.height)) {
+            printf("Error: Could not allocate the post buffer.\n");
+            return 1;
+        }
+        output = &post_buffer;
+    }
+
+    LightList lights;
+    LightClusters clusters_lights = {0};
+    lights_init(&lights);
+    if (ctx.shader == (ShaderBase *)&lights_shader) {
+        if (random_lights(&lights, opt.lights) ||
+                light_clusters_init(&clusters_lights, opt.width, opt.height,
+                    .5f, 10.f)) {
+            printf("Error: Could not allocate the lights.\n");
+            return 1;
+        }
+        lights_shader.clusters = &clusters_lights;
+    }
+
+    draw_fn draw = &draw_model;
+    if (opt.specialized && ctx.shader == (ShaderBase *)&phong_shader) {
+        draw = phong_pipeline(opt.depth_type, opt.hdr);
+    }
+
+    Mat44f *models = NULL;
+    instance_uniforms_fn uniforms = NULL;
+    if (opt.instances > 0) {
+        models = grid_instances(opt.instances);
+        if (models == NULL) {
+            printf("Could not allocate the instances.\n");
+            return 1;
+        }
+        if (ctx.shader == (ShaderBase *)&phong_shader) {
+            uniforms = &phong_instance_uniforms;
+        }
+    }
+    long instances_drawn = 0;
+
+    MeshClusters clusters = {0};
+    if (opt.sort && mesh_build_clusters(&obj, &clusters) != 0) {
+        printf("Could not build the mesh clusters.\n");
+        return 1;
+    }
+
+    Scene scene;
+    scene_init(&scene);
+    scene.sort = opt.sort;
+    if (models != NULL && opt.use_scene) {
+        int mesh = scene_add_mesh(&scene, obj);
+        if (opt.sort) {
+            scene.clusters[mesh] = clusters;
+            clusters = (MeshClusters){0};
+        }
+        for (int i=0; i < opt.instances; i++) {
+            scene_add_instance(&scene, mesh, models[i]);
+        }
+        if (opt.occlusion) {
+            int wall = scene_add_mesh(&scene, wall_mesh());
+            int inst = scene_add_instance(&scene, wall, m44fident());
+            scene_set_occluder(&scene, inst, 1);
+            if (scene_enable_occlusion(&scene, 256, 128) != 0) {
+                printf("Could not allocate the occlusion buffer.\n");
+                return 1;
+            }
+        }
+    }
+
+    CommandBuffer cb;
+    cmdbuf_init(&cb);
+
+    double *frame_ms = malloc(opt.frames*sizeof(double));
+    double start = now_ms();
+    for (int i=0; i < opt.frames; i++) {
+        double t0 = now_ms();
+        TRACE_BEGIN(frame_start);
+        TRACE_BEGIN(clear_start);
+        if (!opt.cmdbuf) {
+            buffer_clear(target);
+            buffer_clear(&buffers[1]);
+        }
+        buffer_clear(&buffers[3]);
+        TRACE_END(clear_start, "clear");
+        if (shadow_map.memory != NULL) {
+            buffer_clear(&shadow_map);
+            draw_model_shadow(obj, light_view_proj, &shadow_map);
+        }
+        set_camera(ctx.shader, i, opt.frames,
+                (float)opt.width/opt.height);
+        if (lights.count > 0) {
+            light_clusters_build(&clusters_lights, &lights,
+                    ctx.shader->modelview, ctx.shader->projection,
+                    ctx.shader->viewport, ctx.jobs);
+        }
+        if (opt.cmdbuf) {
+            cmdbuf_reset(&cb);
+            cmdbuf_clear(&cb, target, &buffers[1]);
+            cmdbuf_set_shader(&cb, ctx.shader, shader_size);
+            if (models != NULL && opt.use_scene) {
+                instances_drawn += scene_record(&scene, &cb, target,
+                        &buffers[1]);
+            } else if (models != NULL) {
+                instances_drawn += record_instances(&cb, &obj, models,
+                        opt.instances, uniforms, target, &buffers[1]);
+            } else {
+                cmdbuf_draw(&cb, &obj, target, &buffers[1]);
+            }
+            CommandBuffer *list[] = {&cb};
+            cmdbuf_submit(ctx.jobs, list, 1, &ctx);
+        } else if (models != NULL && opt.use_scene) {
+            instances_drawn += scene_draw(&scene, &ctx, target, &buffers[1]);
+        } else if (models != NULL) {
+            instances_drawn += draw_model_instanced(obj, NULL, models, 
+                    opt.instances, uniforms, NULL, &ctx, target, &buffers[1]);
+        } else if (opt.sort) {
+            draw_model_sorted(obj, &clusters, &ctx, target, &buffers[1]);
+        } else {
+            draw(obj, &ctx, target, &buffers[1]);
+        }
+        if (opt.heatmap != DEBUG_NONE) {
+            debug_heatmap(&buffers[3], &buffers[0], 0);
+        } else if (opt.hdr) {
+            resolve_jobs(ctx.jobs, &buffers[2], &buffers[0], TONEMAP_CLAMP,
+                    1.f);
+        }
+        if (opt.post) {
+            post_run(ctx.jobs, post_passes, 2);
+        }
+        render_stats_end(&ctx);
+        TRACE_END(frame_start, "frame");
+        frame_ms[i] = now_ms() - t0;
+    }
+    double total = now_ms() - start;
+
+    qsort(frame_ms, opt.frames, sizeof(double), cmp_double);
+    double sum = 0.0;
+    for (int i=0; i < opt.frames; i++) {
+        sum += frame_ms[i];
+    }
+    printf("%s: %d frames at %dx%d, %d triangles, shader %s\n",
+            opt.gen_spec ? opt.gen_spec : opt.obj_path, opt.frames,
+            opt.width, opt.height, obj.nfaces_verts/3, opt.shader);
+    printf("%s ms %.3f\n", opt.gen_spec ? "generate" : "load", load_ms);
+    if (models != NULL) {
+        printf("instances %d, drawn per frame %.1f\n", opt.instances, 
+                (double)instances_drawn/opt.frames);
+    }
+    printf("fps %.2f\n", opt.frames/(total/1000.0));
+    printf("frame ms: mean %.3f min %.3f p50 %.3f p90 %.3f p99 %.3f "
+            "max %.3f\n", sum/opt.frames, frame_ms[0],
+            percentile(frame_ms, opt.frames, 0.5),
+            percentile(frame_ms, opt.frames, 0.9),
+            percentile(frame_ms, opt.frames, 0.99),
+            frame_ms[opt.frames - 1]);
+
+    if (opt.ppm_path != NULL) {
+        write_ppm(opt.ppm_path, output);
+    }
+
+    int failed = 0;
+    double p50 = percentile(frame_ms, opt.frames, 0.5);
+    if (opt.ref_path != NULL) {
+        if (opt.write_refs) {
+            failed |= write_ppm(opt.ref_path, output);
+        } else {
+            failed |= compare_ref(output, &opt);
+        }
+    }
+    if (opt.baseline_path != NULL) {
+        if (opt.write_refs) {
+            FILE *fp = fopen(opt.baseline_path, "w");
+            if (fp != NULL) {
+                fprintf(fp, "p50_ms %.3f\n", p50);
+                fclose(fp);
+            }
+            failed |= (fp == NULL);
+        } else {
+            failed |= compare_baseline(p50, &opt);
+        }
+    }
+
+    if (opt.stats_path != NULL) {
+        FILE *fp = fopen(opt.stats_path, "w");
+        if (fp != NULL) {
+            stats_write_json(fp, &stats, opt.frames);
+            fclose(fp);
+        }
+#ifndef SOFTRAST_STATS
+        printf("Statistics are compiled out, rebuild with STATS=1.\n");
+#endif
+    }
+
+    if (opt.trace_path != NULL) {
+        trace_write_json(opt.trace_path);
+#ifndef SOFTRAST_TRACE
+        printf("Trace markers are compiled out, rebuild with TRACE=1.\n");
+#endif
+    }
+
+    free(frame_ms);
+    free(models);
+    scene_free(&scene);
+    cmdbuf_free(&cb);
+    if (ctx.jobs != NULL) {
+        jobs_free(ctx.jobs);
+    }
+    mesh_clusters_free(&clusters);
+    if (shadow_map.memory != NULL) {
+        buffer_free(&shadow_map);
+    }
+    if (post_buffer.memory != NULL) {
+        buffer_free(&post_buffer);
+    }
+    lights_free(&lights);
+    light_clusters_free(&clusters_lights);
+    for (int i=0; i < ctx.num_buffers; i++) {
+        buffer_free(&buffers[i]);
+    }
+    free_model_data(obj);
+    return failed ? 2 : 0;
+}
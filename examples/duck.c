@@ -1,6 +1,7 @@
 #include <SDL2/SDL.h>
 #include "gl.h"
 #include "obj.h"
+#include "post.h"
 #include "example_shaders.h"
 #include "sdlutil.h"
 
@@ -20,11 +21,10 @@ static Uint32 duck_buf_len;
 // For storing the SDL converted duck.bmp
 static SDL_Surface *diffuse_tex;
 
-// Mesh for duck model and mesh for post process quad.
+// Mesh for duck model.
 static Mesh obj;
-static Mesh screenobj;
 
-// Duck shaders. One for model rendering and one for post process.
+// Duck shader for model rendering.
 typedef struct {
     ShaderBase base;
     SDL_Surface* diffuse_tex;
@@ -40,9 +40,10 @@ int shader_duck_fragment(Vec3f bar, Vec3f *color, void *data) {
     Vec3f normal = m33fv3(sdata->base.varying_vertex_normal, bar);
     Vec3f pos = m33fv3(sdata->base.varying_vertex_post, bar);
 
-    Vec3f L = v3fnormalize(v3fsub(sdata->light_pos,pos));
-    Vec3f E = v3fnormalize(v3fmul(pos, 1.f)); // we are in Eye Coordinates, so EyePos is (0,0,0)  
-    Vec3f R = v3fnormalize(v3fmul(reflect(L,normal), -1.f)); 
+    ShaderBase *base = &sdata->base;
+    Vec3f L = shader_normalize(base, v3fsub(sdata->light_pos,pos));
+    Vec3f E = shader_normalize(base, v3fmul(pos, 1.f)); // we are in Eye Coordinates, so EyePos is (0,0,0)  
+    Vec3f R = shader_normalize(base, v3fmul(reflect(L,normal), -1.f)); 
     
     // Get texture pixel value.
     Vec3f uv = m33fv3(sdata->base.varying_vertex_uv, bar);
@@ -58,7 +59,8 @@ int shader_duck_fragment(Vec3f bar, Vec3f *color, void *data) {
     Vec3f ambient  = sdata->ambient_light;
     Vec3f diffuse  = v3fmul(sdata->light, clamp(v3fdot(normal, L), 0.f, 1.f));
     Vec3f specular = v3fmul(f2v3f(sdata->specular_amount),
-            pow(max(v3fdot(R, E), 0.f),sdata->specular_falloff));
+            shader_pow(base, max(v3fdot(R, E), 0.f),
+                sdata->specular_falloff));
     
     Vec3f rgb = v3femul(texrgb, ambient);
     rgb = v3fadd(rgb, v3femul(texrgb, diffuse));
@@ -69,45 +71,41 @@ int shader_duck_fragment(Vec3f bar, Vec3f *color, void *data) {
 }
 ShaderDuck duck_shader;
 
+// Post process, a full-screen pass tiling the scrolling duck render over
+// the window.
 typedef struct {
-    ShaderBase base;
-    ScreenBuffer* rpass;
     int count;
-    int width;
-    int height;
-} ShaderDuckPost;
-int shader_duckpost_fragment(Vec3f bar, Vec3f *color, void *data) {
-    ShaderDuckPost *sdata = (ShaderDuckPost *)data;
-    Vec3f uv = m33fv3(sdata->base.varying_vertex_uv, bar);
-
-    int rwidth = sdata->rpass->width;
-    int rheight = sdata->rpass->height;
-    int x = sdata->base.frag_coord.e[0];
-    int y = sdata->base.frag_coord.e[1];
-    int rx = rwidth - ((x + sdata->count) % rwidth);
-    int ry = rheight - (( y + sdata->count) % rheight);
-
-    uint32_t *pixel = (uint32_t *)sdata->rpass->memory;
-    uint32_t col = pixel[ rwidth*ry + rx ];
-    float r = (col >> 16 & 0xff)/255.f; 
-    float g = (col >> 8 & 0xff)/255.f;
-    float b = (col & 0xff)/255.f;
-    
-    Vec3f rgb = {{r, g, b}};
-    v3fset(color, rgb);
-
-    return 0;
+} DuckPost;
+static void duckpost_kernel(const PostPass *pass, int y0, int y1) {
+    const DuckPost *post = pass->data;
+    const ScreenBuffer *rpass = pass->src;
+    int rwidth = rpass->width;
+    int rheight = rpass->height;
+    pixel_format format = pass->dst->format;
+    for (int y=y0; y < y1; y++) {
+        // Scroll with y counted from the bottom, post_row() counts from the
+        // top.
+        int fy = pass->dst->height - 1 - y;
+        const uint32_t *in = post_row(rpass,
+                rheight - 1 - (fy + post->count) % rheight);
+        uint32_t *out = post_row(pass->dst, y);
+        int rx = rwidth - 1 - post->count % rwidth;
+        for (int x=0; x < pass->dst->width; x++) {
+            uint32_t col = in[rx];
+            out[x] = pack_color(format, col >> 16 & 0xff, col >> 8 & 0xff,
+                    col & 0xff, 0);
+            rx = rx > 0 ? rx - 1 : rwidth - 1;
+        }
+    }
 }
-ShaderDuckPost duckpost_shader;
+DuckPost duckpost;
 
 
 // Render function, called from loop in main.
 void render(RenderContext* ctx, int count) {
     // Clear main buffer to black.
-    memset(ctx->buffers[0].memory, 0, ctx->buffers[0].height*ctx->buffers[0].width*(sizeof(uint32_t)));
-    memset(ctx->buffers[1].memory, 0, ctx->buffers[1].height*ctx->buffers[1].width*(sizeof(int)));
-    memset(ctx->buffers[2].memory, 0, ctx->buffers[2].height*ctx->buffers[2].width*(sizeof(uint32_t)));
-    memset(ctx->buffers[3].memory, 0, ctx->buffers[3].height*ctx->buffers[3].width*(sizeof(int)));
+    memset(ctx->buffers[0].memory, 0, ctx->buffers[0].height*ctx->buffers[0].pitch);
+    memset(ctx->buffers[1].memory, 0, ctx->buffers[1].height*ctx->buffers[1].pitch);
 
     // Render duck
     uint32_t *pixels = (uint32_t *)ctx->buffers[0].memory;
@@ -142,10 +140,11 @@ void render(RenderContext* ctx, int count) {
     ctx->shader = (ShaderBase *)&duck_shader;
     draw_model(obj, ctx, &ctx->buffers[0], &ctx->buffers[1]);
     
-    // Post process
-    duckpost_shader.count = count;
-    ctx->shader = (ShaderBase *)&duckpost_shader;
-    draw_model(screenobj, ctx, &ctx->buffers[2], &ctx->buffers[3]);
+    // Post process, writes every pixel of the window.
+    duckpost.count = count;
+    PostPass pass = {duckpost_kernel, &ctx->buffers[0], &ctx->buffers[2],
+        &duckpost, 0};
+    post_run(ctx->jobs, &pass, 1);
 }
 
 
@@ -309,10 +308,18 @@ int main(int argc, char **argv) {
     SDL_Renderer *renderer;
     sdl_init(SCREEN_WIDTH, SCREEN_HEIGHT, "duck", &renderer);
 
-    RenderContext ctx;
-    ScreenBuffer buffers[4];
+    RenderContext ctx = {0};
+    ScreenBuffer buffers[3] = {{0}};
     ctx.buffers = buffers;
 
+    // Runs the vertex stage and the post process rows on all CPUs.
+    JobPool pool;
+    if (jobs_init(&pool, 0, 0) != 0) {
+        printf("Error: Could not start the job pool threads.\n");
+        return 1;
+    }
+    ctx.jobs = &pool;
+
     // RGBA for rendering duck model.
     buffers[0].type = BUF_RGBA;
     buffers[0].depth = sizeof(uint32_t);
@@ -324,77 +331,21 @@ int main(int argc, char **argv) {
 
     // Z for rendering duck model.
     buffers[1].type = BUF_Z;
-    buffers[1].depth = sizeof(int);
+    buffers[1].depth = buffer_type_depth(buffers[1].type);
     buffers[1].width = 200;
     buffers[1].height = 200;
     buffers[1].pitch = 200*buffers[1].depth;
     buffers[1].memory = malloc(200*200*buffers[1].depth);
     ctx.num_buffers++;
     
-    // RGBA for rendering post process quad.
+    // RGBA for the post process pass. Memory is the locked window texture,
+    // set each frame.
     buffers[2].type = BUF_RGBA;
     buffers[2].depth = sizeof(uint32_t);
     buffers[2].width = SCREEN_WIDTH;
     buffers[2].height = SCREEN_HEIGHT;
-    buffers[2].pitch = SCREEN_WIDTH*buffers[2].depth;
-    buffers[2].memory = malloc(SCREEN_WIDTH*SCREEN_HEIGHT*buffers[2].depth);
     ctx.num_buffers++;
     
-    // Z for rendering post process quad.
-    buffers[3].type = BUF_Z;
-    buffers[3].depth = sizeof(int);
-    buffers[3].width = SCREEN_WIDTH;
-    buffers[3].height = SCREEN_HEIGHT;
-    buffers[3].pitch = SCREEN_WIDTH*buffers[3].depth;
-    buffers[3].memory = malloc(SCREEN_WIDTH*SCREEN_HEIGHT*buffers[3].depth);
-    ctx.num_buffers++;
-
-
-    // Make screen geometry
-    float verts[] = {
-        -1.0f, -1.0f, 0.f,
-        -1.f, 1.0f, 0.f,
-        1.0f, -1.0f, 0.f,
-        
-        1.0f, -1.0f, 0.f,
-        -1.0f, 1.0f, 0.f,
-        1.0f, 1.0f, 0.f,
-    };
-    screenobj.verts = verts;
-
-    float uvs[] = {
-        0.f, 1.f, 0.f,
-        0.f, 0.f, 0.f,
-        1.f, 1.f, 0.f,
-        
-        1.f, 1.f, 0.f,
-        0.f, 0.f, 0.f,
-        1.f, 0.f, 0.f,
-    };
-    screenobj.uvs = uvs;
-    
-    float normals[] = {
-        0.f, 0.f, 0.f,
-        0.f, 0.f, 0.f,
-        0.f, 0.f, 0.f,
-        0.f, 0.f, 0.f,
-        0.f, 0.f, 0.f,
-        0.f, 0.f, 0.f
-    };
-    screenobj.normals = normals;
-    
-    int faces_verts[] = {
-        0, 1, 2,
-        3, 4, 5,
-    };
-    screenobj.faces_verts = faces_verts;
-    screenobj.faces_uvs = faces_verts;
-    screenobj.faces_normals = faces_verts;
-    screenobj.nverts = 6;
-    screenobj.nuvs = 6;
-    screenobj.nnormals = 6;
-    screenobj.nfaces_verts = 6;
-
     // Load obj file
     FILE *fp = fmemopen(res_duckpoly_obj, res_duckpoly_obj_len, "r");
     if (load_obj_mem(fp, &obj) != 0) {
@@ -409,6 +360,7 @@ int main(int argc, char **argv) {
     
     // Setup shaders
     duck_shader.base.vertex_shader = &shader_phong_vertex;
+    duck_shader.base.vertex_shader_batch = &shader_phong_vertex_batch;
     duck_shader.base.fragment_shader = &shader_duck_fragment;
     duck_shader.diffuse_tex = diffuse_tex;
 
@@ -422,25 +374,6 @@ int main(int argc, char **argv) {
     m44fsetel(&duck_shader.base.viewport, 0, 3, buffers[0].width/2);
     m44fsetel(&duck_shader.base.viewport, 1, 3, buffers[0].height/2);
 
-    duckpost_shader.base.vertex_shader = &shader_uv_vertex;
-    duckpost_shader.base.fragment_shader = &shader_duckpost_fragment;
-    duckpost_shader.rpass = &buffers[0];
-    duckpost_shader.width = buffers[2].width;
-    duckpost_shader.height = buffers[2].height;
-    m44fset(&duckpost_shader.base.mvp, m44fident());
-    m44fset(&duckpost_shader.base.modelview, m44fident());
-    m44fset(&duckpost_shader.base.projection, m44fident());
-
-    m44fset(&duckpost_shader.base.viewport, m44fident());
-    m44fsetel(&duckpost_shader.base.viewport, 0, 0, buffers[2].width/2);
-    m44fsetel(&duckpost_shader.base.viewport, 1, 1, buffers[2].height/2);
-    m44fsetel(&duckpost_shader.base.viewport, 2, 2, 0.f);
-    m44fsetel(&duckpost_shader.base.viewport, 0, 3, buffers[2].width/2);
-    m44fsetel(&duckpost_shader.base.viewport, 1, 3, buffers[2].height/2);
-
-    duckpost_shader.base.mvp = m44fm44f(duckpost_shader.base.projection, duckpost_shader.base.modelview);
-    
-
     // Start Audio
     sdl_start_audio(audio_callback);
     SDL_RWops *src = SDL_RWFromConstMem(res_duck_wav, res_duck_wav_len);
@@ -460,14 +393,16 @@ int main(int argc, char **argv) {
     int running = 1;
     int count = 0;
     while(running) {
-        //Render video
+        //Render video directly into the window texture.
+        if (sdl_lock_window_buffer(&ctx.buffers[2]) != 0) {
+            break;
+        }
         render(&ctx, count++);
-        uint32_t *pixel = (uint32_t *)ctx.buffers[2].memory;
-        
-        sdl_copy_rgb_to_window_buffer(pixel, renderer);
+        sdl_present_window_buffer(&ctx.buffers[2], renderer);
 
         running = (sdl_is_escape_pressed() == 0);
     }
+    jobs_free(&pool);
     
     //for (int i=0; i < ctx.num_buffers; i++) {
     //    free(ctx.buffers[i].memory);
@@ -13,10 +13,9 @@ ShaderPhong phong_shader;
 // Render function, called from loop in main.
 void render(RenderContext* ctx, int count) {
     // Clear main buffer to black.
-    memset(ctx->buffers[0].memory, 0, ctx->buffers[0].height*ctx->buffers[0].width*(sizeof(uint32_t)));
-    memset(ctx->buffers[1].memory, 0, ctx->buffers[1].height*ctx->buffers[1].width*(sizeof(int)));
+    memset(ctx->buffers[0].memory, 0, ctx->buffers[0].height*ctx->buffers[0].pitch);
+    memset(ctx->buffers[1].memory, 0, ctx->buffers[1].height*ctx->buffers[1].pitch);
     
-    uint32_t *pixels = (uint32_t *)ctx->buffers[0].memory;
     float t = 0.008f*count;
 
     // Set Projection and view
@@ -57,26 +56,37 @@ void render(RenderContext* ctx, int count) {
     draw_model(obj, ctx, &ctx->buffers[0], &ctx->buffers[1]);
 }
 
+// Called on the render thread of the frame pipeline.
+static void render_frame(ScreenBuffer *buffers, int frame, void *userdata) {
+    RenderContext *ctx = (RenderContext *)userdata;
+    ctx->buffers = buffers;
+    ctx->num_buffers = 2;
+    render(ctx, frame);
+}
 
+// Usage: objpreview file.obj [frames in flight]
+// With 1 frame in flight, the default, each frame is rendered straight into
+// the window texture and presented before the next starts. With 2 or more
+// rendering runs on its own thread, overlapping presentation, at the cost of
+// copying every frame into the texture.
 int main(int argc, char **argv) {
     SDL_Renderer *renderer;
     sdl_init(SCREEN_WIDTH, SCREEN_HEIGHT, "softrast OBJ preview", &renderer);
 
     // Make custom buffer to interface with program.
-    RenderContext ctx;
-    ScreenBuffer buffers[2];
+    RenderContext ctx = {0};
+    ScreenBuffer buffers[2] = {{0}};
     ctx.buffers = buffers;
 
+    // Color buffer memory is the locked window texture, set each frame.
     buffers[0].type = BUF_RGBA;
     buffers[0].depth = sizeof(uint32_t);
     buffers[0].width = SCREEN_WIDTH;
     buffers[0].height = SCREEN_HEIGHT;
-    buffers[0].pitch = SCREEN_WIDTH*buffers[0].depth;
-    buffers[0].memory = malloc(SCREEN_WIDTH*SCREEN_HEIGHT*buffers[0].depth);
     ctx.num_buffers++;
 
     buffers[1].type = BUF_Z;
-    buffers[1].depth = sizeof(int);
+    buffers[1].depth = buffer_type_depth(buffers[1].type);
     buffers[1].width = SCREEN_WIDTH;
     buffers[1].height = SCREEN_HEIGHT;
     buffers[1].pitch = SCREEN_WIDTH*buffers[1].depth;
@@ -92,6 +102,7 @@ int main(int argc, char **argv) {
 
     // Setup shaders
     phong_shader.base.vertex_shader = &shader_phong_vertex;
+    phong_shader.base.vertex_shader_batch = &shader_phong_vertex_batch;
     phong_shader.base.fragment_shader = &shader_phong_fragment;
     
     m44fset(&phong_shader.base.viewport, m44fident());
@@ -101,17 +112,36 @@ int main(int argc, char **argv) {
     m44fsetel(&phong_shader.base.viewport, 0, 3, buffers[0].width/2);
     m44fsetel(&phong_shader.base.viewport, 1, 3, buffers[0].height/2);
 
-    // Main display
-    int running = 1;
-    int count = 0;
-    while(running) {
-        //Render video
-        render(&ctx, count++);
-        uint32_t *pixel = (uint32_t *)ctx.buffers[0].memory;
-        
-        sdl_copy_rgb_to_window_buffer(pixel, renderer);
-
-        running = (sdl_is_escape_pressed() == 0);
+    int frames_in_flight = (argc > 2) ? atoi(argv[2]) : 1;
+    if (frames_in_flight > 1) {
+        // Pipelined display
+        RenderContext render_ctx = ctx;
+        FramePipeline pipeline;
+        if (frame_pipeline_start(&pipeline, frames_in_flight, SCREEN_WIDTH,
+                    SCREEN_HEIGHT, buffers[1].type, render_frame, 
+                    &render_ctx) != 0) {
+            return 1;
+        }
+        int running = 1;
+        while(running) {
+            frame_pipeline_present(&pipeline, renderer);
+            running = (sdl_is_escape_pressed() == 0);
+        }
+        frame_pipeline_stop(&pipeline);
+    } else {
+        // Main display
+        int running = 1;
+        int count = 0;
+        while(running) {
+            //Render video directly into the window texture.
+            if (sdl_lock_window_buffer(&ctx.buffers[0]) != 0) {
+                break;
+            }
+            render(&ctx, count++);
+            sdl_present_window_buffer(&ctx.buffers[0], renderer);
+
+            running = (sdl_is_escape_pressed() == 0);
+        }
     }
     
     for (int i=0; i < ctx.num_buffers; i++) {
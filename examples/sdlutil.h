@@ -1,6 +1,7 @@
 #pragma once
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_audio.h>
+#include "trace.h"
 
 // Helper for setting up window and SDL.
 
@@ -91,6 +92,270 @@ void sdl_copy_rgb_to_window_buffer(uint32_t* read_pixel, SDL_Renderer *renderer)
 
 }
 
+// Zero-copy present path. Locks the streaming window texture and points the
+// given BUF_RGBA buffer at its memory, with the texture pitch and native 
+// channel order, so the rasterizer writes straight into the texture.
+// The locked memory is write-only and undefined, clear it before rendering.
+int sdl_lock_window_buffer(ScreenBuffer *buffer) {
+    Uint32 sdl_format;
+    SDL_QueryTexture(window_buffer_tex, &sdl_format, 0,
+            &buffer->width, &buffer->height);
+    switch (sdl_format) {
+        case SDL_PIXELFORMAT_ABGR8888: buffer->format = PIXEL_ABGR8888; break;
+        case SDL_PIXELFORMAT_RGBA8888: buffer->format = PIXEL_RGBA8888; break;
+        case SDL_PIXELFORMAT_BGRA8888: buffer->format = PIXEL_BGRA8888; break;
+        default:                       buffer->format = PIXEL_ARGB8888; break;
+    }
+    buffer->type = BUF_RGBA;
+    buffer->depth = sizeof(uint32_t);
+
+    if (SDL_LockTexture(window_buffer_tex, 0, &buffer->memory,
+                &buffer->pitch) != 0) {
+        SDL_Log("Failed to lock window texture: %s", SDL_GetError());
+        return 1;
+    }
+    return 0;
+}
+
+// Unlocks the window texture filled through sdl_lock_window_buffer and 
+// presents it.
+void sdl_present_window_buffer(ScreenBuffer *buffer, SDL_Renderer *renderer) {
+    TRACE_BEGIN(trace_present);
+    SDL_UnlockTexture(window_buffer_tex);
+    buffer->memory = 0;
+    SDL_RenderCopy(renderer, window_buffer_tex, 0, 0);
+    SDL_RenderPresent(renderer);
+    TRACE_END(trace_present, "present");
+}
+
+// Frame pipeline. A render thread fills one of several rotating color/depth
+// buffer sets while the main thread presents the previous one, so rendering
+// of frame N+1 overlaps the upload and vsync wait of frame N. SDL requires
+// the renderer to be used from the thread that created it, so presentation
+// stays on the main thread and rendering moves to the dedicated thread.
+// The texture can't be locked from the render thread, so unlike
+// sdl_lock_window_buffer() every frame is copied into it on present.
+#define SDL_MAX_FRAMES 4
+
+typedef struct {
+    int slots[SDL_MAX_FRAMES];
+    int head;
+    int count;
+} FrameQueue;
+
+typedef struct {
+    ScreenBuffer buffers[2]; // color, depth
+    int frame;
+    Uint64 render_start;
+    Uint64 render_end;
+} FrameSlot;
+
+typedef struct {
+    FrameSlot slots[SDL_MAX_FRAMES];
+    int nslots;
+    FrameQueue free;    // slots ready to be rendered into
+    FrameQueue ready;   // rendered slots waiting to be presented
+    SDL_mutex *lock;
+    SDL_cond *cond;
+    SDL_Thread *thread;
+    int running;
+    int frame;
+
+    void (*render)(ScreenBuffer *buffers, int frame, void *userdata);
+    void *userdata;
+
+    // Frame pacing stats, in ms, reset every report.
+    int stat_frames;
+    double stat_render_sum, stat_render_max;
+    double stat_wait_sum, stat_wait_max;
+    double stat_interval_sum, stat_interval_max;
+    Uint64 last_present;
+} FramePipeline;
+
+static void frame_queue_push(FrameQueue *q, int slot) {
+    q->slots[(q->head + q->count) % SDL_MAX_FRAMES] = slot;
+    q->count++;
+}
+
+static int frame_queue_pop(FrameQueue *q) {
+    int slot = q->slots[q->head];
+    q->head = (q->head + 1) % SDL_MAX_FRAMES;
+    q->count--;
+    return slot;
+}
+
+// Blocks until a slot is available in the queue. Returns -1 when the 
+// pipeline is stopped.
+static int frame_pipeline_take(FramePipeline *p, FrameQueue *q) {
+    int slot = -1;
+    SDL_LockMutex(p->lock);
+    while (p->running && q->count == 0) {
+        SDL_CondWait(p->cond, p->lock);
+    }
+    if (p->running) {
+        slot = frame_queue_pop(q);
+    }
+    SDL_UnlockMutex(p->lock);
+    return slot;
+}
+
+static void frame_pipeline_give(FramePipeline *p, FrameQueue *q, int slot) {
+    SDL_LockMutex(p->lock);
+    frame_queue_push(q, slot);
+    SDL_CondBroadcast(p->cond);
+    SDL_UnlockMutex(p->lock);
+}
+
+static double sdl_ticks_to_ms(Uint64 ticks) {
+    return 1000.0*ticks/(double)SDL_GetPerformanceFrequency();
+}
+
+static int frame_pipeline_thread(void *data) {
+    FramePipeline *p = (FramePipeline *)data;
+    while (1) {
+        int i = frame_pipeline_take(p, &p->free);
+        if (i < 0) {
+            break;
+        }
+        FrameSlot *slot = &p->slots[i];
+        slot->frame = p->frame++;
+        TRACE_BEGIN(render_start);
+        slot->render_start = SDL_GetPerformanceCounter();
+        p->render(slot->buffers, slot->frame, p->userdata);
+        slot->render_end = SDL_GetPerformanceCounter();
+        TRACE_END(render_start, "render");
+        frame_pipeline_give(p, &p->ready, i);
+    }
+    return 0;
+}
+
+// Frees the buffer sets, mutex and condition of a pipeline whose render
+// thread is not running. Missing ones are skipped.
+static void frame_pipeline_free(FramePipeline *p) {
+    for (int i=0; i < p->nslots; i++) {
+        free(p->slots[i].buffers[0].memory);
+        free(p->slots[i].buffers[1].memory);
+    }
+    SDL_DestroyCond(p->cond);
+    SDL_DestroyMutex(p->lock);
+}
+
+// Allocates nslots color/depth buffer sets in the window texture format and
+// starts the render thread. render is called on that thread with the buffer
+// set to fill. Returns 1 and frees everything if any of it fails.
+int frame_pipeline_start(FramePipeline *p, int nslots, int width, int height,
+        buffer_type depth_type,
+        void (*render)(ScreenBuffer *buffers, int frame, void *userdata),
+        void *userdata) {
+    memset(p, 0, sizeof(*p));
+    p->nslots = MIN(MAX(nslots, 2), SDL_MAX_FRAMES);
+    p->render = render;
+    p->userdata = userdata;
+
+    for (int i=0; i < p->nslots; i++) {
+        ScreenBuffer *color = &p->slots[i].buffers[0];
+        color->type = BUF_RGBA;
+        color->format = PIXEL_ARGB8888; // matches window_buffer_tex
+        color->depth = sizeof(uint32_t);
+        color->width = width;
+        color->height = height;
+        color->pitch = width*color->depth;
+        color->memory = malloc(height*color->pitch);
+
+        ScreenBuffer *z = &p->slots[i].buffers[1];
+        z->type = depth_type;
+        z->depth = buffer_type_depth(depth_type);
+        z->width = width;
+        z->height = height;
+        z->pitch = width*z->depth;
+        z->memory = malloc(height*z->pitch);
+
+        if (color->memory == NULL || z->memory == NULL) {
+            SDL_Log("Failed to allocate frame buffers");
+            frame_pipeline_free(p);
+            return 1;
+        }
+        frame_queue_push(&p->free, i);
+    }
+
+    p->lock = SDL_CreateMutex();
+    p->cond = SDL_CreateCond();
+    if (p->lock == NULL || p->cond == NULL) {
+        SDL_Log("Failed to create frame pipeline lock: %s", SDL_GetError());
+        frame_pipeline_free(p);
+        return 1;
+    }
+    p->running = 1;
+    p->thread = SDL_CreateThread(frame_pipeline_thread, "render", p);
+    if (p->thread == NULL) {
+        SDL_Log("Failed to start render thread: %s", SDL_GetError());
+        frame_pipeline_free(p);
+        return 1;
+    }
+    return 0;
+}
+
+// Presents the oldest rendered frame, blocking until one is available, and
+// hands its buffers back to the render thread. Call from the main thread.
+void frame_pipeline_present(FramePipeline *p, SDL_Renderer *renderer) {
+    TRACE_BEGIN(trace_wait);
+    Uint64 wait_start = SDL_GetPerformanceCounter();
+    int i = frame_pipeline_take(p, &p->ready);
+    if (i < 0) {
+        return;
+    }
+    Uint64 wait_end = SDL_GetPerformanceCounter();
+    TRACE_END(trace_wait, "present wait");
+
+    TRACE_BEGIN(trace_present);
+    FrameSlot *slot = &p->slots[i];
+    SDL_UpdateTexture(window_buffer_tex, 0, slot->buffers[0].memory,
+            slot->buffers[0].pitch);
+    // The render thread rewrites the slot once it is given back.
+    double render_ms = sdl_ticks_to_ms(slot->render_end - slot->render_start);
+    frame_pipeline_give(p, &p->free, i);
+    SDL_RenderCopy(renderer, window_buffer_tex, 0, 0);
+    SDL_RenderPresent(renderer);
+    TRACE_END(trace_present, "present");
+
+    // Frame pacing stats.
+    Uint64 now = SDL_GetPerformanceCounter();
+    double wait_ms = sdl_ticks_to_ms(wait_end - wait_start);
+    double interval_ms = p->last_present ?
+        sdl_ticks_to_ms(now - p->last_present) : 0.0;
+    p->last_present = now;
+    p->stat_frames++;
+    p->stat_render_sum += render_ms;
+    p->stat_render_max = MAX(p->stat_render_max, render_ms);
+    p->stat_wait_sum += wait_ms;
+    p->stat_wait_max = MAX(p->stat_wait_max, wait_ms);
+    p->stat_interval_sum += interval_ms;
+    p->stat_interval_max = MAX(p->stat_interval_max, interval_ms);
+
+    if (p->stat_frames == 120) {
+        printf("frames %d: interval avg %.2f max %.2f ms, "
+                "render avg %.2f max %.2f ms, "
+                "present wait avg %.2f max %.2f ms\n", p->stat_frames,
+                p->stat_interval_sum/p->stat_frames, p->stat_interval_max,
+                p->stat_render_sum/p->stat_frames, p->stat_render_max,
+                p->stat_wait_sum/p->stat_frames, p->stat_wait_max);
+        p->stat_frames = 0;
+        p->stat_render_sum = p->stat_render_max = 0.0;
+        p->stat_wait_sum = p->stat_wait_max = 0.0;
+        p->stat_interval_sum = p->stat_interval_max = 0.0;
+    }
+}
+
+// Stops the render thread and frees the buffer sets.
+void frame_pipeline_stop(FramePipeline *p) {
+    SDL_LockMutex(p->lock);
+    p->running = 0;
+    SDL_CondBroadcast(p->cond);
+    SDL_UnlockMutex(p->lock);
+    SDL_WaitThread(p->thread, NULL);
+    frame_pipeline_free(p);
+}
+
 inline static int sdl_is_escape_pressed() {
     SDL_Event event;
     while (SDL_PollEvent(&event)) {
@@ -0,0 +1,380 @@
+#include "cmdbuf.h"
+#include "trace.h"
+
+// Alignment of shader copies, enough for the aligned matrices in them.
+#define STATE_ALIGN 16
+
+static inline size_t align_up(size_t size) {
+    return (size + STATE_ALIGN - 1) & ~(size_t)(STATE_ALIGN - 1);
+}
+
+void cmdbuf_init(CommandBuffer *cb) {
+    memset(cb, 0, sizeof(*cb));
+}
+
+void cmdbuf_free(CommandBuffer *cb) {
+    free(cb->commands);
+    free(cb->arena);
+    free(cb->uniforms);
+    memset(cb, 0, sizeof(*cb));
+}
+
+void cmdbuf_reset(CommandBuffer *cb) {
+    cb->count = 0;
+    cb->arena_used = 0;
+    // The snapshot went with the arena.
+    cb->dirty = 1;
+}
+
+// Reserves size bytes in the arena. Returns the offset, or -1 if allocation
+// failed.
+static size_t arena_alloc(CommandBuffer *cb, size_t size) {
+    size_t offset = align_up(cb->arena_used);
+    if (offset + size > cb->arena_size) {
+        size_t arena_size = cb->arena_size ? 2*cb->arena_size : 4096;
+        while (arena_size < offset + size) {
+            arena_size *= 2;
+        }
+        // realloc doesn't keep the alignment.
+        char *arena = aligned_alloc(STATE_ALIGN, arena_size);
+        if (arena == NULL) {
+            return (size_t)-1;
+        }
+        if (cb->arena != NULL) {
+            memcpy(arena, cb->arena, cb->arena_used);
+        }
+        free(cb->arena);
+        cb->arena = arena;
+        cb->arena_size = arena_size;
+    }
+    cb->arena_used = offset + size;
+    return offset;
+}
+
+static Command *push_command(CommandBuffer *cb, CommandType type,
+        ScreenBuffer *rgba, ScreenBuffer *z) {
+    if (cb->count == cb->size) {
+        int size = cb->size ? 2*cb->size : 256;
+        Command *commands = realloc(cb->commands, size*sizeof(Command));
+        if (commands == NULL) {
+            return NULL;
+        }
+        cb->commands = commands;
+        cb->size = size;
+    }
+    Command *cmd = &cb->commands[cb->count];
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->type = type;
+    cmd->rgba = rgba;
+    cmd->z = z;
+    cmd->seq = cb->count++;
+    return cmd;
+}
+
+void cmdbuf_clear(CommandBuffer *cb, ScreenBuffer *rgba, ScreenBuffer *z) {
+    push_command(cb, CMD_CLEAR, rgba, z);
+}
+
+void *cmdbuf_set_shader(CommandBuffer *cb, ShaderBase *shader, size_t size) {
+    if (size > cb->uniforms_size) {
+        ShaderBase *uniforms = aligned_alloc(STATE_ALIGN, align_up(size));
+        if (uniforms == NULL) {
+            return NULL;
+        }
+        free(cb->uniforms);
+        cb->uniforms = uniforms;
+        cb->uniforms_size = align_up(size);
+    }
+    memcpy(cb->uniforms, shader, size);
+    cb->shader = shader;
+    cb->shader_size = size;
+    cb->dirty = 1;
+    return cb->uniforms;
+}
+
+void *cmdbuf_uniforms(CommandBuffer *cb) {
+    cb->dirty = 1;
+    return cb->uniforms;
+}
+
+void cmdbuf_set_transform(CommandBuffer *cb, Mat44f modelview) {
+    ShaderBase *uniforms = cb->uniforms;
+    if (uniforms == NULL) {
+        return;
+    }
+    uniforms->modelview = modelview;
+    uniforms->mvp = m44fm44f(uniforms->projection, modelview);
+    cb->dirty = 1;
+}
+
+int cmdbuf_draw(CommandBuffer *cb, const Mesh *mesh, ScreenBuffer *rgba,
+        ScreenBuffer *z) {
+    if (cb->uniforms == NULL || rgba == NULL) {
+        return 1;
+    }
+    if (cb->dirty) {
+        size_t state = arena_alloc(cb, cb->shader_size);
+        if (state == (size_t)-1) {
+            return 1;
+        }
+        memcpy(cb->arena + state, cb->uniforms, cb->shader_size);
+        cb->state = state;
+        cb->dirty = 0;
+    }
+
+    Command *cmd = push_command(cb, CMD_DRAW, rgba, z);
+    if (cmd == NULL) {
+        return 1;
+    }
+    cmd->mesh = mesh;
+    cmd->shader = cb->shader;
+    cmd->state = cb->state;
+    cmd->state_size = cb->shader_size;
+    return 0;
+}
+
+// A command of a submit with its sort keys.
+typedef struct {
+    const Command *cmd;
+    const char *state;      // shader snapshot
+    int target;             // rank of first use
+    int segment;            // clears of the target before the command
+    int shader;
+    int buffer;             // index of the command buffer
+} SubmitCommand;
+
+typedef struct {
+    SubmitCommand *commands;
+    int count;
+    int nbands;
+    RenderContext *ctx;
+} Submit;
+
+static int compare_commands(const void *pa, const void *pb) {
+    const SubmitCommand *a = pa, *b = pb;
+    if (a->target != b->target) return a->target - b->target;
+    if (a->segment != b->segment) return a->segment - b->segment;
+    if (a->cmd->type != b->cmd->type) return (a->cmd->type == CMD_DRAW) -
+        (b->cmd->type == CMD_DRAW);
+    if (a->shader != b->shader) return a->shader - b->shader;
+    if (a->buffer != b->buffer) return a->buffer - b->buffer;
+    return a->cmd->seq - b->cmd->seq;
+}
+
+// Copy of the shader being executed, per thread since draws write the
+// varyings into it.
+static _Thread_local ShaderBase *exec_shader;
+static _Thread_local size_t exec_shader_size;
+
+// Frees exec_shader, run on pool workers as they exit.
+static void cmdbuf_thread_cleanup(void) {
+    free(exec_shader);
+    exec_shader = NULL;
+    exec_shader_size = 0;
+}
+
+// Rows of band out of nbands for a buffer.
+static inline void band_rows(const ScreenBuffer *buffer, int band, int nbands,
+        int *y0, int *y1) {
+    *y0 = (int)((long)buffer->height*band/nbands);
+    *y1 = (int)((long)buffer->height*(band + 1)/nbands) - 1;
+}
+
+static void execute_band(void *arg, int band) {
+    Submit *submit = arg;
+    TRACE_BEGIN(band_start);
+    RenderContext ctx = *submit->ctx;
+    ctx.scissor = 1;
+    // Bands already use every thread, and draws must not wait for jobs
+    // from inside a job.
+    ctx.draw_strategy = DRAW_IMMEDIATE;
+    ctx.jobs = NULL;
+    const char *current = NULL;
+
+    for (int i=0; i < submit->count; i++) {
+        const Command *cmd = submit->commands[i].cmd;
+        int y0, y1;
+        if (cmd->type == CMD_CLEAR) {
+            ScreenBuffer *buffers[2] = {cmd->rgba, cmd->z};
+            for (int j=0; j < 2; j++) {
+                if (buffers[j] == NULL) {
+                    continue;
+                }
+                band_rows(buffers[j], band, submit->nbands, &y0, &y1);
+                if (y0 <= y1) {
+                    buffer_clear_rows(buffers[j], y0, y1);
+                }
+            }
+            continue;
+        }
+
+        band_rows(cmd->rgba, band, submit->nbands, &y0, &y1);
+        if (y0 > y1) {
+            continue;
+        }
+        const char *state = submit->commands[i].state;
+        if (state != current) {
+            if (cmd->state_size > exec_shader_size) {
+                ShaderBase *shader = aligned_alloc(STATE_ALIGN,
+                        align_up(cmd->state_size));
+                if (shader == NULL) {
+                    continue;
+                }
+                free(exec_shader);
+                exec_shader = shader;
+                exec_shader_size = align_up(cmd->state_size);
+                jobs_thread_cleanup(cmdbuf_thread_cleanup);
+            }
+            memcpy(exec_shader, state, cmd->state_size);
+            current = state;
+        }
+        ctx.shader = exec_shader;
+        ctx.scissor_min.e[0] = 0;
+        ctx.scissor_min.e[1] = y0;
+        ctx.scissor_max.e[0] = cmd->rgba->width - 1;
+        ctx.scissor_max.e[1] = y1;
+        draw_model(*cmd->mesh, &ctx, cmd->rgba, cmd->z);
+    }
+    TRACE_END(band_start, "command band");
+}
+
+// Rank of key in the table of first uses, adding it when new. Returns -1 if
+// allocation failed.
+static int first_use(const void ***table, int *count, const void *key) {
+    for (int i=0; i < *count; i++) {
+        if ((*table)[i] == key) {
+            return i;
+        }
+    }
+    const void **grown = realloc(*table, (*count + 1)*sizeof(void *));
+    if (grown == NULL) {
+        return -1;
+    }
+    *table = grown;
+    grown[*count] = key;
+    return (*count)++;
+}
+
+// Clears of each buffer so far, in recording order.
+typedef struct {
+    const void **buffers;
+    int *clears;
+    int count;
+} ClearCounts;
+
+// Counter of buffer, NULL for a NULL buffer or if allocation failed. Valid
+// until the next call.
+static int *clear_count(ClearCounts *counts, const void *buffer) {
+    if (buffer == NULL) {
+        return NULL;
+    }
+    int count = counts->count;
+    int i = first_use(&counts->buffers, &counts->count, buffer);
+    if (i < 0) {
+        return NULL;
+    }
+    if (counts->count > count) {
+        int *clears = realloc(counts->clears, counts->count*sizeof(int));
+        if (clears == NULL) {
+            counts->count--;
+            return NULL;
+        }
+        counts->clears = clears;
+        clears[i] = 0;
+    }
+    return &counts->clears[i];
+}
+
+// Color buffer of the first draw into depth buffer z, or NULL.
+static const void *depth_owner(CommandBuffer **buffers, int n,
+        const ScreenBuffer *z) {
+    for (int i=0; i < n; i++) {
+        for (int j=0; j < buffers[i]->count; j++) {
+            const Command *cmd = &buffers[i]->commands[j];
+            if (cmd->type == CMD_DRAW && cmd->z == z) {
+                return cmd->rgba;
+            }
+        }
+    }
+    return NULL;
+}
+
+int cmdbuf_submit(JobPool *jobs, CommandBuffer **buffers, int n,
+        RenderContext *ctx) {
+    TRACE_BEGIN(sort_start);
+    int total = 0;
+    for (int i=0; i < n; i++) {
+        total += buffers[i]->count;
+    }
+    SubmitCommand *commands = malloc(MAX(total, 1)*sizeof(SubmitCommand));
+    // Targets are told apart by their color buffer. Depth only clears go
+    // with the draws into their depth buffer, or by the depth buffer
+    // without any.
+    const void **targets = NULL, **shaders = NULL;
+    int ntargets = 0, nshaders = 0;
+    ClearCounts counts = {0};
+    if (commands == NULL) {
+        return 1;
+    }
+
+    int k = 0, failed = 0;
+    for (int i=0; i < n; i++) {
+        const CommandBuffer *cb = buffers[i];
+        for (int j=0; j < cb->count; j++) {
+            const Command *cmd = &cb->commands[j];
+            SubmitCommand *sc = &commands[k++];
+            sc->cmd = cmd;
+            sc->state = cb->arena + cmd->state;
+            sc->buffer = i;
+            const void *target = cmd->rgba;
+            if (target == NULL) {
+                target = depth_owner(buffers, n, cmd->z);
+            }
+            sc->target = first_use(&targets, &ntargets,
+                    target ? target : (void *)cmd->z);
+            sc->shader = first_use(&shaders, &nshaders, cmd->shader);
+            failed |= (sc->target < 0 || sc->shader < 0);
+
+            // A clear starts a new segment of the target, so draws recorded
+            // before and after it stay on their side of it.
+            const void *used[2] = {target, cmd->z};
+            sc->segment = 0;
+            for (int u=0; u < 2; u++) {
+                int *clears = clear_count(&counts, used[u]);
+                if (clears != NULL) {
+                    *clears += (cmd->type == CMD_CLEAR &&
+                            (u == 1 || cmd->rgba != NULL));
+                    sc->segment += *clears;
+                } else {
+                    failed |= (used[u] != NULL);
+                }
+            }
+        }
+    }
+    free(targets);
+    free(shaders);
+    free(counts.buffers);
+    free(counts.clears);
+    if (failed) {
+        free(commands);
+        return 1;
+    }
+    qsort(commands, total, sizeof(SubmitCommand), compare_commands);
+    TRACE_END(sort_start, "command sort");
+
+    // One parallel loop per target, so a target is complete before the
+    // draws of later targets, which may read it, start.
+    int first = 0;
+    while (first < total) {
+        int end = first + 1;
+        while (end < total && commands[end].target == commands[first].target) {
+            end++;
+        }
+        Submit submit = {commands + first, end - first, jobs_threads(jobs),
+            ctx};
+        jobs_parallel_for(jobs, submit.nbands, execute_band, &submit);
+        first = end;
+    }
+    free(commands);
+    return 0;
+}
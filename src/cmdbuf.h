@@ -0,0 +1,104 @@
+#pragma once
+#include "gl.h"
+
+// Command buffers record clears, shader state and draws to execute later,
+// separating scene traversal from rasterization.
+//
+//     CommandBuffer cb;
+//     cmdbuf_init(&cb);
+//     cmdbuf_clear(&cb, &rgba, &z);
+//     ShaderPhong *phong = cmdbuf_set_shader(&cb, &phong_shader.base,
+//             sizeof(phong_shader));
+//     phong->light = ...;                 // uniforms, kept with the draw
+//     cmdbuf_set_transform(&cb, modelview);
+//     cmdbuf_draw(&cb, &mesh, &rgba, &z);
+//     ...
+//     CommandBuffer *list[] = {&cb};
+//     cmdbuf_submit(&pool, list, 1, &ctx);
+//     cmdbuf_reset(&cb);
+//
+// Each buffer keeps a private copy of the shader, so threads can record into
+// their own buffers at the same time. Every draw snapshots the copy when it
+// changed since the last draw.
+//
+// At submit the commands of all buffers are ordered by render target, told
+// apart by the color buffer, then by shader, both in order of first use.
+// Targets run one after another and each is complete before the next
+// starts, so an offscreen target drawn first can be read by the shaders of
+// later targets. Depth only clears belong to the target of the draws into
+// that depth buffer. Clears are barriers: a clear of a target's color or
+// depth buffer runs after the draws recorded before it and before those
+// recorded after it. Between clears, draws with the same target and shader
+// keep the recorded order. Buffers are in recording order, the first one
+// first. Each target is split into horizontal bands, one per thread, and
+// every thread runs all commands of the target for its band. Output is
+// identical to executing the commands serially in that order.
+//
+// Draws need a color buffer. Depth-only passes such as shadow maps go
+// through draw_model_shadow() before the submit.
+
+typedef enum {CMD_CLEAR, CMD_DRAW} CommandType;
+
+typedef struct {
+    CommandType type;
+    ScreenBuffer *rgba;     // target, either may be NULL for CMD_CLEAR
+    ScreenBuffer *z;
+    const Mesh *mesh;       // CMD_DRAW, not copied, must outlive the submit
+    ShaderBase *shader;     // shader the state was copied from, for sorting
+    size_t state;           // offset of the shader snapshot in the arena
+    size_t state_size;
+    int seq;                // recording order
+} Command;
+
+typedef struct {
+    Command *commands;
+    int count;
+    int size;
+
+    // Shader snapshots. Offsets stay valid when the arena grows.
+    char *arena;
+    size_t arena_used;
+    size_t arena_size;
+
+    ShaderBase *shader;     // current shader and the private copy of it
+    ShaderBase *uniforms;
+    size_t shader_size;
+    size_t uniforms_size;   // allocated size of uniforms
+    int dirty;              // uniforms changed since the last snapshot
+    size_t state;
+} CommandBuffer;
+
+void cmdbuf_init(CommandBuffer *cb);
+void cmdbuf_free(CommandBuffer *cb);
+
+// Drops the recorded commands, keeping the allocations and the current
+// shader.
+void cmdbuf_reset(CommandBuffer *cb);
+
+// Clears the color and depth buffers of a target, either may be NULL.
+void cmdbuf_clear(CommandBuffer *cb, ScreenBuffer *rgba, ScreenBuffer *z);
+
+// Makes shader, size bytes including the derived shader struct, current for
+// the following draws. Returns the private copy to set uniforms on, or NULL
+// if allocation failed.
+void *cmdbuf_set_shader(CommandBuffer *cb, ShaderBase *shader, size_t size);
+
+// Returns the private copy of the current shader to change uniforms on.
+void *cmdbuf_uniforms(CommandBuffer *cb);
+
+// Sets the modelview of the current shader and its mvp with the shader
+// projection.
+void cmdbuf_set_transform(CommandBuffer *cb, Mat44f modelview);
+
+// Records draw_model() of the mesh with the current shader state. Returns 1
+// if allocation failed, no shader is set or rgba is NULL.
+int cmdbuf_draw(CommandBuffer *cb, const Mesh *mesh, ScreenBuffer *rgba,
+        ScreenBuffer *z);
+
+// Sorts and executes the commands of n buffers and waits for them. Bands
+// run as jobs on the pool, one per thread, or serially for a NULL pool. ctx
+// provides the stats and debug settings, its shader is not used. Call from
+// outside the pool's jobs. Returns 1 if allocation failed, nothing is
+// executed then.
+int cmdbuf_submit(JobPool *jobs, CommandBuffer **buffers, int n,
+        RenderContext *ctx);
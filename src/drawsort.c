@@ -0,0 +1,248 @@
+#include "drawsort.h"
+#include "trace.h"
+
+#define RADIX_BITS 8
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+
+// Quantized keys and the second buffer of the radix sort, grown as needed.
+// One set per thread so concurrent sorts don't share them.
+static _Thread_local uint16_t *sort_keys;
+static _Thread_local int *sort_tmp;
+static _Thread_local int sort_size;
+
+// Frees the buffers above, run on pool workers as they exit.
+static void depth_sort_cleanup(void) {
+    free(sort_keys);
+    free(sort_tmp);
+    sort_keys = NULL;
+    sort_tmp = NULL;
+    sort_size = 0;
+}
+
+void depth_sort(int *order, int n, const float *depth) {
+    if (n < 2) {
+        return;
+    }
+    if (n > sort_size) {
+        uint16_t *keys = malloc(2*n*sizeof(uint16_t));
+        int *tmp = malloc(n*sizeof(int));
+        if (keys == NULL || tmp == NULL) {
+            // Unsorted still draws correctly.
+            free(keys);
+            free(tmp);
+            return;
+        }
+        free(sort_keys);
+        free(sort_tmp);
+        sort_keys = keys;
+        sort_tmp = tmp;
+        sort_size = n;
+        jobs_thread_cleanup(depth_sort_cleanup);
+    }
+
+    float lo = depth[order[0]], hi = lo;
+    for (int i=1; i < n; i++) {
+        lo = MIN(lo, depth[order[i]]);
+        hi = MAX(hi, depth[order[i]]);
+    }
+    float scale = (hi > lo) ? 65535.f/(hi - lo) : 0.f;
+
+    // Keys travel with the items, indexed by position like order.
+    uint16_t *keys = sort_keys, *keys_tmp = sort_keys + n;
+    int *items = order, *items_tmp = sort_tmp;
+    for (int i=0; i < n; i++) {
+        keys[i] = (uint16_t)((depth[order[i]] - lo)*scale);
+    }
+
+    // Least significant digit first. Both passes keep the order of equal
+    // digits, and with an even number of passes the result lands in order.
+    for (int shift=0; shift < 16; shift += RADIX_BITS) {
+        int offsets[RADIX_BUCKETS] = {0};
+        for (int i=0; i < n; i++) {
+            offsets[(keys[i] >> shift) & (RADIX_BUCKETS - 1)]++;
+        }
+        int sum = 0;
+        for (int b=0; b < RADIX_BUCKETS; b++) {
+            int count = offsets[b];
+            offsets[b] = sum;
+            sum += count;
+        }
+        for (int i=0; i < n; i++) {
+            int j = offsets[(keys[i] >> shift) & (RADIX_BUCKETS - 1)]++;
+            items_tmp[j] = items[i];
+            keys_tmp[j] = keys[i];
+        }
+
+        int *items_swap = items;
+        items = items_tmp;
+        items_tmp = items_swap;
+        uint16_t *keys_swap = keys;
+        keys = keys_tmp;
+        keys_tmp = keys_swap;
+    }
+}
+
+// Partially orders faces[0..n) around the k-th smallest centroid along axis,
+// Hoare style quickselect like the scene hierarchy build.
+static void select_nth(const float *centroids, int *faces, int n, int k,
+        int axis) {
+    int lo = 0, hi = n - 1;
+    while (lo < hi) {
+        float pivot = centroids[3*faces[(lo + hi)/2] + axis];
+        int i = lo, j = hi;
+        while (i <= j) {
+            while (centroids[3*faces[i] + axis] < pivot) i++;
+            while (centroids[3*faces[j] + axis] > pivot) j--;
+            if (i <= j) {
+                int tmp = faces[i];
+                faces[i] = faces[j];
+                faces[j] = tmp;
+                i++;
+                j--;
+            }
+        }
+        if (k <= j) {
+            hi = j;
+        } else if (k >= i) {
+            lo = i;
+        } else {
+            break;
+        }
+    }
+}
+
+static void split_faces(const float *centroids, int *faces, int first,
+        int count, MeshClusters *clusters) {
+    if (count <= CLUSTER_FACES) {
+        FaceRange range = {first, count};
+        clusters->ranges[clusters->count++] = range;
+        return;
+    }
+
+    float lo[3], hi[3];
+    for (int c=0; c < 3; c++) {
+        lo[c] = hi[c] = centroids[3*faces[first] + c];
+    }
+    for (int i=1; i < count; i++) {
+        for (int c=0; c < 3; c++) {
+            float v = centroids[3*faces[first + i] + c];
+            lo[c] = MIN(lo[c], v);
+            hi[c] = MAX(hi[c], v);
+        }
+    }
+    int axis = 0;
+    if (hi[1] - lo[1] > hi[axis] - lo[axis]) axis = 1;
+    if (hi[2] - lo[2] > hi[axis] - lo[axis]) axis = 2;
+
+    int half = count/2;
+    select_nth(centroids, &faces[first], count, half, axis);
+    split_faces(centroids, faces, first, half, clusters);
+    split_faces(centroids, faces, first + half, count - half, clusters);
+}
+
+// Reorders the index triples of one face attribute, NULL when absent.
+static void permute_faces(int *indices, const int *faces, int nfaces,
+        int *tmp) {
+    if (indices == NULL) {
+        return;
+    }
+    for (int i=0; i < nfaces; i++) {
+        for (int k=0; k < 3; k++) {
+            tmp[3*i + k] = indices[3*faces[i] + k];
+        }
+    }
+    memcpy(indices, tmp, 3*nfaces*sizeof(int));
+}
+
+int mesh_build_clusters(Mesh *obj, MeshClusters *clusters) {
+    TRACE_BEGIN(build_start);
+    memset(clusters, 0, sizeof(*clusters));
+    int nfaces = obj->nfaces_verts/3;
+    // Splits stop above CLUSTER_FACES/2 faces per cluster.
+    int size = MAX(2*nfaces/CLUSTER_FACES + 1, 1);
+    float *centroids = malloc(MAX(3*nfaces, 1)*sizeof(float));
+    int *faces = malloc(MAX(nfaces, 1)*sizeof(int));
+    int *tmp = malloc(MAX(3*nfaces, 1)*sizeof(int));
+    clusters->ranges = malloc(size*sizeof(FaceRange));
+    clusters->bounds = malloc(size*sizeof(Aabb));
+    clusters->order = malloc(size*sizeof(int));
+    clusters->sorted = malloc(size*sizeof(FaceRange));
+    clusters->depth = malloc(size*sizeof(float));
+    if (!centroids || !faces || !tmp || !clusters->ranges || 
+            !clusters->bounds || !clusters->order || !clusters->sorted ||
+            !clusters->depth) {
+        free(centroids);
+        free(faces);
+        free(tmp);
+        mesh_clusters_free(clusters);
+        return 1;
+    }
+
+    for (int i=0; i < nfaces; i++) {
+        faces[i] = i;
+        for (int c=0; c < 3; c++) {
+            float sum = 0.f;
+            for (int k=0; k < 3; k++) {
+                sum += obj->verts[3*obj->faces_verts[3*i + k] + c];
+            }
+            centroids[3*i + c] = sum/3.f;
+        }
+    }
+    if (nfaces > 0) {
+        split_faces(centroids, faces, 0, nfaces, clusters);
+    }
+
+    permute_faces(obj->faces_verts, faces, nfaces, tmp);
+    permute_faces(obj->faces_uvs, faces, nfaces, tmp);
+    permute_faces(obj->faces_normals, faces, nfaces, tmp);
+
+    for (int i=0; i < clusters->count; i++) {
+        FaceRange range = clusters->ranges[i];
+        Aabb box;
+        for (int v=0; v < 3*range.count; v++) {
+            const float *p = &obj->verts[3*obj->faces_verts[3*range.first + v]];
+            for (int c=0; c < 3; c++) {
+                if (v == 0 || p[c] < box.min.e[c]) box.min.e[c] = p[c];
+                if (v == 0 || p[c] > box.max.e[c]) box.max.e[c] = p[c];
+            }
+        }
+        clusters->bounds[i] = box;
+        clusters->order[i] = i;
+    }
+
+    free(centroids);
+    free(faces);
+    free(tmp);
+    TRACE_END(build_start, "mesh_build_clusters");
+    return 0;
+}
+
+void mesh_clusters_free(MeshClusters *clusters) {
+    free(clusters->ranges);
+    free(clusters->bounds);
+    free(clusters->order);
+    free(clusters->sorted);
+    free(clusters->depth);
+    memset(clusters, 0, sizeof(*clusters));
+}
+
+void draw_model_sorted(Mesh obj, MeshClusters *clusters, RenderContext* ctx,
+        ScreenBuffer* buffer_rgba, ScreenBuffer* buffer_z) {
+    TRACE_BEGIN(sort_start);
+    Vec4f row_w = m44frow(ctx->shader->mvp, 3);
+    for (int i=0; i < clusters->count; i++) {
+        const Aabb *b = &clusters->bounds[i];
+        Vec4f center = {{.5f*(b->min.e[0] + b->max.e[0]),
+            .5f*(b->min.e[1] + b->max.e[1]), 
+            .5f*(b->min.e[2] + b->max.e[2]), 1.f}};
+        clusters->depth[i] = v4fdot(row_w, center);
+    }
+    depth_sort(clusters->order, clusters->count, clusters->depth);
+    for (int i=0; i < clusters->count; i++) {
+        clusters->sorted[i] = clusters->ranges[clusters->order[i]];
+    }
+    TRACE_END(sort_start, "cluster sort");
+
+    draw_model_ranges(obj, clusters->sorted, clusters->count, ctx,
+            buffer_rgba, buffer_z);
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include "gl.h"
+
+// Front to back ordering of draws. Fragments behind what is already in the
+// depth buffer are rejected before shading, so drawing near geometry first
+// saves the shading that far geometry drawn first would waste.
+
+// Sorts order[0..n) by depth[order[i]], smallest first. This is a stable 
+// radix sort on the depths quantized to 16 bits over their range, items 
+// closer than one step keep their relative order. Passing in last frame's
+// order keeps the draw order, and so the frame cost, from flickering.
+void depth_sort(int *order, int n, const float *depth);
+
+// Faces per cluster, at most.
+#define CLUSTER_FACES 64
+
+// Spatially coherent groups of faces of a mesh.
+typedef struct {
+    FaceRange *ranges;
+    Aabb *bounds;       // object space
+    int count;
+    int *order;         // cluster indices in the order they were last drawn
+    FaceRange *sorted;  // scratch for draw_model_sorted()
+    float *depth;       // scratch for draw_model_sorted()
+} MeshClusters;
+
+// Splits the faces into clusters at the median centroid along the longest 
+// axis until at most CLUSTER_FACES are left, and reorders the faces of the 
+// mesh so each cluster is a contiguous range. Returns 1 if allocation 
+// failed.
+int mesh_build_clusters(Mesh *obj, MeshClusters *clusters);
+void mesh_clusters_free(MeshClusters *clusters);
+
+// Draws the mesh with its clusters sorted front to back by the view depth,
+// clip space w under the shader mvp, of their bounds centers.
+void draw_model_sorted(Mesh obj, MeshClusters *clusters, RenderContext* ctx,
+        ScreenBuffer* buffer_rgba, ScreenBuffer* buffer_z);
@@ -1,5 +1,15 @@
 #pragma once
 #include "gl.h"
+#include "fastmath.h"
+#include "lights.h"
+
+// Exact or fast math, as picked by the shader's fast_math switch.
+static inline float shader_pow(ShaderBase *base, float x, float y) {
+    return base->fast_math ? fast_powf(x, y) : pow(x, y);
+}
+static inline Vec3f shader_normalize(ShaderBase *base, Vec3f v) {
+    return base->fast_math ? v3fnormalize_fast(v) : v3fnormalize(v);
+}
 
 static inline Vec3f reflect(Vec3f incident, Vec3f normal) {
     // incident - 2*dot(normal, incident)*normal
@@ -25,6 +35,11 @@ Vec4f shader_uv_vertex(Vec3f point, int nthvert, void *data) {
     return vertex;
 }
 
+void shader_uv_vertex_batch(VertexBatch *batch, void *data) {
+    ShaderUV *sdata = (ShaderUV *)data;
+    vertex_batch_transform(sdata->base.mvp, batch);
+}
+
 int shader_uv_fragment(Vec3f bar, Vec3f *color, void *data) {
     ShaderUV *sdata = (ShaderUV *)data;
     Vec3f v0col = {{1.f,0,0}};
@@ -53,6 +68,11 @@ Vec4f shader_normal_vertex(Vec3f point, int nthvert, void *data) {
     return vertex;
 }
 
+void shader_normal_vertex_batch(VertexBatch *batch, void *data) {
+    ShaderNormal *sdata = (ShaderNormal *)data;
+    vertex_batch_transform(sdata->base.mvp, batch);
+}
+
 int shader_normal_fragment(Vec3f bar, Vec3f *color, void *data) {
     ShaderNormal *sdata = (ShaderNormal *)data;
     Vec3f v0col = {{1.f,0,0}};
@@ -81,6 +101,11 @@ typedef struct {
     float specular_amount;
     float specular_falloff;
     int count;
+    // Optional. Shadow map of the light written by draw_model_shadow(), 
+    // shadow_matrix maps object space to its clip space.
+    ScreenBuffer *shadow_map;
+    Mat44f shadow_matrix;
+    float shadow_bias;
 } ShaderPhong;
 
 Vec4f shader_phong_vertex(Vec3f point, int nthvert, void *data) {
@@ -90,22 +115,39 @@ Vec4f shader_phong_vertex(Vec3f point, int nthvert, void *data) {
     return vertex;
 }
 
+void shader_phong_vertex_batch(VertexBatch *batch, void *data) {
+    ShaderPhong *sdata = (ShaderPhong *)data;
+    vertex_batch_transform(sdata->base.mvp, batch);
+}
+
 int shader_phong_fragment(Vec3f bar, Vec3f *color, void *data) {
     ShaderPhong *sdata = (ShaderPhong *)data;
     Vec3f normal = m33fv3(sdata->base.varying_vertex_normal, bar);
     Vec3f pos = m33fv3(sdata->base.varying_vertex_post, bar);
 
-    Vec3f L = v3fnormalize(v3fsub(sdata->light_pos,pos));
-    Vec3f E = v3fnormalize(v3fmul(pos, 1.f)); // we are in Eye Coordinates, so EyePos is (0,0,0)  
-    Vec3f R = v3fnormalize(v3fmul(reflect(L,normal), -1.f)); 
+    ShaderBase *base = &sdata->base;
+    Vec3f L = shader_normalize(base, v3fsub(sdata->light_pos,pos));
+    Vec3f E = shader_normalize(base, v3fmul(pos, 1.f)); // we are in Eye Coordinates, so EyePos is (0,0,0)  
+    Vec3f R = shader_normalize(base, v3fmul(reflect(L,normal), -1.f)); 
 
     Vec3f white = {{.5f, .5f, .5f}};
     Vec3f ambient  = sdata->ambient_light;
     Vec3f diffuse  = v3fmul(sdata->light,
             clamp(sdata->diffuse_amount*v3fdot(normal, L), 0.f, 1.f));
     Vec3f specular = v3fmul(f2v3f(sdata->specular_amount),
-            pow(clamp(v3fdot(R, E), 0.f, 1.f),sdata->specular_falloff));
+            shader_pow(base, clamp(v3fdot(R, E), 0.f, 1.f),
+                sdata->specular_falloff));
     
+    if (sdata->shadow_map != NULL) {
+        Vec3f p = m33fv3(base->varying_vertex_pos, bar);
+        Vec4f light_clip = m44fv4(sdata->shadow_matrix,
+                (Vec4f){{p.e[0], p.e[1], p.e[2], 1.f}});
+        float lit = shadow_pcf(sdata->shadow_map, light_clip, 
+                sdata->shadow_bias);
+        diffuse = v3fmul(diffuse, lit);
+        specular = v3fmul(specular, lit);
+    }
+
     Vec3f rgb = ambient;
     rgb = v3fadd(rgb, diffuse);
     rgb = v3fadd(rgb, specular);
@@ -113,3 +155,71 @@ int shader_phong_fragment(Vec3f bar, Vec3f *color, void *data) {
     v3fset(color, rgb);
     return 0;
 }
+
+//
+// Clustered lights shader, Phong with many point lights
+//
+
+typedef struct {
+    ShaderBase base;
+    Vec3f ambient_light;
+    float diffuse_amount;
+    float specular_amount;
+    float specular_falloff;
+    // Built with light_clusters_build() for the current camera.
+    const LightClusters *clusters;
+} ShaderLights;
+
+Vec4f shader_lights_vertex(Vec3f point, int nthvert, void *data) {
+    ShaderLights *sdata = (ShaderLights *)data;
+    Vec4f vertex = {{point.e[0], point.e[1], point.e[2], 1.f}};
+    vertex = m44fv4(sdata->base.mvp, vertex);
+    return vertex;
+}
+
+void shader_lights_vertex_batch(VertexBatch *batch, void *data) {
+    ShaderLights *sdata = (ShaderLights *)data;
+    vertex_batch_transform(sdata->base.mvp, batch);
+}
+
+int shader_lights_fragment(Vec3f bar, Vec3f *color, void *data) {
+    ShaderLights *sdata = (ShaderLights *)data;
+    ShaderBase *base = &sdata->base;
+    Vec3f p = m33fv3(base->varying_vertex_pos, bar);
+    Vec3f n = m33fv3(base->varying_vertex_normal, bar);
+
+    // Lights are in view space, so shade there.
+    Vec3f pos = v4f2v3f(m44fv4(base->modelview,
+                (Vec4f){{p.e[0], p.e[1], p.e[2], 1.f}}));
+    Vec3f normal = shader_normalize(base, v4f2v3f(m44fv4(base->modelview,
+                    (Vec4f){{n.e[0], n.e[1], n.e[2], 0.f}})));
+    Vec3f E = shader_normalize(base, pos);
+
+    const LightClusters *clusters = sdata->clusters;
+    int count;
+    const int *index = light_cluster_lights(clusters, base->frag_coord.e[0],
+            base->frag_coord.e[1], light_view_depth(clusters, pos), &count);
+
+    Vec3f rgb = sdata->ambient_light;
+    for (int i=0; i < count; i++) {
+        const PointLight *light = &clusters->view_lights[index[i]];
+        Vec3f d = v3fsub(light->pos, pos);
+        float dist2 = v3fdot(d, d);
+        if (dist2 >= light->radius*light->radius) {
+            continue;
+        }
+        float dist = sqrtf(dist2);
+        float falloff = 1.f - dist/light->radius;
+        Vec3f L = v3fmul(d, 1.f/dist);
+        Vec3f R = v3fmul(reflect(L, normal), -1.f);
+
+        float amount = clamp(sdata->diffuse_amount*v3fdot(normal, L), 0.f, 
+                1.f);
+        amount += sdata->specular_amount*shader_pow(base, 
+                clamp(v3fdot(R, E), 0.f, 1.f), sdata->specular_falloff);
+        rgb = v3fadd(rgb, v3fmul(light->color, amount*falloff*falloff));
+    }
+
+    v3fset(color, rgb);
+    return 0;
+}
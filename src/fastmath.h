@@ -0,0 +1,146 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include "linalg.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Fast approximate math for shaders. Accuracy for finite inputs:
+//  fast_rsqrt   relative error < 5e-7 with SSE (rsqrtps plus one
+//               Newton-Raphson step), < 5e-6 without (bit trick plus two).
+//  fast_log2    absolute error < 7e-6, x > 0 and normal.
+//  fast_exp2    relative error < 3e-7, x is clamped to [-126, 126].
+//  fast_powf    relative error < 4e-6*max(|y|, 1) while the result is a 
+//               normal float, and exactly 0 for x <= 0.
+// The _ps forms compute the same approximations on 4 lanes.
+
+// Coefficients, least squares fits on Chebyshev nodes. log2(1 + u) for
+// 1 + u in [sqrt(.5), sqrt(2)) and 2^f for f in [-.5, .5].
+#define FM_LOG2_C0  1.44271577f
+#define FM_LOG2_C1 -0.721122539f
+#define FM_LOG2_C2  0.479324359f
+#define FM_LOG2_C3 -0.367703982f
+#define FM_LOG2_C4  0.322085496f
+#define FM_LOG2_C5 -0.205298296f
+#define FM_EXP2_C0  1.00000008f
+#define FM_EXP2_C1  0.693147207f
+#define FM_EXP2_C2  0.240221074f
+#define FM_EXP2_C3  0.0555032721f
+#define FM_EXP2_C4  0.00967603709f
+#define FM_EXP2_C5  0.00134004322f
+
+// Bit pattern of sqrt(.5). Subtracting it before taking the exponent puts
+// the mantissa in [sqrt(.5), sqrt(2)), centering the polynomial on 1.
+#define FM_SQRT_HALF_BITS 0x3f3504f3
+
+static inline float fast_rsqrt(float x) {
+#ifdef __SSE2__
+    float y = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+    return y*(1.5f - 0.5f*x*y*y);
+#else
+    int32_t i;
+    float y;
+    memcpy(&i, &x, sizeof(i));
+    i = 0x5f3759df - (i >> 1);
+    memcpy(&y, &i, sizeof(y));
+    y = y*(1.5f - 0.5f*x*y*y);
+    return y*(1.5f - 0.5f*x*y*y);
+#endif
+}
+
+static inline float fast_log2(float x) {
+    int32_t i;
+    float m;
+    memcpy(&i, &x, sizeof(i));
+    int32_t e = (i - FM_SQRT_HALF_BITS) >> 23;
+    // e is negative below sqrt(1/2), where a signed shift would be undefined.
+    i -= (int32_t)((uint32_t)e << 23);
+    memcpy(&m, &i, sizeof(m));
+
+    float u = m - 1.f;
+    float p = FM_LOG2_C5;
+    p = p*u + FM_LOG2_C4;
+    p = p*u + FM_LOG2_C3;
+    p = p*u + FM_LOG2_C2;
+    p = p*u + FM_LOG2_C1;
+    p = p*u + FM_LOG2_C0;
+    return (float)e + p*u;
+}
+
+static inline float fast_exp2(float x) {
+    x = (x < -126.f) ? -126.f : (x > 126.f) ? 126.f : x;
+    int32_t n = (int32_t)(x + (x >= 0.f ? .5f : -.5f));
+    float f = x - (float)n;
+
+    float p = FM_EXP2_C5;
+    p = p*f + FM_EXP2_C4;
+    p = p*f + FM_EXP2_C3;
+    p = p*f + FM_EXP2_C2;
+    p = p*f + FM_EXP2_C1;
+    p = p*f + FM_EXP2_C0;
+
+    // 2^n straight into the exponent bits.
+    int32_t bits = (n + 127) << 23;
+    float scale;
+    memcpy(&scale, &bits, sizeof(scale));
+    return p*scale;
+}
+
+static inline float fast_powf(float x, float y) {
+    return (x > 0.f) ? fast_exp2(y*fast_log2(x)) : 0.f;
+}
+
+static inline Vec3f v3fnormalize_fast(Vec3f v) {
+    return v3fmul(v, fast_rsqrt(v3fdot(v, v)));
+}
+
+#ifdef __SSE2__
+
+static inline __m128 fast_rsqrt_ps(__m128 x) {
+    __m128 y = _mm_rsqrt_ps(x);
+    __m128 yy = _mm_mul_ps(y, y);
+    __m128 t = _mm_sub_ps(_mm_set1_ps(1.5f),
+            _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), x), yy));
+    return _mm_mul_ps(y, t);
+}
+
+static inline __m128 fast_log2_ps(__m128 x) {
+    __m128i i = _mm_castps_si128(x);
+    __m128i e = _mm_srai_epi32(
+            _mm_sub_epi32(i, _mm_set1_epi32(FM_SQRT_HALF_BITS)), 23);
+    __m128 m = _mm_castsi128_ps(_mm_sub_epi32(i, _mm_slli_epi32(e, 23)));
+
+    __m128 u = _mm_sub_ps(m, _mm_set1_ps(1.f));
+    __m128 p = _mm_set1_ps(FM_LOG2_C5);
+    p = _mm_add_ps(_mm_mul_ps(p, u), _mm_set1_ps(FM_LOG2_C4));
+    p = _mm_add_ps(_mm_mul_ps(p, u), _mm_set1_ps(FM_LOG2_C3));
+    p = _mm_add_ps(_mm_mul_ps(p, u), _mm_set1_ps(FM_LOG2_C2));
+    p = _mm_add_ps(_mm_mul_ps(p, u), _mm_set1_ps(FM_LOG2_C1));
+    p = _mm_add_ps(_mm_mul_ps(p, u), _mm_set1_ps(FM_LOG2_C0));
+    return _mm_add_ps(_mm_cvtepi32_ps(e), _mm_mul_ps(p, u));
+}
+
+static inline __m128 fast_exp2_ps(__m128 x) {
+    x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(-126.f)), _mm_set1_ps(126.f));
+    // Round to nearest, the default MXCSR mode.
+    __m128i n = _mm_cvtps_epi32(x);
+    __m128 f = _mm_sub_ps(x, _mm_cvtepi32_ps(n));
+
+    __m128 p = _mm_set1_ps(FM_EXP2_C5);
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(FM_EXP2_C4));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(FM_EXP2_C3));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(FM_EXP2_C2));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(FM_EXP2_C1));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(FM_EXP2_C0));
+
+    __m128i bits = _mm_slli_epi32(_mm_add_epi32(n, _mm_set1_epi32(127)), 23);
+    return _mm_mul_ps(p, _mm_castsi128_ps(bits));
+}
+
+static inline __m128 fast_powf_ps(__m128 x, __m128 y) {
+    __m128 r = fast_exp2_ps(_mm_mul_ps(y, fast_log2_ps(x)));
+    return _mm_and_ps(r, _mm_cmpgt_ps(x, _mm_setzero_ps()));
+}
+
+#endif
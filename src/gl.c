@@ -1,4 +1,8 @@
 #include "gl.h"
+#include "trace.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 inline float clamp(float x, float min, float max)
 {
@@ -16,8 +20,23 @@ static inline void swap(int *a, int *b) {
     return;
 }
 
+int buffer_init(ScreenBuffer *buffer, buffer_type type, int width, int height) {
+    memset(buffer, 0, sizeof(*buffer));
+    buffer->type = type;
+    buffer->depth = buffer_type_depth(type);
+    buffer->width = width;
+    buffer->height = height;
+    buffer->pitch = width*buffer->depth;
+    buffer->memory = calloc(height, buffer->pitch);
+    return (buffer->memory == NULL);
+}
+
+void buffer_free(ScreenBuffer *buffer) {
+    free(buffer->memory);
+    buffer->memory = NULL;
+}
+
 void set_color(ScreenBuffer *buffer, int x, int y, uint32_t color) {
-    uint32_t *pixels = (uint32_t *)buffer->memory;
     int ny = (buffer->height-1) - y;
 
     if (!(x >= 0 && x < buffer->width) || !(ny >= 0 && ny < buffer->height)) {
@@ -25,24 +44,54 @@ void set_color(ScreenBuffer *buffer, int x, int y, uint32_t color) {
         return;
     }
 
-    pixels[ny*buffer->width + x] = color;
+    uint32_t *row = (uint32_t *)((char *)buffer->memory + ny*buffer->pitch);
+    row[x] = color;
     return;
 }
 
-int set_z(ScreenBuffer *buffer, int x, int y, int z) {
-    int *zbuffer = (int *)buffer->memory;
+// Depth test and write, one instance per depth buffer format.
+#define SET_Z_FN(fname, type)                                               \
+    int fname(ScreenBuffer *buffer, int x, int y, type z) {                 \
+        type *zbuffer = (type *)buffer->memory;                             \
+        int ny = (buffer->height-1) - y;                                    \
+                                                                            \
+        if (!(x >= 0 && x < buffer->width) ||                               \
+                !(ny >= 0 && ny < buffer->height)) {                        \
+            return 0;                                                       \
+        }                                                                   \
+                                                                            \
+        if (zbuffer[ny*buffer->width + x] < z){                             \
+            zbuffer[ny*buffer->width + x] = z;                              \
+            return 1;                                                       \
+        }                                                                   \
+        return 0;                                                           \
+    }                                                                       \
+
+void set_colorf(ScreenBuffer *buffer, int x, int y, Vec4f color) {
     int ny = (buffer->height-1) - y;
 
     if (!(x >= 0 && x < buffer->width) || !(ny >= 0 && ny < buffer->height)) {
-        //printf("OUT OF BOUNDS!\n");
-        return 0;
+        return;
     }
 
-    if (zbuffer[ny*buffer->width + x] < z){
-        zbuffer[ny*buffer->width + x] = z;
-        return 1;
-    }
-    return 0;
+    Vec4f *row = (Vec4f *)((char *)buffer->memory + ny*buffer->pitch);
+    row[x] = color;
+    return;
+}
+
+SET_Z_FN(set_z, int)
+SET_Z_FN(set_z16, uint16_t)
+SET_Z_FN(set_zf, float)
+
+// Quantize normalized depth, viewport_depth(), to each depth buffer format.
+static inline int depth_z(float d) {
+    return (int)(d*(float)(1 << DEPTH_Z_BITS));
+}
+static inline uint16_t depth_z16(float d) {
+    return (uint16_t)(clamp(d, 0.f, 1.f)*0xffff);
+}
+static inline float depth_z32f(float d) {
+    return d;
 }
 
 void line(ScreenBuffer *buffer, int x0, int y0, int x1, int y1,
@@ -91,56 +140,284 @@ static inline int barycentric(Vec2i A, Vec2i B, Vec2i C) {
     // This gives us the signed area of the parallellogram. (2x tri area.)
 }
 
-// Main rasterize function
-void triangle(Vec3f v0, Vec3f v1, Vec3f v2,
-        Vec3f v0uv, Vec3f v1uv, Vec3f v2uv, 
-        Vec3f n0, Vec3f n1, Vec3f n2, uint32_t color,
-        RenderContext* ctx, ScreenBuffer* buffer_rgba, ScreenBuffer* buffer_z) {
+// Color writes, one per color buffer format. BUF_RGBA clamps and packs,
+// BUF_RGBAF keeps the unclamped shader output for a later resolve().
+static inline void write_rgba(ScreenBuffer *buffer, int x, int y, Vec3f col) {
+    col.e[0] = clamp(col.e[0], 0.f, 1.f);
+    col.e[1] = clamp(col.e[1], 0.f, 1.f);
+    col.e[2] = clamp(col.e[2], 0.f, 1.f);
+    uint32_t color = pack_color(buffer->format, (int)(col.e[0]*0xff),
+            (int)(col.e[1]*0xff), (int)(col.e[2]*0xff), 0);
+    set_color(buffer, x, y, color);
+}
+static inline void write_rgbaf(ScreenBuffer *buffer, int x, int y, Vec3f col) {
+    Vec4f c = {{col.e[0], col.e[1], col.e[2], 1.f}};
+    set_colorf(buffer, x, y, c);
+}
 
-    Vec2i sc[3]; // screen coords
-    Vec3f vertex_pos[3] = {v0, v1, v2}; // vertex pos. world coords
-    
-    // For subpixel accuracy
+// Samples per side of the blocks of the hierarchical raster loop. Triangles
+// whose bounding box spans more than a block both ways are walked block by
+// block, testing the block corners first.
+#define RASTER_BLOCK 8
+
+// Triangles with at most this many samples in their bounding box have them
+// tested in setup, and are dropped there when none is covered.
+#define RASTER_TINY_SAMPLES 4
+
+// Bounding box raster loop. One instance is generated per depth and color
+// format so quantization, depth test and color write are inlined. 
+//
+// Large triangles are walked in RASTER_BLOCK blocks. The edge functions are
+// linear, so if all four corner samples of a block are inside the triangle
+// every sample is, and if all corners are outside one edge no sample is. 
+// Blocks of the first kind skip the per sample test, blocks of the second 
+// are skipped. Partial blocks and small triangles test every sample.
+#define RASTERIZE_FN(fname, quantize, set_depth, write_color)               \
+    /* Depth tests and shades a covered sample. Returns 1 if it passed. */  \
+    static inline int fname##_sample(int x, int y, Vec3f bar,              \
+            float clip_z[3], RenderContext* ctx, ScreenBuffer* buffer_rgba, \
+            ScreenBuffer* buffer_z) {                                       \
+        static const int sub_factor = 16;                                   \
+        /* Interpolate z using barycentric weights. */                      \
+        float z = clip_z[0]*bar.e[0] + clip_z[1]*bar.e[1] +                 \
+            clip_z[2]*bar.e[2];                                             \
+                                                                            \
+        int buf_x = ceil((float)x/sub_factor);                              \
+        int buf_y = ceil((float)y/sub_factor);                              \
+                                                                            \
+        /* Only shade if the depth test passes. */                          \
+        float d = viewport_depth(&ctx->shader->viewport, z);                \
+        if (!set_depth(buffer_z, buf_x, buf_y, quantize(d))) {              \
+            return 0;                                                       \
+        }                                                                   \
+                                                                            \
+        STATS_TIME_BEGIN(shade_start);                                      \
+        ctx->shader->frag_coord.e[0] = buf_x;                               \
+        ctx->shader->frag_coord.e[1] = buf_y;                               \
+                                                                            \
+        Vec3f col;                                                          \
+        ctx->shader->fragment_shader(bar, &col, ctx->shader);               \
+        write_color(buffer_rgba, buf_x, buf_y, col);                        \
+        STATS_TIME_END(STAGE_SHADE, shade_start);                           \
+        return 1;                                                           \
+    }                                                                       \
+                                                                            \
+    static void fname(Vec2i sc[3], float clip_z[3], int area,              \
+            int xmin, int xmax, int ymin, int ymax,                         \
+            RenderContext* ctx, ScreenBuffer* buffer_rgba,                  \
+            ScreenBuffer* buffer_z) {                                       \
+        static const int sub_factor = 16;                                   \
+        uint64_t covered = 0, passed = 0;                                   \
+        STATS_TIME_BEGIN(raster_start);                                     \
+        int nx = (xmax - xmin)/sub_factor + 1;                              \
+        int ny = (ymax - ymin)/sub_factor + 1;                              \
+        if (nx <= RASTER_BLOCK || ny <= RASTER_BLOCK) {                     \
+            for (int x=xmin; x<=xmax; x+=sub_factor) {                      \
+                for (int y=ymin; y<=ymax; y+=sub_factor) {                  \
+                    Vec2i p = {{x, y}};                                     \
+                                                                            \
+                    /* Signed 2x area. */                                   \
+                    float w0 = barycentric(sc[1],sc[2],p);                  \
+                    float w1 = barycentric(sc[2],sc[0],p);                  \
+                    float w2 = barycentric(sc[0],sc[1],p);                  \
+                    w0 /= area; w1 /= area; w2 /= area;                     \
+                    Vec3f bar = {{w0, w1, w2}};                             \
+                                                                            \
+                    /* Check if within triangle. */                         \
+                    if (!(w0 >= 0 && w1 >= 0 && w2 >= 0)) {                 \
+                        continue;                                           \
+                    }                                                       \
+                    covered++;                                              \
+                    passed += fname##_sample(x, y, bar, clip_z, ctx,        \
+                            buffer_rgba, buffer_z);                         \
+                }                                                           \
+            }                                                               \
+        } else {                                                            \
+            /* Edge steps per sample and sign, inside is sign*e >= 0. */    \
+            Vec2i *edge[3][2] = {{&sc[1], &sc[2]}, {&sc[2], &sc[0]},        \
+                {&sc[0], &sc[1]}};                                          \
+            int dx[3], dy[3], sign = area > 0 ? 1 : -1;                     \
+            for (int i=0; i < 3; i++) {                                     \
+                Vec2i a = *edge[i][0], b = *edge[i][1];                     \
+                dx[i] = -(b.e[1] - a.e[1])*sub_factor;                      \
+                dy[i] = (b.e[0] - a.e[0])*sub_factor;                       \
+            }                                                               \
+            for (int by=0; by < ny; by+=RASTER_BLOCK) {                     \
+                for (int bx=0; bx < nx; bx+=RASTER_BLOCK) {                 \
+                    int bw = MIN(RASTER_BLOCK, nx - bx) - 1;                \
+                    int bh = MIN(RASTER_BLOCK, ny - by) - 1;                \
+                    Vec2i p = {{xmin + bx*sub_factor,                       \
+                        ymin + by*sub_factor}};                             \
+                    int e[3], full = 1, empty = 0;                          \
+                    for (int i=0; i < 3; i++) {                             \
+                        e[i] = barycentric(*edge[i][0], *edge[i][1], p);    \
+                        int c0 = sign*e[i];                                 \
+                        int c1 = sign*(e[i] + bw*dx[i]);                    \
+                        int c2 = sign*(e[i] + bh*dy[i]);                    \
+                        int c3 = sign*(e[i] + bw*dx[i] + bh*dy[i]);         \
+                        full &= MIN(MIN(c0, c1), MIN(c2, c3)) >= 0;         \
+                        empty |= MAX(MAX(c0, c1), MAX(c2, c3)) < 0;         \
+                    }                                                       \
+                    if (empty) {                                            \
+                        STATS_ADD(blocks_empty, 1);                         \
+                        continue;                                           \
+                    }                                                       \
+                    STATS_ADD(blocks_full, full);                           \
+                    for (int j=0; j <= bh; j++) {                           \
+                        int y = p.e[1] + j*sub_factor;                      \
+                        for (int k=0; k <= bw; k++) {                       \
+                            int x = p.e[0] + k*sub_factor;                  \
+                            float w0 = e[0] + k*dx[0] + j*dy[0];            \
+                            float w1 = e[1] + k*dx[1] + j*dy[1];            \
+                            float w2 = e[2] + k*dx[2] + j*dy[2];            \
+                            w0 /= area; w1 /= area; w2 /= area;             \
+                            if (!full &&                                    \
+                                    !(w0 >= 0 && w1 >= 0 && w2 >= 0)) {     \
+                                continue;                                   \
+                            }                                               \
+                            covered++;                                      \
+                            Vec3f bar = {{w0, w1, w2}};                     \
+                            passed += fname##_sample(x, y, bar, clip_z,     \
+                                    ctx, buffer_rgba, buffer_z);            \
+                        }                                                   \
+                    }                                                       \
+                }                                                           \
+            }                                                               \
+        }                                                                   \
+        STATS_TIME_END(STAGE_RASTER, raster_start);                         \
+        STATS_ADD(samples_visited, (uint64_t)nx*ny);                        \
+        STATS_ADD(samples_covered, covered);                                \
+        STATS_ADD(depth_pass, passed);                                      \
+        STATS_ADD(depth_fail, covered - passed);                            \
+        STATS_ADD(fragment_shader_calls, passed);                           \
+        (void)covered; (void)passed;                                        \
+    }                                                                       \
+
+RASTERIZE_FN(rasterize_z_rgba, depth_z, set_z, write_rgba)
+RASTERIZE_FN(rasterize_z16_rgba, depth_z16, set_z16, write_rgba)
+RASTERIZE_FN(rasterize_z32f_rgba, depth_z32f, set_zf, write_rgba)
+RASTERIZE_FN(rasterize_z_rgbaf, depth_z, set_z, write_rgbaf)
+RASTERIZE_FN(rasterize_z16_rgbaf, depth_z16, set_z16, write_rgbaf)
+RASTERIZE_FN(rasterize_z32f_rgbaf, depth_z32f, set_zf, write_rgbaf)
+
+typedef void (*rasterize_fn)(Vec2i sc[3], float clip_z[3], int area,
+        int xmin, int xmax, int ymin, int ymax,
+        RenderContext* ctx, ScreenBuffer* buffer_rgba, ScreenBuffer* buffer_z);
+
+// Generic depth test for the debug raster loop.
+static int depth_test(ScreenBuffer *buffer_z, int x, int y, float d) {
+    switch (buffer_z->type) {
+        case BUF_Z16: return set_z16(buffer_z, x, y, depth_z16(d));
+        case BUF_Z32F: return set_zf(buffer_z, x, y, depth_z32f(d));
+        default: return set_z(buffer_z, x, y, depth_z(d));
+    }
+}
+
+// Raster loop for the debug modes. Accumulates into ctx->debug_counts
+// instead of writing colors.
+static void rasterize_debug(Vec2i sc[3], float clip_z[3], int area,
+        int xmin, int xmax, int ymin, int ymax,
+        RenderContext* ctx, ScreenBuffer* buffer_z) {
     static const int sub_factor = 16;
-    static const int sub_mask = sub_factor - 1;
+    ScreenBuffer *counts = ctx->debug_counts;
 
+    for (int x=xmin; x<=xmax; x+=sub_factor) {
+        for (int y=ymin; y<=ymax; y+=sub_factor) {
+            Vec2i p = {{x, y}};
+            float w0 = barycentric(sc[1],sc[2],p);
+            float w1 = barycentric(sc[2],sc[0],p);
+            float w2 = barycentric(sc[0],sc[1],p);
+            w0 /= area; w1 /= area; w2 /= area;
+            Vec3f bar = {{w0, w1, w2}};
+            if (!(w0 >= 0 && w1 >= 0 && w2 >= 0)) {
+                continue;
+            }
 
-    Vec4f vertex_pos_t[3];      // Transformed vertex positions.
-    Vec4f vertex_pos_clip[3];   // Transformed vertex positions in clip space.
-    for(int j=0; j < 3; j++) {
-        // Call vertex shader
-        vertex_pos_t[j] = ctx->shader->vertex_shader(vertex_pos[j], j,
-                ctx->shader);
-        
-        // Perspective divide to get clip space.
-        vertex_pos_clip[j] = v4fdiv(vertex_pos_t[j], vertex_pos_t[j].e[3]);
+            int buf_x = x/sub_factor;
+            int buf_y = y/sub_factor;
+            int ny = (counts->height-1) - buf_y;
+            if (!(buf_x >= 0 && buf_x < counts->width) ||
+                    !(ny >= 0 && ny < counts->height)) {
+                continue;
+            }
+            uint32_t *count = (uint32_t *)((char *)counts->memory +
+                    ny*counts->pitch) + buf_x;
+
+            if (ctx->debug == DEBUG_COVERAGE) {
+                *count += 1;
+                continue;
+            }
+
+            float z = clip_z[0]*w0 + clip_z[1]*w1 + clip_z[2]*w2;
+            float d = viewport_depth(&ctx->shader->viewport, z);
+            if (!depth_test(buffer_z, buf_x, buf_y, d)) {
+                continue;
+            }
 
-        // Vertex post-processing:
-        {
-            // Viewport transform
-            Vec4f sctmp = m44fv4(ctx->shader->viewport, vertex_pos_clip[j]);
-            
-            // Sub-pixel preciision.
-            sc[j].e[0] = sctmp.e[0]*sub_factor;
-            sc[j].e[1] = sctmp.e[1]*sub_factor;
+            if (ctx->debug == DEBUG_DEPTH_PASS) {
+                *count += 1;
+                continue;
+            }
+
+            // DEBUG_SHADER_COST
+            ctx->shader->frag_coord.e[0] = buf_x;
+            ctx->shader->frag_coord.e[1] = buf_y;
+            Vec3f col;
+            uint64_t start = stats_now();
+            ctx->shader->fragment_shader(bar, &col, ctx->shader);
+            *count += (uint32_t)(stats_now() - start);
         }
     }
+}
 
-    // Set values of default varying variables of base shader.
-    {
-        m33fsetcol(&ctx->shader->varying_vertex_normal, 0, n0);
-        m33fsetcol(&ctx->shader->varying_vertex_normal, 1, n1);
-        m33fsetcol(&ctx->shader->varying_vertex_normal, 2, n2);
-        m33fsetcol(&ctx->shader->varying_vertex_uv,     0, v0uv);
-        m33fsetcol(&ctx->shader->varying_vertex_uv,     1, v1uv);
-        m33fsetcol(&ctx->shader->varying_vertex_uv,     2, v2uv);
-        m33fsetcol(&ctx->shader->varying_vertex_pos,    0, vertex_pos[0]);
-        m33fsetcol(&ctx->shader->varying_vertex_pos,    1, vertex_pos[1]);
-        m33fsetcol(&ctx->shader->varying_vertex_pos,    2, vertex_pos[2]);
-        m33fsetcol(&ctx->shader->varying_vertex_post,   0, v4f2v3f(vertex_pos_t[0]));
-        m33fsetcol(&ctx->shader->varying_vertex_post,   1, v4f2v3f(vertex_pos_t[1]));
-        m33fsetcol(&ctx->shader->varying_vertex_post,   2, v4f2v3f(vertex_pos_t[2]));
+// Pick the raster loop specialized for the given buffer formats.
+static rasterize_fn select_rasterizer(ScreenBuffer* buffer_rgba,
+        ScreenBuffer* buffer_z) {
+    int hdr = (buffer_rgba->type == BUF_RGBAF);
+    switch (buffer_z->type) {
+        case BUF_Z16:
+            return hdr ? rasterize_z16_rgbaf : rasterize_z16_rgba;
+        case BUF_Z32F:
+            return hdr ? rasterize_z32f_rgbaf : rasterize_z32f_rgba;
+        default:
+            return hdr ? rasterize_z_rgbaf : rasterize_z_rgba;
     }
+}
+
+// Main rasterize function
+// Vertex post-processing, perspective divide and viewport transform.
+static inline ShadedVertex vertex_post(Vec4f post, Mat44f viewport) {
+    static const int sub_factor = 16;
+    ShadedVertex sv;
+    sv.post = post;
+
+    // Perspective divide to get clip space.
+    Vec4f clip = v4fdiv(post, post.e[3]);
+    sv.clip_z = clip.e[2];
+
+    // Viewport transform
+    Vec4f sctmp = m44fv4(viewport, clip);
+
+    // Sub-pixel preciision.
+    sv.sc.e[0] = sctmp.e[0]*sub_factor;
+    sv.sc.e[1] = sctmp.e[1]*sub_factor;
+    return sv;
+}
+
+// Sets up and rasterizes a triangle whose vertices went through the vertex 
+// stage. vertex_pos, uv and n are the untransformed attributes for the 
+// varyings.
+static void triangle_setup(const ShadedVertex *sv[3], Vec3f vertex_pos[3],
+        Vec3f uv[3], Vec3f n[3], RenderContext* ctx, 
+        ScreenBuffer* buffer_rgba, ScreenBuffer* buffer_z) {
+    // For subpixel accuracy
+    static const int sub_factor = 16;
+    static const int sub_mask = sub_factor - 1;
+
+    STATS_ADD(triangles_submitted, 1);
+    STATS_TIME_BEGIN(setup_start);
+
+    Vec2i sc[3] = {sv[0]->sc, sv[1]->sc, sv[2]->sc}; // screen coords
 
     //Find bounding box to loop over.
     int ymin = sc[0].e[1];
@@ -167,58 +444,297 @@ void triangle(Vec3f v0, Vec3f v1, Vec3f v2,
     xmin = (xmin + sub_mask) & ~sub_mask;
     ymin = (ymin + sub_mask) & ~sub_mask;
 
+    // Cull triangles outside the target and clamp the bounding box to it.
+    // Sample (x, y) lands in pixel (x/sub_factor, y/sub_factor).
+    int xlimit = sub_factor*(MIN(buffer_rgba->width, buffer_z->width) - 1);
+    int ylimit = sub_factor*(MIN(buffer_rgba->height, buffer_z->height) - 1);
+    int xstart = 0, ystart = 0;
+    if (ctx->scissor) {
+        xstart = sub_factor*MAX(ctx->scissor_min.e[0], 0);
+        ystart = sub_factor*MAX(ctx->scissor_min.e[1], 0);
+        xlimit = MIN(xlimit, sub_factor*ctx->scissor_max.e[0]);
+        ylimit = MIN(ylimit, sub_factor*ctx->scissor_max.e[1]);
+    }
+    if (xmin > xlimit || ymin > ylimit || xmax < xstart || ymax < ystart) {
+        STATS_ADD(triangles_culled, 1);
+        STATS_TIME_END(STAGE_SETUP, setup_start);
+        return;
+    }
+    if (xmin < xstart || ymin < ystart || xmax > xlimit || ymax > ylimit) {
+        STATS_ADD(triangles_clipped, 1);
+        xmin = MAX(xmin, xstart);
+        ymin = MAX(ymin, ystart);
+        xmax = MIN(xmax, xlimit);
+        ymax = MIN(ymax, ylimit);
+    }
+
     int area = barycentric(sc[0], sc[1], sc[2]); //2 times tri area
+    if (area == 0) {
+        STATS_ADD(triangles_zero_area, 1);
+        STATS_TIME_END(STAGE_SETUP, setup_start);
+        return;
+    }
 
-    // Bounding box test
-    for (int x=xmin; x<=xmax; x+=sub_factor) {
-        for (int y=ymin; y<=ymax; y+=sub_factor) {
-            Vec2i p = {{x, y}};
-            
-            // barycentric (bc_clip?)
-            float w0 = barycentric(sc[1],sc[2],p); //signed 2x area
-            float w1 = barycentric(sc[2],sc[0],p); //signed 2x area
-            float w2 = barycentric(sc[0],sc[1],p); //signed 2x area
-            w0 /= area; w1 /= area; w2 /= area;
-            Vec3f bar = {{w0, w1, w2}};
+    // Tiny triangles, e.g. of dense meshes, often fall between the sample
+    // positions. Test the few samples of their bounding box here, before
+    // setting up varyings and entering the raster loop.
+    int nsamples = 0;
+    if (xmin <= xmax && ymin <= ymax) {
+        nsamples = ((xmax - xmin)/sub_factor + 1)*
+            ((ymax - ymin)/sub_factor + 1);
+    }
+    if (nsamples <= RASTER_TINY_SAMPLES) {
+        int hit = 0;
+        for (int x=xmin; x <= xmax && !hit; x += sub_factor) {
+            for (int y=ymin; y <= ymax && !hit; y += sub_factor) {
+                Vec2i p = {{x, y}};
+                float w0 = (float)barycentric(sc[1], sc[2], p)/area;
+                float w1 = (float)barycentric(sc[2], sc[0], p)/area;
+                float w2 = (float)barycentric(sc[0], sc[1], p)/area;
+                hit = (w0 >= 0 && w1 >= 0 && w2 >= 0);
+            }
+        }
+        if (!hit) {
+            STATS_ADD(triangles_empty, 1);
+            STATS_TIME_END(STAGE_SETUP, setup_start);
+            return;
+        }
+    }
 
-            // Check if within triangle.
-            if (w0 >= 0 && w1 >= 0 && w2 >= 0) {
-                // Get z value by interpolating using barycentric weights.
-                float z =   vertex_pos_clip[0].e[2] * w0 +
-                            vertex_pos_clip[1].e[2] * w1 +
-                            vertex_pos_clip[2].e[2] * w2;
-
-                int zval = (int)(255.f*(z + 1.f)/2.f);
-                
-                int buf_x = ceil((float)x/sub_factor);
-                int buf_y = ceil((float)y/sub_factor);
-
-                // Try to draw pixel to z buffer. 
-                // If if no higher value already present, draw into rgba.
-                if(set_z(buffer_z, buf_x, buf_y, zval)) {
-
-                    // Set frag coords
-                    ctx->shader->frag_coord.e[0] = buf_x;
-                    ctx->shader->frag_coord.e[1] = buf_y;
-
-                    // Get color
-                    Vec3f col;
-                    ctx->shader->fragment_shader(bar, &col, ctx->shader);
-                    col.e[0] = clamp(col.e[0], 0.f, 1.f);
-                    col.e[1] = clamp(col.e[1], 0.f, 1.f);
-                    col.e[2] = clamp(col.e[2], 0.f, 1.f);
-                    color = ((int)(col.e[0]*0xff) << 16) + 
-                        ((int)(col.e[1]*0xff) << 8) + 
-                        ((int)(col.e[2]*0xff));
-                    set_color(buffer_rgba, buf_x, buf_y, color);
-                }
+    // Set values of default varying variables of base shader.
+    for (int j=0; j < 3; j++) {
+        m33fsetcol(&ctx->shader->varying_vertex_normal, j, n[j]);
+        m33fsetcol(&ctx->shader->varying_vertex_uv,     j, uv[j]);
+        m33fsetcol(&ctx->shader->varying_vertex_pos,    j, vertex_pos[j]);
+        m33fsetcol(&ctx->shader->varying_vertex_post,   j, 
+                v4f2v3f(sv[j]->post));
+    }
+
+    float clip_z[3] = {sv[0]->clip_z, sv[1]->clip_z, sv[2]->clip_z};
+
+    STATS_TIME_END(STAGE_SETUP, setup_start);
+
+    if (ctx->debug != DEBUG_NONE && ctx->debug_counts != NULL) {
+        rasterize_debug(sc, clip_z, area, xmin, xmax, ymin, ymax,
+                ctx, buffer_z);
+        return;
+    }
+
+    // Depth test and color write are specialized per buffer format.
+    rasterize_fn rasterize = select_rasterizer(buffer_rgba, buffer_z);
+    rasterize(sc, clip_z, area, xmin, xmax, ymin, ymax,
+            ctx, buffer_rgba, buffer_z);
+}
+
+void triangle(Vec3f v0, Vec3f v1, Vec3f v2,
+        Vec3f v0uv, Vec3f v1uv, Vec3f v2uv, 
+        Vec3f n0, Vec3f n1, Vec3f n2, uint32_t color,
+        RenderContext* ctx, ScreenBuffer* buffer_rgba, ScreenBuffer* buffer_z) {
+    (void)color;
+    Vec3f vertex_pos[3] = {v0, v1, v2}; // vertex pos. world coords
+    Vec3f uv[3] = {v0uv, v1uv, v2uv};
+    Vec3f n[3] = {n0, n1, n2};
+
+    STATS_TIME_BEGIN(vertex_start);
+
+    ShadedVertex shaded[3];
+    for(int j=0; j < 3; j++) {
+        // Call vertex shader
+        Vec4f post = ctx->shader->vertex_shader(vertex_pos[j], j, ctx->shader);
+        shaded[j] = vertex_post(post, ctx->shader->viewport);
+    }
+
+    STATS_TIME_END(STAGE_VERTEX, vertex_start);
+
+    const ShadedVertex *sv[3] = {&shaded[0], &shaded[1], &shaded[2]};
+    triangle_setup(sv, vertex_pos, uv, n, ctx, buffer_rgba, buffer_z);
+}
+
+// Color ramp for debug_heatmap(), evenly spaced from 0 to max count.
+static const float heatmap_ramp[][3] = {
+    {0.f, 0.f, 0.f},
+    {0.f, 0.f, 1.f},
+    {0.f, 1.f, 0.f},
+    {1.f, 1.f, 0.f},
+    {1.f, 0.f, 0.f},
+    {1.f, 1.f, 1.f},
+};
+
+uint32_t debug_heatmap(ScreenBuffer *counts, ScreenBuffer *rgba,
+        uint32_t max_count) {
+    int width = MIN(counts->width, rgba->width);
+    int height = MIN(counts->height, rgba->height);
+    const int nramp = sizeof(heatmap_ramp)/sizeof(heatmap_ramp[0]);
+
+    if (max_count == 0) {
+        for (int y=0; y < height; y++) {
+            uint32_t *in = (uint32_t *)((char *)counts->memory + y*counts->pitch);
+            for (int x=0; x < width; x++) {
+                max_count = MAX(max_count, in[x]);
             }
         }
-    } // End bounding-box loop.
+        max_count = MAX(max_count, 1);
+    }
+
+    for (int y=0; y < height; y++) {
+        uint32_t *in = (uint32_t *)((char *)counts->memory + y*counts->pitch);
+        uint32_t *out = (uint32_t *)((char *)rgba->memory + y*rgba->pitch);
+        for (int x=0; x < width; x++) {
+            float t = MIN((float)in[x]/max_count, 1.f)*(nramp - 1);
+            int i = MIN((int)t, nramp - 2);
+            float f = t - i;
+            const float *a = heatmap_ramp[i];
+            const float *b = heatmap_ramp[i + 1];
+            out[x] = pack_color(rgba->format,
+                    (int)((a[0] + (b[0] - a[0])*f)*0xff),
+                    (int)((a[1] + (b[1] - a[1])*f)*0xff),
+                    (int)((a[2] + (b[2] - a[2])*f)*0xff), 0xff);
+        }
+    }
+    return max_count;
 }
 
-void draw_model(Mesh obj, RenderContext* ctx, ScreenBuffer* buffer_rgb, 
-        ScreenBuffer* buffer_z) {
+void render_stats_end(RenderContext *ctx) {
+    if (ctx->stats != NULL) {
+        stats_collect(ctx->stats);
+    } else {
+        RenderStats discard = {0};
+        stats_collect(&discard);
+    }
+}
+
+// Mesh positions gathered into batches and the vertex stage output for the
+// mesh being drawn, grown as needed and kept across draws. One set per 
+// thread so concurrent draws don't share them.
+static _Thread_local VertexBatch *batch_cache;
+static _Thread_local int batch_cache_size;
+static _Thread_local ShadedVertex *vertex_cache;
+static _Thread_local int vertex_cache_size;
+
+// Gathers the mesh positions into VERTEX_BATCH wide blocks. Returns the 
+// batches or NULL if allocation failed.
+static VertexBatch *gather_vertices(Mesh *obj) {
+    int n = obj->nverts/3;
+    int nbatches = (n + VERTEX_BATCH - 1)/VERTEX_BATCH;
+    if (nbatches > batch_cache_size) {
+        // realloc doesn't keep the alignment of VertexBatch.
+        VertexBatch *cache = aligned_alloc(_Alignof(VertexBatch), 
+                nbatches*sizeof(VertexBatch));
+        if (cache == NULL) {
+            return NULL;
+        }
+        free(batch_cache);
+        batch_cache = cache;
+        batch_cache_size = nbatches;
+        jobs_thread_cleanup(gl_thread_cleanup);
+    }
+
+    for (int b=0; b < nbatches; b++) {
+        VertexBatch *batch = &batch_cache[b];
+        int i = b*VERTEX_BATCH;
+        batch->count = MIN(VERTEX_BATCH, n - i);
+        for (int k=0; k < VERTEX_BATCH; k++) {
+            for (int c=0; c < 3; c++) {
+                batch->pos[c][k] = (k < batch->count) ? 
+                    obj->verts[3*(i + k) + c] : 0.f;
+            }
+        }
+    }
+    return batch_cache;
+}
+
+// Vertex batches per job when the vertex stage runs on a job pool.
+#define VERTEX_JOB_BATCHES 64
+
+// Runs the batched vertex shader over batches first to end into out, 
+// indexed like the mesh positions.
+static void shade_batches(VertexBatch *batches, int first, int end,
+        ShaderBase *shader, ShadedVertex *out) {
+    static const int sub_factor = 16;
+    for (int b=first; b < end; b++) {
+        int i = b*VERTEX_BATCH;
+        VertexBatch *batch = &batches[b];
+        shader->vertex_shader_batch(batch, shader);
+
+        // vertex_post() across the batch. Same arithmetic, including the 
+        // order of the viewport sums, so results match triangle().
+        const float *vp = shader->viewport.e;
+        for (int k=0; k < batch->count; k++) {
+            float w = batch->clip[3][k];
+            float x = batch->clip[0][k]/w;
+            float y = batch->clip[1][k]/w;
+            float z = batch->clip[2][k]/w;
+            float one = w/w;
+
+            ShadedVertex *sv = &out[i + k];
+            Vec4f post = {{batch->clip[0][k], batch->clip[1][k], 
+                batch->clip[2][k], w}};
+            sv->post = post;
+            sv->clip_z = z;
+            sv->sc.e[0] = (vp[0]*x + vp[1]*y + vp[2]*z + vp[3]*one)*sub_factor;
+            sv->sc.e[1] = (vp[4]*x + vp[5]*y + vp[6]*z + vp[7]*one)*sub_factor;
+        }
+    }
+}
+
+typedef struct {
+    VertexBatch *batches;
+    int nbatches;
+    ShaderBase *shader;
+    ShadedVertex *out;
+} VertexJob;
+
+static void vertex_job(void *arg, int index) {
+    VertexJob *job = arg;
+    int first = index*VERTEX_JOB_BATCHES;
+    shade_batches(job->batches, first, 
+            MIN(first + VERTEX_JOB_BATCHES, job->nbatches), job->shader,
+            job->out);
+}
+
+// Runs the batched vertex shader over n gathered vertices, split into jobs
+// when a pool is given. Returns the shaded vertices, indexed like the mesh
+// positions, or NULL if allocation failed.
+static ShadedVertex *shade_vertices(VertexBatch *batches, int n, 
+        ShaderBase *shader, JobPool *jobs) {
+    if (n > vertex_cache_size) {
+        ShadedVertex *cache = realloc(vertex_cache, n*sizeof(ShadedVertex));
+        if (cache == NULL) {
+            return NULL;
+        }
+        vertex_cache = cache;
+        vertex_cache_size = n;
+        jobs_thread_cleanup(gl_thread_cleanup);
+    }
+
+    int nbatches = (n + VERTEX_BATCH - 1)/VERTEX_BATCH;
+    VertexJob job = {batches, nbatches, shader, vertex_cache};
+    jobs_parallel_for(jobs, 
+            (nbatches + VERTEX_JOB_BATCHES - 1)/VERTEX_JOB_BATCHES,
+            vertex_job, &job);
+    return vertex_cache;
+}
+
+// Vertex stage for a whole mesh. Returns NULL when the shader has no batch
+// function or allocation failed, faces then go through triangle().
+static ShadedVertex *shade_mesh(VertexBatch *batches, Mesh *obj, 
+        ShaderBase *shader, JobPool *jobs) {
+    if (batches == NULL) {
+        return NULL;
+    }
+    TRACE_BEGIN(vertex_start);
+    STATS_TIME_BEGIN(vertex_time);
+    ShadedVertex *shaded = shade_vertices(batches, obj->nverts/3, shader,
+            jobs);
+    STATS_TIME_END(STAGE_VERTEX, vertex_time);
+    TRACE_END(vertex_start, "vertex");
+    return shaded;
+}
+
+// Gathers the attributes of faces first to first + count and sets up and
+// rasterizes them, from the shaded vertices if given.
+static void draw_faces(Mesh obj, int first, int count, ShadedVertex *shaded,
+        RenderContext* ctx, ScreenBuffer* buffer_rgb, ScreenBuffer* buffer_z) {
     int *faces = obj.faces_verts;
     int *faces_uvs = obj.faces_uvs;
     int *faces_normals = obj.faces_normals;
@@ -226,8 +742,8 @@ void draw_model(Mesh obj, RenderContext* ctx, ScreenBuffer* buffer_rgb,
     float *uvs = obj.uvs;
     float *normals = obj.normals;
 
-    int n_faces = obj.nfaces_verts;
-    for(int i = 0; i < n_faces; i=i+3) {
+    int end = 3*(first + count);
+    for(int i = 3*first; i < end; i=i+3) {
         int vert_indecies[3], uv_indecies[3], normal_indecies[3];
 
         if (obj.nuvs > 0) {
@@ -274,9 +790,825 @@ void draw_model(Mesh obj, RenderContext* ctx, ScreenBuffer* buffer_rgb,
             normal_coords[j] = n;
         }
 
-        triangle(world_coords[0], world_coords[1], world_coords[2],
-                uv_coords[0], uv_coords[1], uv_coords[2],
-                normal_coords[0], normal_coords[1], normal_coords[2], 0,
-                ctx, buffer_rgb, buffer_z);
+        if (shaded != NULL) {
+            const ShadedVertex *sv[3] = {&shaded[vert_indecies[0]],
+                &shaded[vert_indecies[1]], &shaded[vert_indecies[2]]};
+            triangle_setup(sv, world_coords, uv_coords, normal_coords,
+                    ctx, buffer_rgb, buffer_z);
+        } else {
+            triangle(world_coords[0], world_coords[1], world_coords[2],
+                    uv_coords[0], uv_coords[1], uv_coords[2],
+                    normal_coords[0], normal_coords[1], normal_coords[2], 0,
+                    ctx, buffer_rgb, buffer_z);
+        }
+    }
+}
+
+// Private targets and shader copies of DRAW_SORT_LAST threads, grown as 
+// needed and kept across draws. Index 0 is unused, the calling thread draws
+// straight into the target.
+typedef struct {
+    ScreenBuffer rgba[SORT_LAST_MAX_THREADS];
+    ScreenBuffer z[SORT_LAST_MAX_THREADS];
+    char *shaders;
+    size_t shader_stride;
+} SortLastCache;
+static _Thread_local SortLastCache *sort_last_cache;
+
+// A sort-last draw, shared by its threads.
+typedef struct {
+    Mesh obj;
+    ShadedVertex *shaded;
+    RenderContext *ctx;
+    ScreenBuffer *rgba;
+    ScreenBuffer *z;
+    SortLastCache *cache;
+    int nthreads;
+} SortLastDraw;
+
+static int sort_last_buffer(ScreenBuffer *priv, const ScreenBuffer *target) {
+    if (priv->memory != NULL && priv->type == target->type &&
+            priv->width == target->width && priv->height == target->height) {
+        return 0;
+    }
+    buffer_free(priv);
+    if (buffer_init(priv, target->type, target->width, target->height)) {
+        return 1;
+    }
+    priv->format = target->format;
+    return 0;
+}
+
+// Sets up the private buffers and shader copies for nthreads. Returns NULL
+// if allocation failed.
+static SortLastCache *sort_last_setup(RenderContext *ctx, ScreenBuffer *rgba,
+        ScreenBuffer *z, int nthreads) {
+    SortLastCache *cache = sort_last_cache;
+    if (cache == NULL) {
+        cache = calloc(1, sizeof(SortLastCache));
+        if (cache == NULL) {
+            return NULL;
+        }
+        sort_last_cache = cache;
+        jobs_thread_cleanup(gl_thread_cleanup);
+    }
+    // Shaders hold aligned matrices.
+    size_t stride = (ctx->shader_size + 15) & ~(size_t)15;
+    if (stride > cache->shader_stride) {
+        char *shaders = aligned_alloc(16, SORT_LAST_MAX_THREADS*stride);
+        if (shaders == NULL) {
+            return NULL;
+        }
+        free(cache->shaders);
+        cache->shaders = shaders;
+        cache->shader_stride = stride;
+    }
+    for (int k=1; k < nthreads; k++) {
+        if (sort_last_buffer(&cache->rgba[k], rgba) ||
+                sort_last_buffer(&cache->z[k], z)) {
+            return NULL;
+        }
+    }
+    return cache;
+}
+
+static void sort_last_raster(void *arg, int k) {
+    SortLastDraw *draw = arg;
+    TRACE_BEGIN(raster_start);
+    RenderContext ctx = *draw->ctx;
+    ctx.shader = (ShaderBase *)(draw->cache->shaders + 
+            k*draw->cache->shader_stride);
+    memcpy(ctx.shader, draw->ctx->shader, draw->ctx->shader_size);
+
+    int nfaces = draw->obj.nfaces_verts/3;
+    int first = (int)((long)nfaces*k/draw->nthreads);
+    int end = (int)((long)nfaces*(k + 1)/draw->nthreads);
+    ScreenBuffer *rgba = draw->rgba, *z = draw->z;
+    if (k > 0) {
+        rgba = &draw->cache->rgba[k];
+        z = &draw->cache->z[k];
+        buffer_clear(rgba);
+        buffer_clear(z);
+    }
+    draw_faces(draw->obj, first, end - first, draw->shaded, &ctx, rgba, z);
+    TRACE_END(raster_start, "sort-last raster");
+}
+
+#ifdef __SSE2__
+static inline __m128i select_si128(__m128i mask, __m128i a, __m128i b) {
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+// Depth merge of 4 pixels per format. Keeps the closer depth in dst and 
+// returns the lanes where src was closer.
+static inline __m128i merge_z4_int(int *dst, const int *src) {
+    __m128i a = _mm_loadu_si128((const __m128i *)src);
+    __m128i b = _mm_loadu_si128((const __m128i *)dst);
+    __m128i mask = _mm_cmpgt_epi32(a, b);
+    _mm_storeu_si128((__m128i *)dst, select_si128(mask, a, b));
+    return mask;
+}
+
+static inline __m128i merge_z4_uint16_t(uint16_t *dst, const uint16_t *src) {
+    __m128i a = _mm_loadl_epi64((const __m128i *)src);
+    __m128i b = _mm_loadl_epi64((const __m128i *)dst);
+    // Zero extended, so the signed compare works for all 16-bit depths.
+    __m128i zero = _mm_setzero_si128();
+    __m128i mask = _mm_cmpgt_epi32(_mm_unpacklo_epi16(a, zero),
+            _mm_unpacklo_epi16(b, zero));
+    __m128i mask16 = _mm_packs_epi32(mask, mask);
+    _mm_storel_epi64((__m128i *)dst, select_si128(mask16, a, b));
+    return mask;
+}
+
+static inline __m128i merge_z4_float(float *dst, const float *src) {
+    __m128 a = _mm_loadu_ps(src);
+    __m128 b = _mm_loadu_ps(dst);
+    __m128 mask = _mm_cmpgt_ps(a, b);
+    _mm_storeu_ps(dst, _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)));
+    return _mm_castps_si128(mask);
+}
+
+// Copies the colors of pixels i to i + 3 from src where mask is set.
+static inline void merge_color4(ScreenBuffer *dst, const ScreenBuffer *src,
+        int i, __m128i mask) {
+    if (dst->type == BUF_RGBA) {
+        __m128i *d = (__m128i *)((uint32_t *)dst->memory + i);
+        __m128i a = _mm_loadu_si128((const __m128i *)
+                ((const uint32_t *)src->memory + i));
+        _mm_storeu_si128(d, select_si128(mask, a, _mm_loadu_si128(d)));
+        return;
+    }
+    __m128i *d = (__m128i *)dst->memory + i;
+    const __m128i *s = (const __m128i *)src->memory + i;
+    __m128i lanes[4] = {_mm_shuffle_epi32(mask, 0x00),
+        _mm_shuffle_epi32(mask, 0x55), _mm_shuffle_epi32(mask, 0xaa),
+        _mm_shuffle_epi32(mask, 0xff)};
+    for (int j=0; j < 4; j++) {
+        _mm_storeu_si128(&d[j], select_si128(lanes[j], 
+                    _mm_loadu_si128(&s[j]), _mm_loadu_si128(&d[j])));
+    }
+}
+
+#define MERGE_SIMD(type)                                                    \
+        for (; i + 4 <= end; i += 4) {                                      \
+            __m128i mask = merge_z4_##type(&dz[i], &sz[i]);                 \
+            if (_mm_movemask_epi8(mask)) {                                  \
+                merge_color4(dst_rgba, src_rgba, i, mask);                  \
+            }                                                               \
+        }
+#else
+#define MERGE_SIMD(type)
+#endif
+
+// Depth merge of pixels start to end of a private target into the target,
+// one instance per depth format. draw_faces_sort_last() only runs on tightly
+// packed targets of the same size, like the private ones from buffer_init(),
+// so pixels are indexed linearly. src only wins when strictly closer,
+// like the depth test, so earlier face ranges win ties.
+#define MERGE_FN(fname, type)                                               \
+    static void fname(ScreenBuffer *dst_rgba, ScreenBuffer *dst_z,          \
+            const ScreenBuffer *src_rgba, const ScreenBuffer *src_z,        \
+            int start, int end) {                                           \
+        type *dz = (type *)dst_z->memory;                                   \
+        const type *sz = (const type *)src_z->memory;                       \
+        int depth = dst_rgba->depth;                                        \
+        int i = start;                                                      \
+        MERGE_SIMD(type)                                                    \
+        for (; i < end; i++) {                                              \
+            if (sz[i] > dz[i]) {                                            \
+                dz[i] = sz[i];                                              \
+                memcpy((char *)dst_rgba->memory + i*depth,                  \
+                        (const char *)src_rgba->memory + i*depth, depth);   \
+            }                                                               \
+        }                                                                   \
+    }                                                                       \
+
+MERGE_FN(merge_z, int)
+MERGE_FN(merge_z16, uint16_t)
+MERGE_FN(merge_z32f, float)
+
+static void sort_last_merge(void *arg, int k) {
+    SortLastDraw *draw = arg;
+    TRACE_BEGIN(merge_start);
+    int npixels = draw->z->width*draw->z->height;
+    int start = (int)((long)npixels*k/draw->nthreads);
+    int end = (int)((long)npixels*(k + 1)/draw->nthreads);
+    // In thread order so ties resolve like DRAW_IMMEDIATE.
+    for (int j=1; j < draw->nthreads; j++) {
+        ScreenBuffer *rgba = &draw->cache->rgba[j];
+        ScreenBuffer *z = &draw->cache->z[j];
+        switch (draw->z->type) {
+            case BUF_Z16: 
+                merge_z16(draw->rgba, draw->z, rgba, z, start, end);
+                break;
+            case BUF_Z32F:
+                merge_z32f(draw->rgba, draw->z, rgba, z, start, end);
+                break;
+            default:
+                merge_z(draw->rgba, draw->z, rgba, z, start, end);
+                break;
+        }
+    }
+    TRACE_END(merge_start, "sort-last merge");
+}
+
+// Draws the faces with DRAW_SORT_LAST. Returns 1 if the draw can't use it.
+static int draw_faces_sort_last(Mesh obj, ShadedVertex *shaded, 
+        RenderContext* ctx, ScreenBuffer* buffer_rgb, ScreenBuffer* buffer_z) {
+    if (ctx->jobs == NULL || ctx->shader_size == 0 || 
+            ctx->debug != DEBUG_NONE || 
+            buffer_rgb->width != buffer_z->width ||
+            buffer_rgb->height != buffer_z->height ||
+            buffer_rgb->pitch != buffer_rgb->width*buffer_rgb->depth ||
+            buffer_z->pitch != buffer_z->width*buffer_z->depth) {
+        // The merge indexes the targets as tightly packed.
+        return 1;
+    }
+    int nthreads = ctx->threads > 0 ? ctx->threads : jobs_threads(ctx->jobs);
+    nthreads = MIN(MAX(nthreads, 1), SORT_LAST_MAX_THREADS);
+    nthreads = MIN(nthreads, MAX(obj.nfaces_verts/3, 1));
+    if (nthreads < 2) {
+        return 1;
+    }
+    SortLastCache *cache = sort_last_setup(ctx, buffer_rgb, buffer_z, 
+            nthreads);
+    if (cache == NULL) {
+        return 1;
+    }
+
+    SortLastDraw draw = {obj, shaded, ctx, buffer_rgb, buffer_z, cache,
+        nthreads};
+    jobs_parallel_for(ctx->jobs, nthreads, sort_last_raster, &draw);
+    jobs_parallel_for(ctx->jobs, nthreads, sort_last_merge, &draw);
+    return 0;
+}
+
+void draw_model(Mesh obj, RenderContext* ctx, ScreenBuffer* buffer_rgb, 
+        ScreenBuffer* buffer_z) {
+    TRACE_BEGIN(draw_start);
+    VertexBatch *batches = NULL;
+    if (ctx->shader->vertex_shader_batch != NULL) {
+        batches = gather_vertices(&obj);
+    }
+    ShadedVertex *shaded = shade_mesh(batches, &obj, ctx->shader, ctx->jobs);
+    if (ctx->draw_strategy != DRAW_SORT_LAST || draw_faces_sort_last(obj,
+                shaded, ctx, buffer_rgb, buffer_z) != 0) {
+        draw_faces(obj, 0, obj.nfaces_verts/3, shaded, ctx, buffer_rgb, 
+                buffer_z);
+    }
+    TRACE_END(draw_start, "draw_model");
+}
+
+ShadedVertex *draw_vertex_stage(Mesh obj, RenderContext *ctx) {
+    if (ctx->shader->vertex_shader_batch == NULL) {
+        return NULL;
+    }
+    return shade_mesh(gather_vertices(&obj), &obj, ctx->shader, ctx->jobs);
+}
+
+void draw_model_ranges(Mesh obj, const FaceRange *ranges, int nranges,
+        RenderContext* ctx, ScreenBuffer* buffer_rgb, ScreenBuffer* buffer_z) {
+    TRACE_BEGIN(draw_start);
+    VertexBatch *batches = NULL;
+    if (ctx->shader->vertex_shader_batch != NULL) {
+        batches = gather_vertices(&obj);
+    }
+    ShadedVertex *shaded = shade_mesh(batches, &obj, ctx->shader, ctx->jobs);
+    for (int i=0; i < nranges; i++) {
+        draw_faces(obj, ranges[i].first, ranges[i].count, shaded, ctx,
+                buffer_rgb, buffer_z);
+    }
+    TRACE_END(draw_start, "draw_model_ranges");
+}
+
+void draw_model_range(Mesh obj, int first, int count, RenderContext* ctx,
+        ScreenBuffer* buffer_rgb, ScreenBuffer* buffer_z) {
+    FaceRange range = {first, count};
+    draw_model_ranges(obj, &range, 1, ctx, buffer_rgb, buffer_z);
+}
+
+Aabb mesh_bounds(Mesh obj) {
+    Aabb box = {{{0.f, 0.f, 0.f}}, {{0.f, 0.f, 0.f}}};
+    for (int i=0; i < obj.nverts; i += 3) {
+        for (int c=0; c < 3; c++) {
+            float v = obj.verts[i + c];
+            if (i == 0 || v < box.min.e[c]) box.min.e[c] = v;
+            if (i == 0 || v > box.max.e[c]) box.max.e[c] = v;
+        }
+    }
+    return box;
+}
+
+Aabb aabb_transform(Aabb box, Mat44f m) {
+    // Per axis, the extremes of sum_j(m_ij*v_j) pick min or max of v_j 
+    // independently.
+    Aabb out;
+    for (int i=0; i < 3; i++) {
+        float lo = m.e[4*i + 3], hi = m.e[4*i + 3];
+        for (int j=0; j < 3; j++) {
+            float a = m.e[4*i + j]*box.min.e[j];
+            float b = m.e[4*i + j]*box.max.e[j];
+            lo += MIN(a, b);
+            hi += MAX(a, b);
+        }
+        out.min.e[i] = lo;
+        out.max.e[i] = hi;
+    }
+    return out;
+}
+
+Frustum frustum_from_matrix(Mat44f m) {
+    // Gribb-Hartmann, -w <= x <= w and -w <= y <= w in terms of the rows.
+    Vec4f row_x = m44frow(m, 0);
+    Vec4f row_y = m44frow(m, 1);
+    Vec4f row_w = m44frow(m, 3);
+    Frustum f;
+    f.planes[0] = v4fadd(row_w, row_x);
+    f.planes[1] = v4fsub(row_w, row_x);
+    f.planes[2] = v4fadd(row_w, row_y);
+    f.planes[3] = v4fsub(row_w, row_y);
+    f.planes[4] = row_w;
+    return f;
+}
+
+int frustum_test_aabb(const Frustum *frustum, Aabb box) {
+    for (int i=0; i < FRUSTUM_PLANES; i++) {
+        const float *p = frustum->planes[i].e;
+        // Corner furthest along the plane normal.
+        float d = p[3];
+        for (int c=0; c < 3; c++) {
+            d += p[c]*(p[c] >= 0.f ? box.max.e[c] : box.min.e[c]);
+        }
+        if (d < 0.f || (i == FRUSTUM_PLANES - 1 && d == 0.f)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int draw_model_instanced(Mesh obj, const Aabb *bounds, const Mat44f *models,
+        int count, instance_uniforms_fn uniforms, void *userdata,
+        RenderContext* ctx, ScreenBuffer* buffer_rgb, ScreenBuffer* buffer_z) {
+    TRACE_BEGIN(draw_start);
+    ShaderBase *shader = ctx->shader;
+    Aabb box = bounds ? *bounds : mesh_bounds(obj);
+    Mat44f view = shader->modelview;
+    Mat44f mvp = shader->mvp;
+
+    // Positions are gathered once and reused by every instance.
+    VertexBatch *batches = NULL;
+    if (shader->vertex_shader_batch != NULL) {
+        batches = gather_vertices(&obj);
+    }
+
+    int drawn = 0;
+    STATS_ADD(instances_submitted, count);
+    for (int i=0; i < count; i++) {
+        shader->modelview = m44fm44f(view, models[i]);
+        shader->mvp = m44fm44f(shader->projection, shader->modelview);
+
+        Frustum frustum = frustum_from_matrix(shader->mvp);
+        if (!frustum_test_aabb(&frustum, box)) {
+            STATS_ADD(instances_culled, 1);
+            continue;
+        }
+        if (uniforms != NULL) {
+            uniforms(shader, i, userdata);
+        }
+
+        ShadedVertex *shaded = shade_mesh(batches, &obj, shader, ctx->jobs);
+        draw_faces(obj, 0, obj.nfaces_verts/3, shaded, ctx, buffer_rgb,
+                buffer_z);
+        drawn++;
+    }
+
+    shader->modelview = view;
+    shader->mvp = mvp;
+    TRACE_END(draw_start, "draw_model_instanced");
+    return drawn;
+}
+
+// Row y of a BUF_Z32F buffer, flipped like set_zf().
+static inline float *depth_row(ScreenBuffer *buffer_z, int y) {
+    return (float *)buffer_z->memory + 
+        (buffer_z->height - 1 - y)*buffer_z->width;
+}
+
+void triangle_depth(Vec4f v0, Vec4f v1, Vec4f v2, ScreenBuffer *buffer_z) {
+    if (v0.e[3] <= 0.f || v1.e[3] <= 0.f || v2.e[3] <= 0.f) {
+        return;
+    }
+    int width = buffer_z->width, height = buffer_z->height;
+    Vec4f *v[3] = {&v0, &v1, &v2};
+    float sx[3], sy[3], d = INFINITY;
+    for (int i=0; i < 3; i++) {
+        float inv_w = 1.f/v[i]->e[3];
+        sx[i] = (v[i]->e[0]*inv_w + 1.f)*.5f*width;
+        sy[i] = (v[i]->e[1]*inv_w + 1.f)*.5f*height;
+        d = MIN(d, (v[i]->e[2]*inv_w + 1.f)*.5f);
+    }
+
+    float area = (sx[1] - sx[0])*(sy[2] - sy[0]) - 
+        (sy[1] - sy[0])*(sx[2] - sx[0]);
+    if (area == 0.f) {
+        return;
+    }
+    // Either winding, edges are oriented to be positive inside.
+    float sign = area > 0.f ? 1.f : -1.f;
+
+    // Edge i runs from vertex i to i + 1. Its value at a pixel center must
+    // exceed the largest change across half a pixel for the whole pixel to
+    // be inside.
+    float ex[3], ey[3], e0[3], margin[3];
+    for (int i=0; i < 3; i++) {
+        int j = (i + 1) % 3;
+        ex[i] = -sign*(sy[j] - sy[i]);
+        ey[i] = sign*(sx[j] - sx[i]);
+        e0[i] = -(ex[i]*sx[i] + ey[i]*sy[i]);
+        margin[i] = .5f*(fabsf(ex[i]) + fabsf(ey[i]));
+    }
+
+    int x0 = MAX((int)floorf(MIN(sx[0], MIN(sx[1], sx[2]))), 0);
+    int x1 = MIN((int)ceilf(MAX(sx[0], MAX(sx[1], sx[2]))), width) - 1;
+    int y0 = MAX((int)floorf(MIN(sy[0], MIN(sy[1], sy[2]))), 0);
+    int y1 = MIN((int)ceilf(MAX(sy[0], MAX(sy[1], sy[2]))), height) - 1;
+
+    for (int y=y0; y <= y1; y++) {
+        float *row = depth_row(buffer_z, y);
+        float py = y + .5f;
+        for (int x=x0; x <= x1; x++) {
+            float px = x + .5f;
+            int inside = 1;
+            for (int i=0; i < 3; i++) {
+                inside &= ex[i]*px + ey[i]*py + e0[i] >= margin[i];
+            }
+            if (inside && row[x] < d) {
+                row[x] = d;
+            }
+        }
+    }
+}
+
+// Clip space positions for draw_model_depth(), per thread like the vertex
+// stage caches.
+static _Thread_local Vec4f *depth_cache;
+static _Thread_local int depth_cache_size;
+
+// Transforms the mesh vertices by mvp into depth_cache. Returns NULL if 
+// allocation failed.
+static Vec4f *clip_positions(Mesh *obj, Mat44f mvp) {
+    int n = obj->nverts/3;
+    if (n > depth_cache_size) {
+        Vec4f *cache = aligned_alloc(_Alignof(Vec4f), n*sizeof(Vec4f));
+        if (cache == NULL) {
+            return NULL;
+        }
+        free(depth_cache);
+        depth_cache = cache;
+        depth_cache_size = n;
+        jobs_thread_cleanup(gl_thread_cleanup);
+    }
+    m44fv3p_batch(mvp, obj->verts, depth_cache, n);
+    return depth_cache;
+}
+
+void gl_thread_cleanup(void) {
+    free(batch_cache);
+    free(vertex_cache);
+    free(depth_cache);
+    batch_cache = NULL;
+    vertex_cache = NULL;
+    depth_cache = NULL;
+    batch_cache_size = vertex_cache_size = depth_cache_size = 0;
+
+    SortLastCache *cache = sort_last_cache;
+    if (cache != NULL) {
+        for (int k=0; k < SORT_LAST_MAX_THREADS; k++) {
+            buffer_free(&cache->rgba[k]);
+            buffer_free(&cache->z[k]);
+        }
+        free(cache->shaders);
+        free(cache);
+        sort_last_cache = NULL;
+    }
+}
+
+void draw_model_depth(Mesh obj, Mat44f mvp, ScreenBuffer *buffer_z) {
+    TRACE_BEGIN(draw_start);
+    Vec4f *clip = clip_positions(&obj, mvp);
+    if (clip == NULL) {
+        return;
+    }
+    for (int i=0; i < obj.nfaces_verts; i += 3) {
+        triangle_depth(clip[obj.faces_verts[i]], clip[obj.faces_verts[i + 1]],
+                clip[obj.faces_verts[i + 2]], buffer_z);
+    }
+    TRACE_END(draw_start, "draw_model_depth");
+}
+
+// Shadow map raster loop, one instance per depth format. Walks the bounding
+// box with the edge functions and depth plane stepped per pixel.
+#define SHADOW_RASTER_FN(fname, type, quantize)                             \
+    static void fname(const float sx[3], const float sy[3],                \
+            const float sz[3], ScreenBuffer *buffer_z) {                    \
+        int width = buffer_z->width, height = buffer_z->height;             \
+        float area = (sx[1] - sx[0])*(sy[2] - sy[0]) -                      \
+            (sy[1] - sy[0])*(sx[2] - sx[0]);                                \
+        if (area == 0.f) {                                                  \
+            return;                                                         \
+        }                                                                   \
+        /* Either winding, edges are oriented to be positive inside. */     \
+        float sign = area > 0.f ? 1.f : -1.f;                               \
+        float ex[3], ey[3], e0[3];                                          \
+        for (int i=0; i < 3; i++) {                                         \
+            int j = (i + 1) % 3;                                            \
+            ex[i] = -sign*(sy[j] - sy[i]);                                  \
+            ey[i] = sign*(sx[j] - sx[i]);                                   \
+            e0[i] = -(ex[i]*sx[i] + ey[i]*sy[i]);                           \
+        }                                                                   \
+        /* Edge i + 1 is opposite vertex i, its value over the area is */   \
+        /* the barycentric weight of the vertex. */                         \
+        float zx = 0.f, zy = 0.f, z0 = 0.f, inv_area = sign/area;           \
+        for (int i=0; i < 3; i++) {                                         \
+            int j = (i + 1) % 3;                                            \
+            zx += sz[i]*ex[j]*inv_area;                                     \
+            zy += sz[i]*ey[j]*inv_area;                                     \
+            z0 += sz[i]*e0[j]*inv_area;                                     \
+        }                                                                   \
+                                                                            \
+        int x0 = MAX((int)floorf(MIN(sx[0], MIN(sx[1], sx[2]))), 0);        \
+        int x1 = MIN((int)ceilf(MAX(sx[0], MAX(sx[1], sx[2]))), width) - 1; \
+        int y0 = MAX((int)floorf(MIN(sy[0], MIN(sy[1], sy[2]))), 0);        \
+        int y1 = MIN((int)ceilf(MAX(sy[0], MAX(sy[1], sy[2]))), height) - 1;\
+        for (int y=y0; y <= y1; y++) {                                      \
+            type *row = (type *)((char *)buffer_z->memory +                 \
+                    (height - 1 - y)*buffer_z->pitch);                      \
+            float px = x0 + .5f, py = y + .5f;                              \
+            float w0 = ex[0]*px + ey[0]*py + e0[0];                         \
+            float w1 = ex[1]*px + ey[1]*py + e0[1];                         \
+            float w2 = ex[2]*px + ey[2]*py + e0[2];                         \
+            float z = zx*px + zy*py + z0;                                   \
+            for (int x=x0; x <= x1; x++) {                                  \
+                if (w0 >= 0.f && w1 >= 0.f && w2 >= 0.f) {                 \
+                    type d = quantize((z + 1.f)/2.f);                       \
+                    if (row[x] < d) {                                       \
+                        row[x] = d;                                         \
+                    }                                                       \
+                }                                                           \
+                w0 += ex[0]; w1 += ex[1]; w2 += ex[2];                      \
+                z += zx;                                                    \
+            }                                                               \
+        }                                                                   \
+    }                                                                       \
+
+SHADOW_RASTER_FN(shadow_raster_z, int, depth_z)
+SHADOW_RASTER_FN(shadow_raster_z16, uint16_t, depth_z16)
+SHADOW_RASTER_FN(shadow_raster_z32f, float, depth_z32f)
+
+void triangle_shadow(Vec4f v0, Vec4f v1, Vec4f v2, ScreenBuffer *buffer_z) {
+    if (v0.e[3] <= 0.f || v1.e[3] <= 0.f || v2.e[3] <= 0.f) {
+        return;
+    }
+    Vec4f *v[3] = {&v0, &v1, &v2};
+    float sx[3], sy[3], sz[3];
+    for (int i=0; i < 3; i++) {
+        float inv_w = 1.f/v[i]->e[3];
+        sx[i] = (v[i]->e[0]*inv_w + 1.f)*.5f*buffer_z->width;
+        sy[i] = (v[i]->e[1]*inv_w + 1.f)*.5f*buffer_z->height;
+        sz[i] = v[i]->e[2]*inv_w;
+    }
+    switch (buffer_z->type) {
+        case BUF_Z16: shadow_raster_z16(sx, sy, sz, buffer_z); break;
+        case BUF_Z32F: shadow_raster_z32f(sx, sy, sz, buffer_z); break;
+        default: shadow_raster_z(sx, sy, sz, buffer_z); break;
+    }
+}
+
+void draw_model_shadow(Mesh obj, Mat44f mvp, ScreenBuffer *buffer_z) {
+    TRACE_BEGIN(draw_start);
+    Vec4f *clip = clip_positions(&obj, mvp);
+    if (clip == NULL) {
+        return;
+    }
+    for (int i=0; i < obj.nfaces_verts; i += 3) {
+        triangle_shadow(clip[obj.faces_verts[i]], clip[obj.faces_verts[i + 1]],
+                clip[obj.faces_verts[i + 2]], buffer_z);
+    }
+    TRACE_END(draw_start, "draw_model_shadow");
+}
+
+// Normalized depth of a pixel, x and y counted like set_z().
+static inline float read_depth(const ScreenBuffer *buffer_z, int x, int y) {
+    const char *row = (const char *)buffer_z->memory + 
+        (buffer_z->height - 1 - y)*buffer_z->pitch;
+    switch (buffer_z->type) {
+        case BUF_Z16: return ((const uint16_t *)row)[x]/(float)0xffff;
+        case BUF_Z32F: return ((const float *)row)[x];
+        default: return ((const int *)row)[x]/(float)(1 << DEPTH_Z_BITS);
+    }
+}
+
+float shadow_pcf(const ScreenBuffer *shadow_map, Vec4f light_clip, 
+        float bias) {
+    if (light_clip.e[3] <= 0.f) {
+        return 1.f;
+    }
+    int width = shadow_map->width, height = shadow_map->height;
+    float inv_w = 1.f/light_clip.e[3];
+    int cx = (int)floorf((light_clip.e[0]*inv_w + 1.f)*.5f*width);
+    int cy = (int)floorf((light_clip.e[1]*inv_w + 1.f)*.5f*height);
+    float d = (light_clip.e[2]*inv_w + 1.f)*.5f + bias;
+
+    int lit = 0, taps = 0;
+    for (int y=cy - SHADOW_PCF_RADIUS; y <= cy + SHADOW_PCF_RADIUS; y++) {
+        for (int x=cx - SHADOW_PCF_RADIUS; x <= cx + SHADOW_PCF_RADIUS; x++) {
+            taps++;
+            if (x < 0 || x >= width || y < 0 || y >= height) {
+                lit++;
+                continue;
+            }
+            lit += read_depth(shadow_map, x, y) <= d;
+        }
+    }
+    return (float)lit/taps;
+}
+
+int occlusion_test_aabb(ScreenBuffer *buffer_z, Mat44f view_proj, Aabb box) {
+    int width = buffer_z->width, height = buffer_z->height;
+    float min_x = width, max_x = 0.f, min_y = height, max_y = 0.f;
+    float d = 0.f;
+    for (int i=0; i < 8; i++) {
+        Vec4f corner = {{
+            (i & 1) ? box.max.e[0] : box.min.e[0],
+            (i & 2) ? box.max.e[1] : box.min.e[1],
+            (i & 4) ? box.max.e[2] : box.min.e[2],
+            1.f
+        }};
+        Vec4f p = m44fv4(view_proj, corner);
+        if (p.e[3] <= 0.f) {
+            // Reaches behind the camera, no screen rectangle bounds it.
+            return 1;
+        }
+        float inv_w = 1.f/p.e[3];
+        float sx = (p.e[0]*inv_w + 1.f)*.5f*width;
+        float sy = (p.e[1]*inv_w + 1.f)*.5f*height;
+        min_x = MIN(min_x, sx);
+        max_x = MAX(max_x, sx);
+        min_y = MIN(min_y, sy);
+        max_y = MAX(max_y, sy);
+        d = MAX(d, (p.e[2]*inv_w + 1.f)*.5f);
+    }
+
+    // Every pixel the rectangle touches.
+    int x0 = MAX((int)floorf(min_x), 0);
+    int x1 = MIN((int)floorf(max_x), width - 1);
+    int y0 = MAX((int)floorf(min_y), 0);
+    int y1 = MIN((int)floorf(max_y), height - 1);
+    if (x0 > x1 || y0 > y1) {
+        return 1;
+    }
+    for (int y=y0; y <= y1; y++) {
+        const float *row = depth_row(buffer_z, y);
+        for (int x=x0; x <= x1; x++) {
+            if (row[x] <= d) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Tonemap operators for resolve().
+static inline float tonemap(float c, tonemap_op op, float exposure) {
+    c *= exposure;
+    if (op == TONEMAP_REINHARD) {
+        c = c/(1.f + max(c, 0.f));
+    }
+    return clamp(c, 0.f, 1.f);
+}
+
+#ifdef __SSE2__
+// Reorders an r,g,b,a vector so the packed bytes match the pixel format.
+static inline __m128 swizzle_rgba(__m128 c, pixel_format format) {
+    switch (format) {
+        case PIXEL_ABGR8888: return c;
+        case PIXEL_RGBA8888: return _mm_shuffle_ps(c, c, _MM_SHUFFLE(0, 1, 2, 3));
+        case PIXEL_BGRA8888: return _mm_shuffle_ps(c, c, _MM_SHUFFLE(2, 1, 0, 3));
+        default:             return _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 1, 2));
+    }
+}
+
+// Mask of the alpha lane of a swizzled vector, the lane packed into the alpha
+// byte of the format.
+static inline __m128 alpha_mask(pixel_format format) {
+    int low = (format == PIXEL_RGBA8888 || format == PIXEL_BGRA8888);
+    return _mm_castsi128_ps(_mm_set_epi32(low ? 0 : -1, 0, 0, low ? -1 : 0));
+}
+#endif
+
+// Rows per resolve_jobs() job.
+#define RESOLVE_JOB_ROWS 32
+
+static void resolve_rows(ScreenBuffer *src, ScreenBuffer *dst, tonemap_op op,
+        float exposure, int y0, int y1) {
+    int width = MIN(src->width, dst->width);
+    pixel_format format = dst->format;
+
+    for (int y=y0; y < y1; y++) {
+        float *in = (float *)((char *)src->memory + y*src->pitch);
+        uint32_t *out = (uint32_t *)((char *)dst->memory + y*dst->pitch);
+        int i = 0;
+
+#ifdef __SSE2__
+        // Four pixels per iteration, packed with saturation to bytes. Alpha
+        // is only clamped, like in the scalar loop.
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 one = _mm_set1_ps(1.f);
+        const __m128 scale = _mm_set1_ps(255.f);
+        const __m128 expo = _mm_set1_ps(exposure);
+        const __m128 alpha = alpha_mask(format);
+        for (; i + 4 <= width; i += 4) {
+            __m128i p[4];
+            for (int j=0; j < 4; j++) {
+                __m128 a = swizzle_rgba(_mm_loadu_ps(&in[4*(i + j)]), format);
+                __m128 c = _mm_mul_ps(a, expo);
+                if (op == TONEMAP_REINHARD) {
+                    c = _mm_div_ps(c, _mm_add_ps(one, _mm_max_ps(c, zero)));
+                }
+                c = _mm_or_ps(_mm_and_ps(alpha, a), _mm_andnot_ps(alpha, c));
+                c = _mm_min_ps(_mm_max_ps(c, zero), one);
+                p[j] = _mm_cvttps_epi32(_mm_mul_ps(c, scale));
+            }
+            __m128i lo = _mm_packs_epi32(p[0], p[1]);
+            __m128i hi = _mm_packs_epi32(p[2], p[3]);
+            _mm_storeu_si128((__m128i *)&out[i], _mm_packus_epi16(lo, hi));
+        }
+#endif
+
+        for (; i < width; i++) {
+            float *c = &in[4*i];
+            out[i] = pack_color(format,
+                    (int)(tonemap(c[0], op, exposure)*0xff),
+                    (int)(tonemap(c[1], op, exposure)*0xff),
+                    (int)(tonemap(c[2], op, exposure)*0xff),
+                    (int)(clamp(c[3], 0.f, 1.f)*0xff));
+        }
+    }
+}
+
+void resolve(ScreenBuffer *src, ScreenBuffer *dst, tonemap_op op,
+        float exposure) {
+    TRACE_BEGIN(resolve_start);
+    resolve_rows(src, dst, op, exposure, 0, MIN(src->height, dst->height));
+    TRACE_END(resolve_start, "resolve");
+}
+
+typedef struct {
+    ScreenBuffer *src;
+    ScreenBuffer *dst;
+    tonemap_op op;
+    float exposure;
+    int height;
+} ResolveJob;
+
+static void resolve_job(void *arg, int index) {
+    ResolveJob *job = arg;
+    int y0 = index*RESOLVE_JOB_ROWS;
+    resolve_rows(job->src, job->dst, job->op, job->exposure, y0,
+            MIN(y0 + RESOLVE_JOB_ROWS, job->height));
+}
+
+void resolve_jobs(JobPool *jobs, ScreenBuffer *src, ScreenBuffer *dst,
+        tonemap_op op, float exposure) {
+    TRACE_BEGIN(resolve_start);
+    ResolveJob job = {src, dst, op, exposure, MIN(src->height, dst->height)};
+    int n = (job.height + RESOLVE_JOB_ROWS - 1)/RESOLVE_JOB_ROWS;
+    jobs_parallel_for(jobs, n, resolve_job, &job);
+    TRACE_END(resolve_start, "resolve");
+}
+
+void accumulate(ScreenBuffer *dst, ScreenBuffer *src) {
+    int n = 4*MIN(src->width, dst->width);
+    int height = MIN(src->height, dst->height);
+    TRACE_BEGIN(accumulate_start);
+
+    for (int y=0; y < height; y++) {
+        float *out = (float *)((char *)dst->memory + y*dst->pitch);
+        float *in = (float *)((char *)src->memory + y*src->pitch);
+        int i = 0;
+
+#ifdef __SSE2__
+        for (; i + 4 <= n; i += 4) {
+            __m128 a = _mm_loadu_ps(&out[i]);
+            __m128 b = _mm_loadu_ps(&in[i]);
+            _mm_storeu_ps(&out[i], _mm_add_ps(a, b));
+        }
+#endif
+
+        for (; i < n; i++) {
+            out[i] += in[i];
+        }
     }
+    TRACE_END(accumulate_start, "accumulate");
 }
@@ -1,12 +1,52 @@
 #pragma once
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
 #include "linalg.h"
+#include "stats.h"
+#include "jobs.h"
 
 #define MIN(a,b) (((a)<(b))?(a):(b))
 #define MAX(a,b) (((a)>(b))?(a):(b))
 
-typedef enum {BUF_RGBA, BUF_Z} buffer_type;
+// Buffer formats. BUF_RGBA is packed 8-bit 0xAARRGGBB, BUF_RGBAF is a float
+// r,g,b,a render target holding unclamped shader output. BUF_COUNT holds
+// uint32_t per pixel counters for the debug modes. Depth buffers hold
+// normalized depth where a larger value wins the depth test and 0 is the
+// cleared (farthest) value.
+//  BUF_Z     32-bit int, fixed point with DEPTH_Z_BITS fractional bits.
+//  BUF_Z16   16-bit unorm, for bandwidth sensitive passes.
+//  BUF_Z32F  32-bit float, the normalized depth unquantized. With
+//            perspective() and viewport() it is (z_ndc + 1)/2, whose
+//            resolution near far is about that of BUF_Z. With
+//            perspective_reversed() and viewport_reversed() it is the near
+//            distance over w, which keeps the float's relative precision out
+//            to any distance.
+typedef enum {BUF_RGBA, BUF_Z, BUF_Z16, BUF_Z32F, BUF_RGBAF, BUF_COUNT} buffer_type;
+#define DEPTH_Z_BITS 24
+
+// Bytes per pixel for a buffer type.
+static inline int buffer_type_depth(buffer_type type) {
+    switch (type) {
+        case BUF_Z16: return sizeof(uint16_t);
+        case BUF_Z32F: return sizeof(float);
+        case BUF_Z: return sizeof(int);
+        case BUF_RGBAF: return sizeof(Vec4f);
+        default: return sizeof(uint32_t);
+    }
+}
+
+// Channel order of packed BUF_RGBA pixels, named by the uint32_t layout from
+// the most significant byte. Lets the rasterizer write directly in the native
+// format of the presentation surface.
+typedef enum {
+    PIXEL_ARGB8888,
+    PIXEL_ABGR8888,
+    PIXEL_RGBA8888,
+    PIXEL_BGRA8888
+} pixel_format;
+
 typedef struct {
     buffer_type type;
     int depth;
@@ -14,11 +54,56 @@ typedef struct {
     int width;
     int height;
     int pitch; 
+    pixel_format format;
 } ScreenBuffer;
 
+// Allocates memory for a width x height buffer of the given type with tightly
+// packed rows. Returns 1 if allocation failed.
+int buffer_init(ScreenBuffer *buffer, buffer_type type, int width, int height);
+void buffer_free(ScreenBuffer *buffer);
+
+// Clears the buffer to zero, black or farthest depth for all formats.
+static inline void buffer_clear(ScreenBuffer *buffer) {
+    memset(buffer->memory, 0, buffer->height*buffer->pitch);
+}
+
+// Clears rows y0 to y1, inclusive and counted from the bottom like 
+// set_color().
+static inline void buffer_clear_rows(ScreenBuffer *buffer, int y0, int y1) {
+    char *first = (char *)buffer->memory + 
+        (buffer->height - 1 - y1)*buffer->pitch;
+    memset(first, 0, (y1 - y0 + 1)*buffer->pitch);
+}
+
+// Packs an 8-bit color in the channel order of the given format.
+static inline uint32_t pack_color(pixel_format format, uint32_t r, uint32_t g,
+        uint32_t b, uint32_t a) {
+    switch (format) {
+        case PIXEL_ABGR8888: return (a << 24) + (b << 16) + (g << 8) + r;
+        case PIXEL_RGBA8888: return (r << 24) + (g << 16) + (b << 8) + a;
+        case PIXEL_BGRA8888: return (b << 24) + (g << 16) + (r << 8) + a;
+        default:             return (a << 24) + (r << 16) + (g << 8) + b;
+    }
+}
+
+// Block of vertices for batched vertex shading, in structure of arrays 
+// layout. pos holds the object space x, y and z of count vertices, the 
+// shader writes the pre-divide clip x, y, z and w to clip. Lanes past count 
+// are zero and may be transformed like the rest.
+#define VERTEX_BATCH 16
+typedef struct {
+    LINALG_ALIGN float pos[3][VERTEX_BATCH];
+    LINALG_ALIGN float clip[4][VERTEX_BATCH];
+    int count;
+} VertexBatch;
+
 typedef struct {
     Vec4f (*vertex_shader)(Vec3f, int, void*);
     int (*fragment_shader)(Vec3f, Vec3f*, void*);
+    // Optional. Batched equivalent of vertex_shader, used by draw_model() to
+    // transform all vertices of a mesh up front. With RenderContext.jobs it
+    // runs on several threads at once and must only read the shader.
+    void (*vertex_shader_batch)(VertexBatch*, void*);
     Mat44f projection;
     Mat44f modelview;
     Mat44f mvp; //modelview*projection
@@ -28,14 +113,70 @@ typedef struct {
     Mat33f varying_vertex_normal;
     Mat33f varying_vertex_uv;
     Vec2i  frag_coord;
+    int fast_math; // Shaders may use the fastmath.h approximations.
 } ShaderBase;
 
+// Debug render modes. Instead of shading, the rasterizer accumulates a per 
+// pixel count into RenderContext.debug_counts, a BUF_COUNT buffer, and leaves
+// the color buffer untouched. debug_heatmap() turns the counts into colors.
+//  DEBUG_COVERAGE     covered samples, before the depth test. Overdraw.
+//  DEBUG_DEPTH_PASS   samples passing the depth test. Shading overdraw.
+//  DEBUG_SHADER_COST  timer ticks spent in the fragment shader.
+typedef enum {
+    DEBUG_NONE,
+    DEBUG_COVERAGE,
+    DEBUG_DEPTH_PASS,
+    DEBUG_SHADER_COST
+} debug_mode;
+
+// How draw_model() spreads a draw over threads.
+//  DRAW_IMMEDIATE  the calling thread rasterizes every face.
+//  DRAW_SORT_LAST  the faces are split into one contiguous range per thread.
+//                  Each thread rasterizes its range into private color and
+//                  depth buffers, which are then merged into the target by
+//                  depth. The result matches DRAW_IMMEDIATE exactly. Suits a
+//                  few large meshes, as it costs a clear and a merge of the
+//                  whole target per thread and draw.
+typedef enum {
+    DRAW_IMMEDIATE,
+    DRAW_SORT_LAST
+} draw_strategy;
+
+// Max threads of a DRAW_SORT_LAST draw.
+#define SORT_LAST_MAX_THREADS 64
+
 typedef struct {
     ShaderBase *shader;
     ScreenBuffer *buffers;
     int num_buffers;
+    RenderStats *stats;     // Optional. Frame totals, see render_stats_end().
+    debug_mode debug;
+    ScreenBuffer *debug_counts;
+    // Optional. When set, only pixels from scissor_min to scissor_max, 
+    // inclusive, are rasterized. Lets threads split a target into bands.
+    int scissor;
+    Vec2i scissor_min;
+    Vec2i scissor_max;
+    // Optional. Read by draw_model() on every call, so it can change per 
+    // draw. DRAW_SORT_LAST needs jobs and shader_size, the size of the 
+    // struct the shader is part of, to give each thread a copy. It falls 
+    // back to DRAW_IMMEDIATE without them, in debug modes and for targets
+    // whose pitch has padding. threads is the number of face ranges, <= 0
+    // uses one per pool thread.
+    draw_strategy draw_strategy;
+    int threads;
+    size_t shader_size;
+    // Optional. Pool for the vertex stage and DRAW_SORT_LAST. A thread
+    // waiting for its jobs runs other queued jobs, so draws using the pool 
+    // must not run as jobs of it themselves.
+    JobPool *jobs;
 } RenderContext;
 
+// Adds the pipeline statistics gathered by all threads since the last call
+// into ctx->stats. Call at frame end. Counting requires building with 
+// SOFTRAST_STATS.
+void render_stats_end(RenderContext *ctx);
+
 typedef struct {
     Vec3f pos;
     Vec3f target;
@@ -46,23 +187,78 @@ typedef struct {
 float clamp(float x, float min, float max);
 float max(float x, float y);
 
-// Sets given pixel in the given buffer to the color
+// Sets given pixel in the given buffer to the color. The color is already
+// packed in the channel order of the buffer format. Rows are pitch bytes apart.
 void set_color(ScreenBuffer *buffer, int x, int y, uint32_t color);
 
+// Sets given pixel in the given BUF_RGBAF buffer to the color.
+void set_colorf(ScreenBuffer *buffer, int x, int y, Vec4f color);
+
 // Sets the zbuffer at the pixel in the given buffer. 
 // Returns 1 if successfully set value. 0 if not and existing value was higher.
+// One function per depth format, BUF_Z, BUF_Z16 and BUF_Z32F.
 int set_z(ScreenBuffer *buffer, int x, int y, int z);
+int set_z16(ScreenBuffer *buffer, int x, int y, uint16_t z);
+int set_zf(ScreenBuffer *buffer, int x, int y, float z);
 
 // Draws line in buffer from (x0, y0) to (x1, y1) with color.
 void line(ScreenBuffer *buffer, int x0, int y0, int x1, int y1, uint32_t color);
 
 // Draws and fills triangle with verticies v0, v1, v2 and corresponding
-// uv coordinates.
+// uv coordinates. color is unused, the fragment shader gives the color.
 void triangle(Vec3f v0, Vec3f v1, Vec3f v2,
         Vec3f v0uv, Vec3f v1uv, Vec3f v2uv,
         Vec3f n0, Vec3f n1, Vec3f n2, uint32_t color,
         RenderContext* ctx, ScreenBuffer* buffer_rgba, ScreenBuffer* buffer_z);
 
+// Tonemap operators used when resolving a float render target.
+typedef enum {TONEMAP_CLAMP, TONEMAP_REINHARD} tonemap_op;
+
+// Resolves a BUF_RGBAF render target into a BUF_RGBA buffer of the same size.
+// Colors are scaled by exposure, tonemapped and packed to 8 bits in the
+// channel order of dst.
+void resolve(ScreenBuffer *src, ScreenBuffer *dst, tonemap_op op,
+        float exposure);
+
+// resolve() with the rows split into jobs on a pool.
+void resolve_jobs(JobPool *jobs, ScreenBuffer *src, ScreenBuffer *dst,
+        tonemap_op op, float exposure);
+
+// Adds the BUF_RGBAF buffer src into dst. Used to accumulate several passes or
+// lights before resolving.
+void accumulate(ScreenBuffer *dst, ScreenBuffer *src);
+
+// Maps the counts of a BUF_COUNT buffer through a color ramp, black, blue,
+// green, yellow, red to white, into a BUF_RGBA buffer of the same size.
+// max_count maps to white, pass 0 to use the largest count in the buffer.
+// Returns the count used as maximum.
+uint32_t debug_heatmap(ScreenBuffer *counts, ScreenBuffer *rgba,
+        uint32_t max_count);
+
+// clip = m*(pos, 1) for all lanes of the batch. Accumulates in the same order
+// as m44fv4, so it matches the single vertex path exactly.
+static inline void vertex_batch_transform(Mat44f m, VertexBatch *batch) {
+    const float *x = batch->pos[0], *y = batch->pos[1], *z = batch->pos[2];
+    for (int r=0; r<4; r++) {
+        const float *row = &m.e[4*r];
+        float *out = batch->clip[r];
+#if defined(LINALG_SSE)
+        __m128 m0 = _mm_set1_ps(row[0]), m1 = _mm_set1_ps(row[1]),
+               m2 = _mm_set1_ps(row[2]), m3 = _mm_set1_ps(row[3]);
+        for (int i=0; i<VERTEX_BATCH; i+=4) {
+            __m128 acc = _mm_mul_ps(m0, _mm_load_ps(&x[i]));
+            acc = _mm_add_ps(acc, _mm_mul_ps(m1, _mm_load_ps(&y[i])));
+            acc = _mm_add_ps(acc, _mm_mul_ps(m2, _mm_load_ps(&z[i])));
+            _mm_store_ps(&out[i], _mm_add_ps(acc, m3));
+        }
+#else
+        for (int i=0; i<VERTEX_BATCH; i++) {
+            out[i] = row[0]*x[i] + row[1]*y[i] + row[2]*z[i] + row[3];
+        }
+#endif
+    }
+}
+
 // Struct to represent 3d mesh models.
 typedef struct {
     float *verts;           //stored as v0.x v0.y v0.z v1.x v.1.y ...
@@ -78,33 +274,166 @@ typedef struct {
     int nfaces_verts;
 } Mesh;
 
-inline void free_model_data(Mesh obj) {
+static inline void free_model_data(Mesh obj) {
     free(obj.verts);
     free(obj.uvs);
     free(obj.normals);
     free(obj.faces_verts);
     free(obj.faces_uvs);
+    free(obj.faces_normals);
     return;
 }
 
-// Function to draw triangles with uv for a model file.
+// Axis aligned bounding box.
+typedef struct {
+    Vec3f min;
+    Vec3f max;
+} Aabb;
+
+// Bounds of the vertex positions of a mesh.
+Aabb mesh_bounds(Mesh obj);
+
+// Bounds of the box transformed by an affine matrix, e.g. a model matrix.
+Aabb aabb_transform(Aabb box, Mat44f m);
+
+// Clip space frustum planes of a transform. A point p is inside plane i when
+// dot(planes[i], (p, 1)) >= 0. Only the left, right, bottom and top planes 
+// and w > 0 are used, the depth range of perspective() isn't a reliable
+// near/far test.
+#define FRUSTUM_PLANES 5
+typedef struct {
+    Vec4f planes[FRUSTUM_PLANES];
+} Frustum;
+
+// Extracts the planes of m, e.g. an mvp, in the space m transforms from.
+Frustum frustum_from_matrix(Mat44f m);
+
+// Returns 0 if the box is fully outside the frustum, 1 if it may be visible.
+int frustum_test_aabb(const Frustum *frustum, Aabb box);
+
+// Depth-only rasterization for occlusion culling into a BUF_Z32F buffer,
+// which is typically small, e.g. 256x128. v0, v1, v2 are clip space 
+// positions before the perspective divide, mapped to the whole buffer. The 
+// result is conservative: only pixels the triangle fully covers are written,
+// with the farthest depth of its vertices. Triangles crossing w = 0 are 
+// skipped.
+void triangle_depth(Vec4f v0, Vec4f v1, Vec4f v2, ScreenBuffer *buffer_z);
+
+// Rasterizes all faces of a mesh with triangle_depth().
+void draw_model_depth(Mesh obj, Mat44f mvp, ScreenBuffer *buffer_z);
+
+// Tests a box against a depth buffer written by triangle_depth() with the 
+// same view_proj. Returns 0 if every pixel the box covers on screen holds a
+// depth closer than the closest point of the box, 1 if it may be visible.
+int occlusion_test_aabb(ScreenBuffer *buffer_z, Mat44f view_proj, Aabb box);
+
+// Depth-only rasterization for shadow maps, into a BUF_Z, BUF_Z16 or 
+// BUF_Z32F buffer. v0, v1, v2 are clip space positions before the
+// perspective divide, mapped to the whole buffer. Pixels whose center the
+// triangle covers get its interpolated depth if closer, edges included. There
+// are no varyings, shader calls or color writes. Triangles crossing w = 0
+// are skipped.
+void triangle_shadow(Vec4f v0, Vec4f v1, Vec4f v2, ScreenBuffer *buffer_z);
+
+// Rasterizes all faces of a mesh with triangle_shadow(). mvp maps the mesh
+// into the clip space of the light.
+void draw_model_shadow(Mesh obj, Mat44f mvp, ScreenBuffer *buffer_z);
+
+// Texels on each side of the center for shadow_pcf(), 1 filters 3x3.
+#define SHADOW_PCF_RADIUS 1
+
+// Percentage closer filtering of a shadow map written by triangle_shadow().
+// light_clip is the shaded point in the clip space of the light, e.g. the
+// mvp given to draw_model_shadow() times its object space position. Returns
+// the lit fraction of the texels around it, 0 in full shadow. A texel 
+// shadows the point when its depth is closer than the point's depth plus 
+// bias. Points outside the map are lit.
+float shadow_pcf(const ScreenBuffer *shadow_map, Vec4f light_clip, 
+        float bias);
+
+// Function to draw triangles with uv for a model file. If the shader has a
+// vertex_shader_batch, all vertices of the mesh are transformed in bulk 
+// before the faces are rasterized, otherwise each face calls vertex_shader
+// through triangle().
 void draw_model(Mesh obj, RenderContext* ctx, ScreenBuffer* buffer_rgba, 
         ScreenBuffer* buffer_z);
 
-// Viewport projection. Maps [-1, 1]x[-1,1] to [0, w]x[0,h].
+// Frees the buffers draw_model() and the depth-only draws keep per thread
+// across draws. Pool workers run it on exit through jobs_thread_cleanup(),
+// other threads that draw can call it before they exit.
+void gl_thread_cleanup(void);
+
+// Output of the vertex stage for one vertex.
+typedef struct {
+    Vec4f post;     // Vertex shader output, before the perspective divide.
+    Vec2i sc;       // Screen coords with sub-pixel precision.
+    float clip_z;   // z after the perspective divide.
+} ShadedVertex;
+
+// The vertex stage of draw_model() for all vertices of a mesh, on ctx->jobs
+// when set. Returns the shaded vertices indexed like the mesh positions, 
+// valid until the next draw on the calling thread, or NULL if the shader 
+// has no vertex_shader_batch or allocation failed.
+ShadedVertex *draw_vertex_stage(Mesh obj, RenderContext *ctx);
+
+// Faces first to first + count of a mesh, counted in triangles.
+typedef struct {
+    int first;
+    int count;
+} FaceRange;
+
+// Draws a subset of the faces of a mesh. All vertices of the mesh go through
+// the vertex stage once, then the ranges are drawn in the given order.
+void draw_model_ranges(Mesh obj, const FaceRange *ranges, int nranges,
+        RenderContext* ctx, ScreenBuffer* buffer_rgba, ScreenBuffer* buffer_z);
+void draw_model_range(Mesh obj, int first, int count, RenderContext* ctx,
+        ScreenBuffer* buffer_rgba, ScreenBuffer* buffer_z);
+
+// Called before each visible instance is drawn, with shader modelview and mvp
+// already set for it. Sets per-instance uniforms on the shader.
+typedef void (*instance_uniforms_fn)(ShaderBase *shader, int instance,
+        void *userdata);
+
+// Draws count instances of a mesh. models holds the model matrix of each
+// instance, shader modelview is taken as the view matrix and restored when
+// done. Instances whose bounds fall outside the frustum are skipped. bounds
+// may be NULL to compute them from the mesh, uniforms may be NULL.
+// With a vertex_shader_batch the mesh positions are gathered once and each
+// instance transforms them in batches. Returns the number of instances drawn.
+int draw_model_instanced(Mesh obj, const Aabb *bounds, const Mat44f *models,
+        int count, instance_uniforms_fn uniforms, void *userdata,
+        RenderContext* ctx, ScreenBuffer* buffer_rgba, ScreenBuffer* buffer_z);
+
+// Viewport projection. Maps [-1, 1]x[-1,1] to [0, w]x[0,h] and z to the 
+// normalized [0, 1] depth range. Quantization to the depth buffer format is
+// done by the rasterizer.
 static inline Mat44f viewport(int x, int y, int w, int h) {
-    int depth = 255; //TODO assign somehow.
     Mat44f m = m44fident();
     m.e[4*0 + 3] = x+w/2.f;
     m.e[4*1 + 3] = y+h/2.f;
-    m.e[4*2 + 3] = 1.f;
+    m.e[4*2 + 3] = .5f;
     
     m.e[4*0 + 0] = w/2.f;
     m.e[4*1 + 1] = h/2.f;
-    m.e[4*2 + 2] = depth/2.f;
+    m.e[4*2 + 2] = .5f;
+    return m;
+}
+
+// Viewport for perspective_reversed(). Maps x and y like viewport() and
+// keeps z, which that projection already gives as normalized depth.
+static inline Mat44f viewport_reversed(int x, int y, int w, int h) {
+    Mat44f m = viewport(x, y, w, h);
+    m.e[4*2 + 3] = 0.f;
+    m.e[4*2 + 2] = 1.f;
     return m;
 }
 
+// Normalized depth of z after the perspective divide, through the z row of
+// the viewport.
+static inline float viewport_depth(const Mat44f *viewport, float z) {
+    return viewport->e[4*2 + 2]*z + viewport->e[4*2 + 3];
+}
+
 static inline Mat44f perspective(float fovy, float aspect, float znear,
         float zfar) {
     const double DEG2RAD = 3.14159265 / 180;
@@ -118,6 +447,37 @@ static inline Mat44f perspective(float fovy, float aspect, float znear,
     return m;
 }
 
+// Reversed-Z perspective with the far plane at infinity, znear signed as
+// for perspective(). z after the perspective divide is -znear/w, 1 at the
+// near plane falling towards 0 with distance, so it is the normalized depth
+// itself and is never the small difference of two larger terms. Use it with
+// viewport_reversed() and a BUF_Z32F depth buffer.
+static inline Mat44f perspective_reversed(float fovy, float aspect,
+        float znear) {
+    const double DEG2RAD = 3.14159265 / 180;
+    float tangent = tan(fovy/2 * DEG2RAD);
+    float f = 1.f/tangent;
+    Mat44f m = {{
+        f/aspect,       0,      0,      0,
+        0,              f,      0,      0,
+        0,              0,      0,      -znear,
+        0,              0,      1.f,    0}};
+    return m;
+}
+
+// Orthographic projection, e.g. for the shadow map of a directional light.
+// Looking down -z like lookat(), view z = -znear maps to depth 1, the 
+// closest, and -zfar to -1.
+static inline Mat44f orthographic(float left, float right, float bottom,
+        float top, float znear, float zfar) {
+    Mat44f m = {{
+        2.f/(right - left), 0,  0,  -(right + left)/(right - left),
+        0,  2.f/(top - bottom), 0,  -(top + bottom)/(top - bottom),
+        0,  0,  2.f/(zfar - znear), (zfar + znear)/(zfar - znear),
+        0,  0,  0,  1.f}};
+    return m;
+}
+
 static inline void lookat(Mat44f* modelview, Vec3f eye, Vec3f target, Vec3f up) {
     // Camera points in -z direction.
     Vec3f z = v3fnormalize(v3fsub(target,eye));
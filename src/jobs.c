@@ -0,0 +1,293 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "jobs.h"
+
+// Failed find rounds before an idle worker goes to sleep.
+#define JOBS_SPIN 64
+
+// Pool and index of the calling thread, NULL and -1 outside pools.
+static _Thread_local JobPool *job_pool;
+static _Thread_local int job_thread = -1;
+static _Thread_local unsigned job_seed;
+
+// Owner only. Returns 1 if the deque is full.
+static int deque_push(JobDeque *d, Job job) {
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&d->top, memory_order_acquire);
+    if (b - t >= JOBS_DEQUE_SIZE) {
+        return 1;
+    }
+    d->jobs[b % JOBS_DEQUE_SIZE] = job;
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    return 0;
+}
+
+// Owner only, takes the newest job. Returns 0 if empty.
+static int deque_pop(JobDeque *d, Job *job) {
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long t = atomic_load_explicit(&d->top, memory_order_relaxed);
+    if (t > b) {
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        return 0;
+    }
+    *job = d->jobs[b % JOBS_DEQUE_SIZE];
+    if (t < b) {
+        return 1;
+    }
+    // Last job, race the thieves for it.
+    int won = atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+            memory_order_seq_cst, memory_order_relaxed);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    return won;
+}
+
+// Any thread, takes the oldest job. Returns 0 if empty or another thread
+// got it first. A slot read while the owner reuses it is only possible when
+// the job was already taken, the CAS then fails and the copy is dropped.
+static int deque_steal(JobDeque *d, Job *job) {
+    long t = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    if (t >= b) {
+        return 0;
+    }
+    *job = d->jobs[t % JOBS_DEQUE_SIZE];
+    return atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+            memory_order_seq_cst, memory_order_relaxed);
+}
+
+// Takes a job from the own deque, or steals one starting at a random
+// victim. Returns 0 if none was found.
+static int find_job(JobPool *pool, Job *job) {
+    int found = deque_pop(&pool->deques[job_thread], job);
+    int n = pool->nthreads;
+    job_seed = job_seed*1103515245u + 12345u;
+    int start = (int)((job_seed >> 16) % (unsigned)n);
+    for (int i=0; i < n && !found; i++) {
+        int victim = (start + i) % n;
+        if (victim != job_thread) {
+            found = deque_steal(&pool->deques[victim], job);
+        }
+    }
+    if (found) {
+        atomic_fetch_sub(&pool->queued, 1);
+    }
+    return found;
+}
+
+static inline void run_job(Job job) {
+    job.fn(job.arg, job.index);
+    if (job.counter != NULL) {
+        atomic_fetch_sub(&job.counter->pending, 1);
+    }
+}
+
+static void pin_thread(int index) {
+#ifdef __linux__
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(index % (ncpus > 0 ? ncpus : 1), &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void)index;
+#endif
+}
+
+typedef struct {
+    JobPool *pool;
+    int index;
+    int flags;
+} WorkerStart;
+
+// Functions of jobs_thread_cleanup().
+static pthread_mutex_t cleanup_lock = PTHREAD_MUTEX_INITIALIZER;
+static void (*cleanups[JOBS_MAX_CLEANUPS])(void);
+static int ncleanups;
+
+int jobs_thread_cleanup(void (*fn)(void)) {
+    int failed = 0;
+    pthread_mutex_lock(&cleanup_lock);
+    int i = 0;
+    while (i < ncleanups && cleanups[i] != fn) {
+        i++;
+    }
+    if (i == ncleanups) {
+        if (ncleanups < JOBS_MAX_CLEANUPS) {
+            cleanups[ncleanups++] = fn;
+        } else {
+            failed = 1;
+        }
+    }
+    pthread_mutex_unlock(&cleanup_lock);
+    return failed;
+}
+
+// Runs the registered cleanups on the calling worker.
+static void run_cleanups(void) {
+    void (*fns[JOBS_MAX_CLEANUPS])(void);
+    pthread_mutex_lock(&cleanup_lock);
+    int n = ncleanups;
+    memcpy(fns, cleanups, n*sizeof(fns[0]));
+    pthread_mutex_unlock(&cleanup_lock);
+    for (int i=0; i < n; i++) {
+        fns[i]();
+    }
+}
+
+static void *worker_main(void *arg) {
+    WorkerStart start = *(WorkerStart *)arg;
+    free(arg);
+    JobPool *pool = start.pool;
+    job_pool = pool;
+    job_thread = start.index;
+    job_seed = (unsigned)start.index*2654435761u;
+    if (start.flags & JOBS_PIN_THREADS) {
+        pin_thread(start.index);
+    }
+
+    int idle = 0;
+    while (!atomic_load(&pool->quit)) {
+        Job job;
+        if (find_job(pool, &job)) {
+            run_job(job);
+            idle = 0;
+            continue;
+        }
+        if (++idle < JOBS_SPIN) {
+            sched_yield();
+            continue;
+        }
+
+        // Pushers check sleepers after bumping queued, sleepers are counted
+        // before checking queued, so one of the two sees the other.
+        pthread_mutex_lock(&pool->lock);
+        atomic_fetch_add(&pool->sleepers, 1);
+        while (atomic_load(&pool->queued) == 0 && !atomic_load(&pool->quit)) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        atomic_fetch_sub(&pool->sleepers, 1);
+        pthread_mutex_unlock(&pool->lock);
+        idle = 0;
+    }
+    run_cleanups();
+    return NULL;
+}
+
+int jobs_init(JobPool *pool, int nthreads, int flags) {
+    memset(pool, 0, sizeof(*pool));
+    if (nthreads <= 0) {
+        nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    nthreads = nthreads < 1 ? 1 : nthreads;
+    nthreads = nthreads > JOBS_MAX_THREADS ? JOBS_MAX_THREADS : nthreads;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+
+    pool->nthreads = 1;
+    pool->deques = aligned_alloc(_Alignof(JobDeque),
+            nthreads*sizeof(JobDeque));
+    if (pool->deques == NULL) {
+        return 1;
+    }
+    memset(pool->deques, 0, nthreads*sizeof(JobDeque));
+    job_pool = pool;
+    job_thread = 0;
+    job_seed = 1;
+    if (flags & JOBS_PIN_THREADS) {
+        pin_thread(0);
+    }
+
+    int failed = 0;
+    for (int i=1; i < nthreads && !failed; i++) {
+        WorkerStart *start = malloc(sizeof(WorkerStart));
+        if (start == NULL) {
+            failed = 1;
+            break;
+        }
+        *start = (WorkerStart){pool, i, flags};
+        // Workers only look at deques below nthreads, count it first.
+        pool->nthreads = i + 1;
+        if (pthread_create(&pool->threads[i], NULL, worker_main, start)) {
+            free(start);
+            pool->nthreads = i;
+            failed = 1;
+        }
+    }
+    return failed;
+}
+
+void jobs_free(JobPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    atomic_store(&pool->quit, 1);
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i=1; i < pool->nthreads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    free(pool->deques);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    if (job_pool == pool) {
+        job_pool = NULL;
+        job_thread = -1;
+    }
+    memset(pool, 0, sizeof(*pool));
+}
+
+void jobs_run(JobPool *pool, job_fn fn, void *arg, int index,
+        JobCounter *counter) {
+    Job job = {fn, arg, index, counter};
+    if (counter != NULL) {
+        atomic_fetch_add(&counter->pending, 1);
+    }
+    if (pool == NULL || job_pool != pool ||
+            deque_push(&pool->deques[job_thread], job)) {
+        run_job(job);
+        return;
+    }
+    atomic_fetch_add(&pool->queued, 1);
+    if (atomic_load(&pool->sleepers) > 0) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->wake);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+void jobs_wait(JobPool *pool, JobCounter *counter) {
+    while (atomic_load(&counter->pending) > 0) {
+        Job job;
+        if (pool != NULL && job_pool == pool && find_job(pool, &job)) {
+            run_job(job);
+        } else {
+            sched_yield();
+        }
+    }
+}
+
+void jobs_parallel_for(JobPool *pool, int n, job_fn fn, void *arg) {
+    if (pool == NULL || job_pool != pool || n < 2) {
+        for (int i=0; i < n; i++) {
+            fn(arg, i);
+        }
+        return;
+    }
+    JobCounter counter = {0};
+    for (int i=n - 1; i > 0; i--) {
+        jobs_run(pool, fn, arg, i, &counter);
+    }
+    fn(arg, 0);
+    jobs_wait(pool, &counter);
+}
+
+int jobs_threads(const JobPool *pool) {
+    return pool != NULL ? pool->nthreads : 1;
+}
@@ -0,0 +1,102 @@
+#pragma once
+#include <pthread.h>
+#include <stdatomic.h>
+
+// Persistent worker pool for per-frame jobs. Each thread owns a Chase-Lev
+// deque: it pushes and pops jobs at the bottom while idle threads steal
+// from the top of a random victim, so forked work spreads without a shared
+// queue.
+//
+//     JobPool pool;
+//     jobs_init(&pool, 0, 0);             // from the main thread
+//     ...
+//     jobs_parallel_for(&pool, n, fn, arg);   // fn(arg, 0) .. fn(arg, n-1)
+//     ...
+//     jobs_free(&pool);
+//
+// Finer control goes through counters. Every job started with a counter
+// increments it and decrements it when done, jobs_wait() runs other jobs
+// until it drops to zero:
+//
+//     JobCounter counter = {0};
+//     jobs_run(&pool, fn, arg, i, &counter);  // fork
+//     jobs_wait(&pool, &counter);             // join
+//
+// A job depending on others waits for their counter inside the job, which
+// also runs jobs meanwhile, so dependencies only need to be acyclic.
+//
+// Jobs are pushed onto the deque of the calling thread, which must be the
+// thread that called jobs_init() or a job of the pool. Other threads run
+// the job inline instead.
+
+// Jobs per deque. Pushing onto a full deque runs the job inline.
+#define JOBS_DEQUE_SIZE 4096
+#define JOBS_MAX_THREADS 64
+
+// Pin each thread to one CPU, where supported.
+#define JOBS_PIN_THREADS 1
+
+// Functions jobs_thread_cleanup() can hold.
+#define JOBS_MAX_CLEANUPS 16
+
+typedef void (*job_fn)(void *arg, int index);
+
+typedef struct {
+    atomic_int pending;
+} JobCounter;
+
+typedef struct {
+    job_fn fn;
+    void *arg;
+    int index;
+    JobCounter *counter;
+} Job;
+
+// top and bottom on their own cache lines, thieves only write top.
+typedef struct {
+    _Alignas(64) atomic_long top;
+    _Alignas(64) atomic_long bottom;
+    Job jobs[JOBS_DEQUE_SIZE];
+} JobDeque;
+
+typedef struct JobPool {
+    int nthreads;           // including the thread that called jobs_init()
+    pthread_t threads[JOBS_MAX_THREADS];
+    JobDeque *deques;
+
+    // Idle workers sleep until jobs are queued.
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    atomic_int queued;      // pushed and not yet taken
+    atomic_int sleepers;
+    atomic_int quit;
+} JobPool;
+
+// Starts nthreads - 1 workers, nthreads <= 0 uses one per online CPU. The
+// calling thread becomes thread 0 of the pool. flags is 0 or
+// JOBS_PIN_THREADS. Returns 1 if allocation failed or no worker could be
+// started. Jobs still run then, on fewer threads.
+int jobs_init(JobPool *pool, int nthreads, int flags);
+
+// Stops the workers. Call with no jobs in flight.
+void jobs_free(JobPool *pool);
+
+// Queues fn(arg, index). counter may be NULL.
+void jobs_run(JobPool *pool, job_fn fn, void *arg, int index,
+        JobCounter *counter);
+
+// Runs queued jobs until counter reaches zero.
+void jobs_wait(JobPool *pool, JobCounter *counter);
+
+// Runs fn(arg, i) for i from 0 to n - 1 and returns when all are done.
+// With a NULL pool they run in order on the calling thread.
+void jobs_parallel_for(JobPool *pool, int n, job_fn fn, void *arg);
+
+// Number of threads of the pool, 1 for NULL.
+int jobs_threads(const JobPool *pool);
+
+// Registers fn to run on every worker of every pool just before the worker
+// exits, e.g. to free the thread-local caches of a module. Registering the
+// same fn again does nothing, so modules can register whenever they fill a
+// cache. Returns 1 if JOBS_MAX_CLEANUPS functions are registered already.
+int jobs_thread_cleanup(void (*fn)(void));
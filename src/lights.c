@@ -0,0 +1,221 @@
+#include "lights.h"
+#include "trace.h"
+
+// Lights per bounds job.
+#define LIGHT_JOB_LIGHTS 64
+
+void lights_init(LightList *list) {
+    memset(list, 0, sizeof(*list));
+}
+
+void lights_free(LightList *list) {
+    free(list->lights);
+    memset(list, 0, sizeof(*list));
+}
+
+int lights_add(LightList *list, PointLight light) {
+    if (list->count == list->size) {
+        int size = list->size ? 2*list->size : 64;
+        PointLight *lights = realloc(list->lights, size*sizeof(PointLight));
+        if (lights == NULL) {
+            return -1;
+        }
+        list->lights = lights;
+        list->size = size;
+    }
+    list->lights[list->count] = light;
+    return list->count++;
+}
+
+int light_clusters_init(LightClusters *clusters, int width, int height,
+        float znear, float zfar) {
+    memset(clusters, 0, sizeof(*clusters));
+    clusters->tiles_x = (width + LIGHT_TILE_SIZE - 1)/LIGHT_TILE_SIZE;
+    clusters->tiles_y = (height + LIGHT_TILE_SIZE - 1)/LIGHT_TILE_SIZE;
+    clusters->znear = znear;
+    clusters->zfar = zfar;
+    clusters->slice_scale = LIGHT_SLICES/logf(zfar/znear);
+    clusters->clusters = calloc(clusters->tiles_x*clusters->tiles_y*
+            LIGHT_SLICES, sizeof(LightCluster));
+    return clusters->clusters == NULL;
+}
+
+void light_clusters_free(LightClusters *clusters) {
+    free(clusters->clusters);
+    for (int s=0; s < LIGHT_SLICES; s++) {
+        free(clusters->slices[s].indices);
+    }
+    free(clusters->view_lights);
+    free(clusters->bounds);
+    memset(clusters, 0, sizeof(*clusters));
+}
+
+typedef struct {
+    LightClusters *clusters;
+    const LightList *lights;
+    Mat44f view;
+    Mat44f screen;      // viewport*projection
+} ClusterBuild;
+
+// Transforms a block of lights to view space and finds their bounds.
+static void bounds_job(void *arg, int index) {
+    ClusterBuild *build = arg;
+    LightClusters *clusters = build->clusters;
+    int end = MIN((index + 1)*LIGHT_JOB_LIGHTS, build->lights->count);
+    for (int i=index*LIGHT_JOB_LIGHTS; i < end; i++) {
+        PointLight light = build->lights->lights[i];
+        Vec4f pos = m44fv4(build->view, (Vec4f){{light.pos.e[0],
+                light.pos.e[1], light.pos.e[2], 1.f}});
+        light.pos = v4f2v3f(pos);
+        clusters->view_lights[i] = light;
+
+        // Depth is linear in the position, so over the sphere it changes
+        // by at most the radius times the length of the plane normal.
+        LightBounds *b = &clusters->bounds[i];
+        float r = light.radius;
+        float depth = light_view_depth(clusters, light.pos);
+        float range = r*v3fnorm(v4f2v3f(clusters->depth_plane));
+        b->x0 = 0;
+        b->x1 = clusters->tiles_x - 1;
+        b->y0 = 0;
+        b->y1 = clusters->tiles_y - 1;
+        b->s0 = light_slice(clusters, depth - range);
+        b->s1 = light_slice(clusters, depth + range);
+        if (depth + range <= 0.f) {
+            b->s0 = 1;
+            b->s1 = 0;
+            continue;
+        }
+        if (depth - range <= 0.f) {
+            // Reaches behind the camera, no screen rectangle bounds it.
+            continue;
+        }
+
+        // Screen rectangle of the corners of the bounding box.
+        float min_x = INFINITY, max_x = -INFINITY;
+        float min_y = INFINITY, max_y = -INFINITY;
+        for (int k=0; k < 8; k++) {
+            Vec4f corner = {{
+                light.pos.e[0] + ((k & 1) ? r : -r),
+                light.pos.e[1] + ((k & 2) ? r : -r),
+                light.pos.e[2] + ((k & 4) ? r : -r),
+                1.f
+            }};
+            Vec4f p = m44fv4(build->screen, corner);
+            float sx = p.e[0]/p.e[3], sy = p.e[1]/p.e[3];
+            min_x = MIN(min_x, sx);
+            max_x = MAX(max_x, sx);
+            min_y = MIN(min_y, sy);
+            max_y = MAX(max_y, sy);
+        }
+        float tiles_x = clusters->tiles_x, tiles_y = clusters->tiles_y;
+        min_x = floorf(min_x/LIGHT_TILE_SIZE);
+        max_x = floorf(max_x/LIGHT_TILE_SIZE);
+        min_y = floorf(min_y/LIGHT_TILE_SIZE);
+        max_y = floorf(max_y/LIGHT_TILE_SIZE);
+        if (max_x < 0.f || max_y < 0.f || min_x >= tiles_x ||
+                min_y >= tiles_y) {
+            b->s0 = 1;
+            b->s1 = 0;
+            continue;
+        }
+        b->x0 = (int)MAX(min_x, 0.f);
+        b->x1 = (int)MIN(max_x, tiles_x - 1.f);
+        b->y0 = (int)MAX(min_y, 0.f);
+        b->y1 = (int)MIN(max_y, tiles_y - 1.f);
+    }
+}
+
+// Fills the clusters of depth slice s, counting their lights first so each
+// cluster gets a contiguous range of the slice index list.
+static void slice_job(void *arg, int s) {
+    ClusterBuild *build = arg;
+    LightClusters *clusters = build->clusters;
+    LightSlice *slice = &clusters->slices[s];
+    int tiles_x = clusters->tiles_x;
+    LightCluster *first = &clusters->clusters[s*tiles_x*clusters->tiles_y];
+    memset(first, 0, tiles_x*clusters->tiles_y*sizeof(LightCluster));
+    slice->failed = 0;
+
+    for (int i=0; i < clusters->nlights; i++) {
+        const LightBounds *b = &clusters->bounds[i];
+        if (s < b->s0 || s > b->s1) {
+            continue;
+        }
+        for (int y=b->y0; y <= b->y1; y++) {
+            for (int x=b->x0; x <= b->x1; x++) {
+                first[y*tiles_x + x].count++;
+            }
+        }
+    }
+
+    int total = 0;
+    for (int c=0; c < tiles_x*clusters->tiles_y; c++) {
+        first[c].offset = total;
+        total += first[c].count;
+        first[c].count = 0;
+    }
+    if (total > slice->size) {
+        int *indices = realloc(slice->indices, total*sizeof(int));
+        if (indices == NULL) {
+            memset(first, 0, tiles_x*clusters->tiles_y*sizeof(LightCluster));
+            slice->failed = 1;
+            return;
+        }
+        slice->indices = indices;
+        slice->size = total;
+    }
+
+    for (int i=0; i < clusters->nlights; i++) {
+        const LightBounds *b = &clusters->bounds[i];
+        if (s < b->s0 || s > b->s1) {
+            continue;
+        }
+        for (int y=b->y0; y <= b->y1; y++) {
+            for (int x=b->x0; x <= b->x1; x++) {
+                LightCluster *cluster = &first[y*tiles_x + x];
+                slice->indices[cluster->offset + cluster->count++] = i;
+            }
+        }
+    }
+}
+
+int light_clusters_build(LightClusters *clusters, const LightList *lights,
+        Mat44f view, Mat44f projection, Mat44f viewport, JobPool *jobs) {
+    TRACE_BEGIN(build_start);
+    if (lights->count > clusters->lights_size) {
+        PointLight *view_lights = realloc(clusters->view_lights,
+                lights->count*sizeof(PointLight));
+        if (view_lights != NULL) {
+            clusters->view_lights = view_lights;
+        }
+        LightBounds *bounds = realloc(clusters->bounds,
+                lights->count*sizeof(LightBounds));
+        if (bounds != NULL) {
+            clusters->bounds = bounds;
+        }
+        if (view_lights == NULL || bounds == NULL) {
+            clusters->nlights = 0;
+            memset(clusters->clusters, 0, clusters->tiles_x*
+                    clusters->tiles_y*LIGHT_SLICES*sizeof(LightCluster));
+            return 1;
+        }
+        clusters->lights_size = lights->count;
+    }
+    clusters->nlights = lights->count;
+    clusters->depth_plane = (Vec4f){{projection.e[12], projection.e[13],
+        projection.e[14], projection.e[15]}};
+
+    ClusterBuild build = {clusters, lights, view,
+        m44fm44f(viewport, projection)};
+    jobs_parallel_for(jobs, (lights->count + LIGHT_JOB_LIGHTS - 1)/
+            LIGHT_JOB_LIGHTS, bounds_job, &build);
+    jobs_parallel_for(jobs, LIGHT_SLICES, slice_job, &build);
+
+    int failed = 0;
+    for (int s=0; s < LIGHT_SLICES; s++) {
+        failed |= clusters->slices[s].failed;
+    }
+    TRACE_END(build_start, "light clusters");
+    return failed;
+}
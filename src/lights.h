@@ -0,0 +1,130 @@
+#pragma once
+#include "gl.h"
+
+// Clustered point lights. The view frustum is split into screen tiles of
+// LIGHT_TILE_SIZE pixels and LIGHT_SLICES depth slices, and every frame each
+// cluster gets the list of lights whose bounds reach into it. A fragment
+// then only loops over the lights of its cluster instead of all of them.
+//
+//     LightList lights;
+//     lights_init(&lights);
+//     lights_add(&lights, light);         // world space
+//     LightClusters clusters;
+//     light_clusters_init(&clusters, width, height, .1f, 100.f);
+//     ...
+//     light_clusters_build(&clusters, &lights, view, projection, viewport,
+//             jobs);                      // per frame, after the camera
+//     ...
+//     int count;
+//     float depth = light_view_depth(&clusters, view_pos);
+//     const int *index = light_cluster_lights(&clusters, x, y, depth, 
+//             &count);
+//     // clusters.view_lights[index[0..count)] in view space
+//
+// The depth of a view space point is its clip w under the projection, the
+// distance in front of the camera for perspective().
+
+typedef struct {
+    Vec3f pos;
+    Vec3f color;
+    float radius;   // no light at and past this distance
+} PointLight;
+
+typedef struct {
+    PointLight *lights;
+    int count;
+    int size;
+} LightList;
+
+void lights_init(LightList *list);
+void lights_free(LightList *list);
+
+// Returns the index of the light, or -1 if allocation failed.
+int lights_add(LightList *list, PointLight light);
+
+// Cluster size on screen in pixels, and number of depth slices. Slices are
+// spaced exponentially from znear to zfar so clusters stay about as deep as
+// they are wide.
+#define LIGHT_TILE_SIZE 32
+#define LIGHT_SLICES 16
+
+// Lights of a cluster, at offset in the index list of its slice.
+typedef struct {
+    int offset;
+    int count;
+} LightCluster;
+
+// Light indices of all clusters of a depth slice, written by one job.
+typedef struct {
+    int *indices;
+    int size;
+    int failed;     // allocation failed, the slice has no lights
+} LightSlice;
+
+// Screen tiles and slices a light reaches, per build.
+typedef struct {
+    int x0, x1;
+    int y0, y1;
+    int s0, s1;     // s0 > s1 if the light is culled
+} LightBounds;
+
+typedef struct {
+    int tiles_x;
+    int tiles_y;
+    float znear;        // depth covered by the slices, fragments outside
+    float zfar;         // go into the first or last slice
+    float slice_scale;  // LIGHT_SLICES/log(zfar/znear)
+    Vec4f depth_plane;  // last row of the projection, w of a view point
+
+    LightCluster *clusters; // tiles_x*tiles_y per slice, slice major
+    LightSlice slices[LIGHT_SLICES];
+
+    PointLight *view_lights; // the lights in view space, per build
+    LightBounds *bounds;
+    int nlights;
+    int lights_size;
+} LightClusters;
+
+// Sets up clusters for a width x height target. Returns 1 if allocation
+// failed.
+int light_clusters_init(LightClusters *clusters, int width, int height,
+        float znear, float zfar);
+void light_clusters_free(LightClusters *clusters);
+
+// Assigns the lights to the clusters of the camera. view takes world to view
+// space, projection and viewport are those of the shader. The depth slices
+// are assigned in parallel as jobs on the pool, or serially for a NULL pool.
+// A light whose bounds reach to depth 0 covers all tiles of its slices.
+// Returns 1 if allocation failed, clusters may then miss lights.
+int light_clusters_build(LightClusters *clusters, const LightList *lights,
+        Mat44f view, Mat44f projection, Mat44f viewport, JobPool *jobs);
+
+// Depth of a view space point.
+static inline float light_view_depth(const LightClusters *clusters, 
+        Vec3f pos) {
+    const float *plane = clusters->depth_plane.e;
+    return plane[0]*pos.e[0] + plane[1]*pos.e[1] + plane[2]*pos.e[2] + 
+        plane[3];
+}
+
+// Depth slice of a depth.
+static inline int light_slice(const LightClusters *clusters, float depth) {
+    if (depth <= clusters->znear) {
+        return 0;
+    }
+    int s = (int)(logf(depth/clusters->znear)*clusters->slice_scale);
+    return MIN(s, LIGHT_SLICES - 1);
+}
+
+// Indices into view_lights of the lights of the cluster at pixel x, y, as
+// in frag_coord, and depth. Sets *count to their number.
+static inline const int *light_cluster_lights(const LightClusters *clusters,
+        int x, int y, float depth, int *count) {
+    int tx = MIN(MAX(x, 0)/LIGHT_TILE_SIZE, clusters->tiles_x - 1);
+    int ty = MIN(MAX(y, 0)/LIGHT_TILE_SIZE, clusters->tiles_y - 1);
+    int s = light_slice(clusters, depth);
+    const LightCluster *cluster = &clusters->clusters[
+        (s*clusters->tiles_y + ty)*clusters->tiles_x + tx];
+    *count = cluster->count;
+    return clusters->slices[s].indices + cluster->offset;
+}
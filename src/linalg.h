@@ -1,11 +1,28 @@
 #pragma once
 #include <math.h>
+#include <stdint.h>
+
+// SIMD backend for the 4 wide types, picked at compile time. Build with
+// -DLINALG_SCALAR to force the plain loops everywhere.
+#if defined(__SSE__) && !defined(LINALG_SCALAR)
+#include <xmmintrin.h>
+#define LINALG_SSE
+#elif defined(__ARM_NEON) && !defined(LINALG_SCALAR)
+#include <arm_neon.h>
+#define LINALG_NEON
+#endif
+
+// Vec4f, Vec4i and Mat44f rows are 16 byte aligned so they load straight 
+// into vector registers.
+#define LINALG_ALIGN _Alignas(16)
 
 // https://en.wikipedia.org/wiki/Fast_inverse_square_root
-static float q_rsqrt( float number ) {
+// The integer view must be 32 bits, long is 64 on LP64. See fastmath.h for
+// the faster and more accurate fast_rsqrt.
+static inline float q_rsqrt( float number ) {
 	union {
 		float f;
-		long i;
+		int32_t i;
 	} conv;
 	
 	float x2;
@@ -34,11 +51,11 @@ typedef struct {
 } Vec3f;
 
 typedef struct {
-    int e[4];
+    LINALG_ALIGN int e[4];
 } Vec4i;
 
 typedef struct {
-    float e[4];
+    LINALG_ALIGN float e[4];
 } Vec4f;
 
 typedef struct {
@@ -50,7 +67,7 @@ typedef struct {
 } Mat33f;
 
 typedef struct {
-    float e[4*4];
+    LINALG_ALIGN float e[4*4];
 } Mat44f;
 
 #define VEC_UTILS(fname, Vtype, type, dim) \
@@ -250,7 +267,10 @@ static inline Vec3f v3fcross(Vec3f a, Vec3f b) {
         }                                                                   \
         return val;                                                         \
     }                                                                       \
-                                                                            \
+
+// Matrix-vector and matrix-matrix products, split from MAT_UTILS so Mat44f 
+// can provide SIMD versions instead.
+#define MAT_PRODUCTS(fname, Mtype, Vtype, type, dim) \
     static inline Vtype fname##v##dim(Mtype m,                              \
             Vtype v) {                                                      \
         Vtype val;                                                          \
@@ -279,11 +299,13 @@ static inline Vec3f v3fcross(Vec3f a, Vec3f b) {
     }                                                                       \
 
 MAT_UTILS(m22f,Mat22f,Vec2f,float,2)
+MAT_PRODUCTS(m22f,Mat22f,Vec2f,float,2)
 static inline float m22fdet(Mat22f m) {
     return (m.e[2*0 + 0] * m.e[2*1 + 1] - m.e[2*0 + 1] * m.e[2*1 + 0]);
 }
 
 MAT_UTILS(m33f,Mat33f,Vec3f,float,3)
+MAT_PRODUCTS(m33f,Mat33f,Vec3f,float,3)
 static inline float m33fdet(Mat33f m) {
     return (
         m.e[2*0 + 0]*(m.e[2*1 + 1]*m.e[2*2 + 2] - m.e[2*1 + 2]*m.e[2*2 + 1]) +
@@ -294,6 +316,150 @@ static inline float m33fdet(Mat33f m) {
 
 MAT_UTILS(m44f,Mat44f,Vec4f,float,4)
 
+// The SIMD products accumulate in the same order as the scalar loops, 
+// c_i = ((a_i0*b_0 + a_i1*b_1) + a_i2*b_2) + a_i3*b_3, so results are bit 
+// identical across backends.
+#if defined(LINALG_SSE)
+
+// Columns of m, for broadcasting vector components against.
+static inline void m44f_cols_sse(const Mat44f *m, __m128 c[4]) {
+    c[0] = _mm_load_ps(&m->e[0]);
+    c[1] = _mm_load_ps(&m->e[4]);
+    c[2] = _mm_load_ps(&m->e[8]);
+    c[3] = _mm_load_ps(&m->e[12]);
+    _MM_TRANSPOSE4_PS(c[0], c[1], c[2], c[3]);
+}
+
+static inline __m128 m44f_apply_sse(const __m128 c[4], __m128 v) {
+    __m128 acc = _mm_mul_ps(c[0], _mm_shuffle_ps(v, v, 0x00));
+    acc = _mm_add_ps(acc, _mm_mul_ps(c[1], _mm_shuffle_ps(v, v, 0x55)));
+    acc = _mm_add_ps(acc, _mm_mul_ps(c[2], _mm_shuffle_ps(v, v, 0xaa)));
+    acc = _mm_add_ps(acc, _mm_mul_ps(c[3], _mm_shuffle_ps(v, v, 0xff)));
+    return acc;
+}
+
+static inline Vec4f m44fv4(Mat44f m, Vec4f v) {
+    __m128 c[4];
+    m44f_cols_sse(&m, c);
+    // Set from the elements rather than loading v, it is passed in two 
+    // halves and a wide load of those stalls store forwarding.
+    __m128 x = _mm_setr_ps(v.e[0], v.e[1], v.e[2], v.e[3]);
+    Vec4f val;
+    _mm_store_ps(val.e, m44f_apply_sse(c, x));
+    return val;
+}
+
+static inline Mat44f m44fm44f(Mat44f a, Mat44f b) {
+    // Row i of the product is sum_k(a_ik*row_k(b)).
+    __m128 rows[4] = {_mm_load_ps(&b.e[0]), _mm_load_ps(&b.e[4]), 
+        _mm_load_ps(&b.e[8]), _mm_load_ps(&b.e[12])};
+    Mat44f val;
+    for (int i=0; i<4; i++) {
+        _mm_store_ps(&val.e[4*i], 
+                m44f_apply_sse(rows, _mm_load_ps(&a.e[4*i])));
+    }
+    return val;
+}
+
+// out[i] = m*in[i] for n vectors. in and out may be the same array.
+static inline void m44fv4_batch(Mat44f m, const Vec4f *in, Vec4f *out, 
+        int n) {
+    __m128 c[4];
+    m44f_cols_sse(&m, c);
+    for (int i=0; i<n; i++) {
+        _mm_store_ps(out[i].e, m44f_apply_sse(c, _mm_load_ps(in[i].e)));
+    }
+}
+
+// out[i] = m*(x, y, z, 1) for n points stored as packed xyz floats, the
+// layout of Mesh.verts.
+static inline void m44fv3p_batch(Mat44f m, const float *in, Vec4f *out, 
+        int n) {
+    __m128 c[4];
+    m44f_cols_sse(&m, c);
+    for (int i=0; i<n; i++) {
+        // One wide load per point, except the last which would read past 
+        // the end of the array.
+        __m128 p = (i < n - 1) ? _mm_loadu_ps(&in[3*i]) :
+            _mm_setr_ps(in[3*i], in[3*i + 1], in[3*i + 2], 0.f);
+        __m128 acc = _mm_mul_ps(c[0], _mm_shuffle_ps(p, p, 0x00));
+        acc = _mm_add_ps(acc, _mm_mul_ps(c[1], _mm_shuffle_ps(p, p, 0x55)));
+        acc = _mm_add_ps(acc, _mm_mul_ps(c[2], _mm_shuffle_ps(p, p, 0xaa)));
+        acc = _mm_add_ps(acc, c[3]);
+        _mm_store_ps(out[i].e, acc);
+    }
+}
+
+#elif defined(LINALG_NEON)
+
+static inline float32x4_t m44f_apply_neon(float32x4x4_t c, float32x4_t v) {
+    float32x4_t acc = vmulq_n_f32(c.val[0], vgetq_lane_f32(v, 0));
+    acc = vaddq_f32(acc, vmulq_n_f32(c.val[1], vgetq_lane_f32(v, 1)));
+    acc = vaddq_f32(acc, vmulq_n_f32(c.val[2], vgetq_lane_f32(v, 2)));
+    acc = vaddq_f32(acc, vmulq_n_f32(c.val[3], vgetq_lane_f32(v, 3)));
+    return acc;
+}
+
+static inline Vec4f m44fv4(Mat44f m, Vec4f v) {
+    // vld4q deinterleaves, giving the columns of the row major matrix.
+    float32x4x4_t c = vld4q_f32(m.e);
+    Vec4f val;
+    vst1q_f32(val.e, m44f_apply_neon(c, vld1q_f32(v.e)));
+    return val;
+}
+
+static inline Mat44f m44fm44f(Mat44f a, Mat44f b) {
+    float32x4x4_t rows = {{vld1q_f32(&b.e[0]), vld1q_f32(&b.e[4]), 
+        vld1q_f32(&b.e[8]), vld1q_f32(&b.e[12])}};
+    Mat44f val;
+    for (int i=0; i<4; i++) {
+        vst1q_f32(&val.e[4*i], m44f_apply_neon(rows, vld1q_f32(&a.e[4*i])));
+    }
+    return val;
+}
+
+static inline void m44fv4_batch(Mat44f m, const Vec4f *in, Vec4f *out, 
+        int n) {
+    float32x4x4_t c = vld4q_f32(m.e);
+    for (int i=0; i<n; i++) {
+        vst1q_f32(out[i].e, m44f_apply_neon(c, vld1q_f32(in[i].e)));
+    }
+}
+
+static inline void m44fv3p_batch(Mat44f m, const float *in, Vec4f *out, 
+        int n) {
+    float32x4x4_t c = vld4q_f32(m.e);
+    for (int i=0; i<n; i++) {
+        const float *p = &in[3*i];
+        float32x4_t acc = vmulq_n_f32(c.val[0], p[0]);
+        acc = vaddq_f32(acc, vmulq_n_f32(c.val[1], p[1]));
+        acc = vaddq_f32(acc, vmulq_n_f32(c.val[2], p[2]));
+        acc = vaddq_f32(acc, c.val[3]);
+        vst1q_f32(out[i].e, acc);
+    }
+}
+
+#else
+
+MAT_PRODUCTS(m44f,Mat44f,Vec4f,float,4)
+
+static inline void m44fv4_batch(Mat44f m, const Vec4f *in, Vec4f *out, 
+        int n) {
+    for (int i=0; i<n; i++) {
+        out[i] = m44fv4(m, in[i]);
+    }
+}
+
+static inline void m44fv3p_batch(Mat44f m, const float *in, Vec4f *out, 
+        int n) {
+    for (int i=0; i<n; i++) {
+        Vec4f p = {{in[3*i + 0], in[3*i + 1], in[3*i + 2], 1.f}};
+        out[i] = m44fv4(m, p);
+    }
+}
+
+#endif
+
 // TODO LU decomposition
 static inline Mat44f m44finv(Mat44f m) {
     Mat44f inv;
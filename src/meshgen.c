@@ -0,0 +1,153 @@
+#include "meshgen.h"
+
+// xorshift32, deterministic for a given seed.
+static inline float rand_unit(unsigned *state) {
+    unsigned x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return (x >> 8)*(1.f/16777216.f);
+}
+
+void meshgen_defaults(MeshGenParams *params) {
+    params->triangles = 100000;
+    params->size_min = 0.005f;
+    params->size_max = 0.05f;
+    params->distribution = SIZE_LOG;
+    params->layers = 1;
+    params->coverage = 1.f;
+    params->seed = 1;
+}
+
+int meshgen_parse(const char *spec, MeshGenParams *params) {
+    meshgen_defaults(params);
+
+    char buffer[256];
+    strncpy(buffer, spec, sizeof(buffer) - 1);
+    buffer[sizeof(buffer) - 1] = '\0';
+
+    for (char *tok = strtok(buffer, ","); tok; tok = strtok(NULL, ",")) {
+        char dist[16];
+        if (sscanf(tok, "tris=%ld", &params->triangles) == 1) {
+            continue;
+        } else if (sscanf(tok, "size=%f:%f", &params->size_min,
+                    &params->size_max) == 2) {
+            continue;
+        } else if (sscanf(tok, "dist=%15s", dist) == 1) {
+            params->distribution = (strcmp(dist, "uniform") == 0) ?
+                SIZE_UNIFORM : SIZE_LOG;
+        } else if (sscanf(tok, "layers=%d", &params->layers) == 1) {
+            continue;
+        } else if (sscanf(tok, "coverage=%f", &params->coverage) == 1) {
+            continue;
+        } else if (sscanf(tok, "seed=%u", &params->seed) == 1) {
+            continue;
+        } else {
+            return 1;
+        }
+    }
+    return (params->triangles < 1 || params->layers < 1 ||
+            params->size_min <= 0.f || params->size_max < params->size_min ||
+            params->coverage <= 0.f);
+}
+
+int meshgen_generate(const MeshGenParams *params, Mesh *obj) {
+    size_t ntris = params->triangles;
+    size_t nindices = 3*ntris;
+
+    // Every triangle has its own three vertices. All share one normal and
+    // one set of three uvs.
+    obj->nverts = 3*nindices;
+    obj->nuvs = 3*3;
+    obj->nnormals = 3;
+    obj->nfaces_verts = nindices;
+    obj->verts = malloc(obj->nverts*sizeof(float));
+    obj->uvs = malloc(obj->nuvs*sizeof(float));
+    obj->normals = malloc(obj->nnormals*sizeof(float));
+    obj->faces_verts = malloc(nindices*sizeof(int));
+    obj->faces_uvs = malloc(nindices*sizeof(int));
+    obj->faces_normals = malloc(nindices*sizeof(int));
+    if (!obj->verts || !obj->uvs || !obj->normals || !obj->faces_verts ||
+            !obj->faces_uvs || !obj->faces_normals) {
+        free_model_data(*obj);
+        return 1;
+    }
+
+    const float uvs[9] = {0.f, 0.f, 0.f,  1.f, 0.f, 0.f,  0.f, 1.f, 0.f};
+    memcpy(obj->uvs, uvs, sizeof(uvs));
+    obj->normals[0] = 0.f;
+    obj->normals[1] = 0.f;
+    obj->normals[2] = 1.f;
+
+    unsigned state = params->seed ? params->seed : 1;
+    float half = sqrtf(params->coverage);
+    float log_min = logf(params->size_min);
+    float log_max = logf(params->size_max);
+    const float two_pi = 6.2831853f;
+
+    for (size_t t=0; t < ntris; t++) {
+        int layer = t % params->layers;
+        float z = (params->layers > 1) ?
+            -0.5f + (float)layer/(params->layers - 1) : 0.f;
+
+        float size = (params->distribution == SIZE_LOG) ?
+            expf(log_min + (log_max - log_min)*rand_unit(&state)) :
+            params->size_min + 
+            (params->size_max - params->size_min)*rand_unit(&state);
+        float cx = (2.f*rand_unit(&state) - 1.f)*half;
+        float cy = (2.f*rand_unit(&state) - 1.f)*half;
+        float angle = two_pi*rand_unit(&state);
+
+        // Counter-clockwise, roughly equilateral, circumradius size/sqrt(3).
+        float r = size*0.57735f;
+        for (int j=0; j < 3; j++) {
+            float a = angle + j*two_pi/3.f;
+            size_t v = 3*t + j;
+            obj->verts[3*v + 0] = cx + r*cosf(a);
+            obj->verts[3*v + 1] = cy + r*sinf(a);
+            obj->verts[3*v + 2] = z;
+            obj->faces_verts[v] = v;
+            obj->faces_uvs[v] = j;
+            obj->faces_normals[v] = 0;
+        }
+    }
+    return 0;
+}
+
+int mesh_write_obj(FILE *fp, const Mesh *obj) {
+    for (int i=0; i < obj->nverts; i += 3) {
+        fprintf(fp, "v %.9g %.9g %.9g\n", obj->verts[i], obj->verts[i + 1],
+                obj->verts[i + 2]);
+    }
+    for (int i=0; i < obj->nuvs; i += 3) {
+        fprintf(fp, "vt %.9g %.9g %.9g\n", obj->uvs[i], obj->uvs[i + 1],
+                obj->uvs[i + 2]);
+    }
+    for (int i=0; i < obj->nnormals; i += 3) {
+        fprintf(fp, "vn %.9g %.9g %.9g\n", obj->normals[i],
+                obj->normals[i + 1], obj->normals[i + 2]);
+    }
+
+    // OBJ indices are 1-based. %.9g above round-trips floats exactly, so the
+    // loaded mesh renders identically.
+    int has_uvs = obj->nuvs > 0, has_normals = obj->nnormals > 0;
+    for (int i=0; i < obj->nfaces_verts; i += 3) {
+        fprintf(fp, "f");
+        for (int j=0; j < 3; j++) {
+            int v = obj->faces_verts[i + j] + 1;
+            if (has_uvs && has_normals) {
+                fprintf(fp, " %d/%d/%d", v, obj->faces_uvs[i + j] + 1,
+                        obj->faces_normals[i + j] + 1);
+            } else if (has_normals) {
+                fprintf(fp, " %d//%d", v, obj->faces_normals[i + j] + 1);
+            } else if (has_uvs) {
+                fprintf(fp, " %d/%d/", v, obj->faces_uvs[i + j] + 1);
+            } else {
+                fprintf(fp, " %d//", v);
+            }
+        }
+        fprintf(fp, "\n");
+    }
+    return ferror(fp) ? 1 : 0;
+}
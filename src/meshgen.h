@@ -0,0 +1,37 @@
+#pragma once
+#include "gl.h"
+
+// Synthetic mesh generator for scaling benchmarks.
+//
+// Triangles are scattered over `layers` planes stacked along z between -0.5
+// and 0.5, all facing +z. On each plane they are placed inside a centered 
+// square covering `coverage` of the [-1, 1]^2 area, so depth complexity is 
+// roughly layers times the overlap within a layer. Triangle edge lengths are
+// drawn between size_min and size_max, uniformly or log-uniformly.
+
+typedef enum {SIZE_UNIFORM, SIZE_LOG} size_distribution;
+
+typedef struct {
+    long triangles;
+    float size_min;
+    float size_max;
+    size_distribution distribution;
+    int layers;
+    float coverage;
+    unsigned seed;
+} MeshGenParams;
+
+void meshgen_defaults(MeshGenParams *params);
+
+// Parses a comma separated spec into params, starting from the defaults.
+// Keys: tris=N, size=MIN:MAX, dist=uniform|log, layers=N, coverage=F, seed=N
+// For example "tris=1000000,size=0.002:0.05,dist=log,layers=4".
+// Returns 1 on a malformed spec.
+int meshgen_parse(const char *spec, MeshGenParams *params);
+
+// Generates the mesh. Free with free_model_data(). Returns 1 if allocation
+// failed.
+int meshgen_generate(const MeshGenParams *params, Mesh *obj);
+
+// Writes a mesh as OBJ text readable by load_obj().
+int mesh_write_obj(FILE *fp, const Mesh *obj);
@@ -1,4 +1,5 @@
 #include "obj.h"
+#include "trace.h"
 #include <unistd.h>
 
 // Local helper functions
@@ -145,9 +146,13 @@ int load_obj_mem(FILE *fp, Mesh *obj) {
     char *str = buffer;
     int line_len = 0;
 
+    TRACE_BEGIN(load_start);
+
     // Get element sizes.
+    TRACE_BEGIN(count_start);
     get_obj_type_count(fp, &obj->nverts, &obj->nuvs, &obj->nnormals,
             &obj->nfaces_verts);
+    TRACE_END(count_start, "obj count");
     
     // Allocate memory for data.
     obj->verts           = malloc(obj->nverts*sizeof(float)); 
@@ -158,6 +163,7 @@ int load_obj_mem(FILE *fp, Mesh *obj) {
     obj->faces_normals   = malloc(obj->nfaces_verts*sizeof(int)); 
     
     // Save vertex data.
+    TRACE_BEGIN(verts_start);
     seek_to(fp, "v ");
     {
         int i = 0;
@@ -172,14 +178,18 @@ int load_obj_mem(FILE *fp, Mesh *obj) {
         }
     }
     
+    TRACE_END(verts_start, "obj verts");
+    
     // Save UV data.
+    TRACE_BEGIN(uvs_start);
     seek_to(fp, "vt");
     {
         int i = 0;
         while (i < obj->nuvs) {
             get_next_obj_entry(fp, "vt ", &str);
 
-            float uvx, uvy, uvz;
+            // The third component is optional.
+            float uvx, uvy, uvz = 0.f;
             sscanf(str, "vt %f %f %f", &uvx, &uvy, &uvz);
             obj->uvs[i++] = uvx;
             obj->uvs[i++] = uvy;
@@ -187,7 +197,10 @@ int load_obj_mem(FILE *fp, Mesh *obj) {
         }
     }
     
+    TRACE_END(uvs_start, "obj uvs");
+    
     // Save Normal data.
+    TRACE_BEGIN(normals_start);
     seek_to(fp, "vn");
     {
         int i = 0;
@@ -202,7 +215,10 @@ int load_obj_mem(FILE *fp, Mesh *obj) {
         }
     }
 
+    TRACE_END(normals_start, "obj normals");
+
     // Save faces data.
+    TRACE_BEGIN(faces_start);
     seek_to(fp, "f ");
     {
         int i = 0;
@@ -251,6 +267,9 @@ int load_obj_mem(FILE *fp, Mesh *obj) {
         }
     }
 
+    TRACE_END(faces_start, "obj faces");
+    TRACE_END(load_start, "load_obj");
+
     printf("Number of vert elements %d, Number of vertids: %d. \n\n\n", obj->nverts, obj->nfaces_verts);
     fclose(fp);
     return 0;
@@ -0,0 +1,257 @@
+#pragma once
+#include "gl.h"
+
+// Specialized pipelines. DEFINE_PIPELINE() generates a draw function with the
+// fragment shader, the varyings it reads, the depth test and write and the
+// buffer formats fixed at compile time. The fragment shader is called
+// directly so the compiler can inline it into the raster loop, and setup only
+// fills the varyings the shader reads.
+//
+//     DEFINE_PIPELINE(draw_phong, shader_phong_fragment,
+//             PIPE_VARYING_POST | PIPE_VARYING_NORMAL,
+//             PIPE_DEPTH_TEST | PIPE_DEPTH_WRITE, Z, RGBA)
+//     ...
+//     draw_phong(mesh, &ctx, &rgba, &z);   // like draw_model()
+//
+// The generated function is static, define it in the file using it. Output
+// matches draw_model() exactly. It needs a shader with vertex_shader_batch,
+// which still runs through the shader, once per VERTEX_BATCH vertices, and
+// buffers of the given formats. It falls back to draw_model() otherwise, for
+// debug modes and for DRAW_SORT_LAST.
+//
+// Parameters:
+//  name        name of the draw function
+//  fragment    int fragment(Vec3f bar, Vec3f *color, void *shader)
+//  varyings    PIPE_VARYING_* flags, the ShaderBase varyings to set up
+//  depth       PIPE_DEPTH_* flags. Without PIPE_DEPTH_TEST every covered
+//              sample is shaded, without PIPE_DEPTH_WRITE the depth buffer
+//              is left unchanged.
+//  zformat     depth buffer format, Z, Z16 or Z32F for BUF_Z, BUF_Z16 and
+//              BUF_Z32F
+//  cformat     color buffer format, RGBA or RGBAF
+
+#define PIPE_VARYING_POS    1   // varying_vertex_pos, object space position
+#define PIPE_VARYING_POST   2   // varying_vertex_post, vertex shader output
+#define PIPE_VARYING_NORMAL 4
+#define PIPE_VARYING_UV     8
+#define PIPE_VARYING_ALL    15
+
+#define PIPE_DEPTH_TEST  1
+#define PIPE_DEPTH_WRITE 2
+
+// Per format storage type, buffer type and conversion, picked by token
+// pasting the zformat and cformat parameters.
+#define PIPE_ZTYPE_Z int
+#define PIPE_ZTYPE_Z16 uint16_t
+#define PIPE_ZTYPE_Z32F float
+#define PIPE_BUF_Z BUF_Z
+#define PIPE_BUF_Z16 BUF_Z16
+#define PIPE_BUF_Z32F BUF_Z32F
+#define PIPE_BUF_RGBA BUF_RGBA
+#define PIPE_BUF_RGBAF BUF_RGBAF
+
+// Quantize normalized depth like the generic rasterizer.
+static inline int pipe_depth_Z(float d) {
+    return (int)(d*(float)(1 << DEPTH_Z_BITS));
+}
+static inline uint16_t pipe_depth_Z16(float d) {
+    return (uint16_t)(clamp(d, 0.f, 1.f)*0xffff);
+}
+static inline float pipe_depth_Z32F(float d) {
+    return d;
+}
+
+// Color writes to a row of the color buffer.
+static inline void pipe_color_RGBA(ScreenBuffer *buffer, void *row, int x,
+        Vec3f col) {
+    col.e[0] = clamp(col.e[0], 0.f, 1.f);
+    col.e[1] = clamp(col.e[1], 0.f, 1.f);
+    col.e[2] = clamp(col.e[2], 0.f, 1.f);
+    ((uint32_t *)row)[x] = pack_color(buffer->format, (int)(col.e[0]*0xff),
+            (int)(col.e[1]*0xff), (int)(col.e[2]*0xff), 0);
+}
+static inline void pipe_color_RGBAF(ScreenBuffer *buffer, void *row, int x,
+        Vec3f col) {
+    (void)buffer;
+    Vec4f c = {{col.e[0], col.e[1], col.e[2], 1.f}};
+    ((Vec4f *)row)[x] = c;
+}
+
+// Row y of a buffer, counted from the bottom like set_color().
+static inline void *pipe_row(ScreenBuffer *buffer, int y) {
+    return (char *)buffer->memory + (buffer->height - 1 - y)*buffer->pitch;
+}
+
+// barycentric() of the generic rasterizer, twice the signed area of a, b, c.
+static inline int pipe_edge(Vec2i a, Vec2i b, Vec2i c) {
+    return (b.e[0] - a.e[0])*(c.e[1] - a.e[1]) - 
+        (c.e[0] - a.e[0])*(b.e[1] - a.e[1]);
+}
+
+// Vertex attribute i of a face, zero when the mesh has none.
+static inline Vec3f pipe_attribute(const float *data, const int *faces,
+        int i) {
+    if (data == NULL) {
+        Vec3f zero = {{0.f, 0.f, 0.f}};
+        return zero;
+    }
+    const float *a = &data[3*faces[i]];
+    Vec3f v = {{a[0], a[1], a[2]}};
+    return v;
+}
+
+#define DEFINE_PIPELINE(name, fragment, varyings, depth, zformat, cformat)  \
+    static void name##_raster(const ShadedVertex *sv[3], int area,          \
+            int xmin, int xmax, int ymin, int ymax, ShaderBase *shader,     \
+            ScreenBuffer *buffer_rgba, ScreenBuffer *buffer_z) {            \
+        enum {sub_factor = 16};                                             \
+        Vec2i s0 = sv[0]->sc, s1 = sv[1]->sc, s2 = sv[2]->sc;               \
+        float z0 = sv[0]->clip_z, z1 = sv[1]->clip_z, z2 = sv[2]->clip_z;   \
+        Mat44f vp = shader->viewport;                                       \
+        /* Edge functions of pipe_edge(), stepped one sample at a time */   \
+        /* in exact integer arithmetic. */                                  \
+        int dx0 = -(s2.e[1] - s1.e[1])*sub_factor;                          \
+        int dy0 = (s2.e[0] - s1.e[0])*sub_factor;                           \
+        int dx1 = -(s0.e[1] - s2.e[1])*sub_factor;                          \
+        int dy1 = (s0.e[0] - s2.e[0])*sub_factor;                           \
+        int dx2 = -(s1.e[1] - s0.e[1])*sub_factor;                          \
+        int dy2 = (s1.e[0] - s0.e[0])*sub_factor;                           \
+        Vec2i p = {{xmin, ymin}};                                           \
+        int row0 = pipe_edge(s1, s2, p);                                    \
+        int row1 = pipe_edge(s2, s0, p);                                    \
+        int row2 = pipe_edge(s0, s1, p);                                    \
+        uint64_t covered = 0, passed = 0;                                   \
+        for (int y=ymin; y<=ymax; y+=sub_factor) {                          \
+            int buf_y = y/sub_factor;                                       \
+            PIPE_ZTYPE_##zformat *zrow = pipe_row(buffer_z, buf_y);         \
+            void *crow = pipe_row(buffer_rgba, buf_y);                      \
+            int e0 = row0, e1 = row1, e2 = row2;                            \
+            for (int x=xmin; x<=xmax; x+=sub_factor) {                      \
+                float w0 = e0, w1 = e1, w2 = e2;                            \
+                e0 += dx0; e1 += dx1; e2 += dx2;                            \
+                w0 /= area; w1 /= area; w2 /= area;                         \
+                if (!(w0 >= 0 && w1 >= 0 && w2 >= 0)) {                     \
+                    continue;                                               \
+                }                                                           \
+                covered++;                                                  \
+                int buf_x = x/sub_factor;                                   \
+                if ((depth) & (PIPE_DEPTH_TEST | PIPE_DEPTH_WRITE)) {       \
+                    float z = z0*w0 + z1*w1 + z2*w2;                        \
+                    PIPE_ZTYPE_##zformat d =                                \
+                        pipe_depth_##zformat(viewport_depth(&vp, z));       \
+                    if (((depth) & PIPE_DEPTH_TEST) && !(zrow[buf_x] < d)) {\
+                        continue;                                           \
+                    }                                                       \
+                    if ((depth) & PIPE_DEPTH_WRITE) {                       \
+                        zrow[buf_x] = d;                                    \
+                    }                                                       \
+                }                                                           \
+                passed++;                                                   \
+                shader->frag_coord.e[0] = buf_x;                            \
+                shader->frag_coord.e[1] = buf_y;                            \
+                Vec3f bar = {{w0, w1, w2}};                                 \
+                Vec3f col;                                                  \
+                fragment(bar, &col, shader);                                \
+                pipe_color_##cformat(buffer_rgba, crow, buf_x, col);        \
+            }                                                               \
+            row0 += dy0; row1 += dy1; row2 += dy2;                          \
+        }                                                                   \
+        STATS_ADD(samples_visited,                                          \
+                (uint64_t)((xmax - xmin)/sub_factor + 1)*                   \
+                ((ymax - ymin)/sub_factor + 1));                            \
+        STATS_ADD(samples_covered, covered);                                \
+        STATS_ADD(depth_pass, passed);                                      \
+        STATS_ADD(depth_fail, covered - passed);                            \
+        STATS_ADD(fragment_shader_calls, passed);                           \
+        (void)covered; (void)passed;                                        \
+    }                                                                       \
+                                                                            \
+    static void name(Mesh obj, RenderContext *ctx,                          \
+            ScreenBuffer *buffer_rgba, ScreenBuffer *buffer_z) {            \
+        enum {sub_factor = 16, sub_mask = 15};                              \
+        ShaderBase *shader = ctx->shader;                                   \
+        if (ctx->debug != DEBUG_NONE ||                                     \
+                ctx->draw_strategy != DRAW_IMMEDIATE ||                     \
+                buffer_z->type != PIPE_BUF_##zformat ||                     \
+                buffer_rgba->type != PIPE_BUF_##cformat) {                  \
+            draw_model(obj, ctx, buffer_rgba, buffer_z);                    \
+            return;                                                         \
+        }                                                                   \
+        const ShadedVertex *shaded = draw_vertex_stage(obj, ctx);           \
+        if (shaded == NULL) {                                               \
+            draw_model(obj, ctx, buffer_rgba, buffer_z);                    \
+            return;                                                         \
+        }                                                                   \
+                                                                            \
+        int xlimit = sub_factor*(MIN(buffer_rgba->width,                    \
+                    buffer_z->width) - 1);                                  \
+        int ylimit = sub_factor*(MIN(buffer_rgba->height,                   \
+                    buffer_z->height) - 1);                                 \
+        int xstart = 0, ystart = 0;                                         \
+        if (ctx->scissor) {                                                 \
+            xstart = sub_factor*MAX(ctx->scissor_min.e[0], 0);              \
+            ystart = sub_factor*MAX(ctx->scissor_min.e[1], 0);              \
+            xlimit = MIN(xlimit, sub_factor*ctx->scissor_max.e[0]);         \
+            ylimit = MIN(ylimit, sub_factor*ctx->scissor_max.e[1]);         \
+        }                                                                   \
+        const float *uvs = obj.nuvs > 0 ? obj.uvs : NULL;                   \
+        const float *normals = obj.nnormals > 0 ? obj.normals : NULL;       \
+                                                                            \
+        for (int i=0; i < obj.nfaces_verts; i += 3) {                       \
+            const int *face = &obj.faces_verts[i];                          \
+            const ShadedVertex *sv[3] = {&shaded[face[0]],                  \
+                &shaded[face[1]], &shaded[face[2]]};                        \
+            STATS_ADD(triangles_submitted, 1);                              \
+                                                                            \
+            int xmin = MIN(sv[0]->sc.e[0], MIN(sv[1]->sc.e[0],              \
+                        sv[2]->sc.e[0]));                                   \
+            int xmax = MAX(sv[0]->sc.e[0], MAX(sv[1]->sc.e[0],              \
+                        sv[2]->sc.e[0]));                                   \
+            int ymin = MIN(sv[0]->sc.e[1], MIN(sv[1]->sc.e[1],              \
+                        sv[2]->sc.e[1]));                                   \
+            int ymax = MAX(sv[0]->sc.e[1], MAX(sv[1]->sc.e[1],              \
+                        sv[2]->sc.e[1]));                                   \
+            xmin = (xmin + sub_mask) & ~sub_mask;                           \
+            ymin = (ymin + sub_mask) & ~sub_mask;                           \
+            if (xmin > xlimit || ymin > ylimit || xmax < xstart ||          \
+                    ymax < ystart) {                                        \
+                STATS_ADD(triangles_culled, 1);                             \
+                continue;                                                   \
+            }                                                               \
+            if (xmin < xstart || ymin < ystart || xmax > xlimit ||          \
+                    ymax > ylimit) {                                        \
+                STATS_ADD(triangles_clipped, 1);                            \
+                xmin = MAX(xmin, xstart);                                   \
+                ymin = MAX(ymin, ystart);                                   \
+                xmax = MIN(xmax, xlimit);                                   \
+                ymax = MIN(ymax, ylimit);                                   \
+            }                                                               \
+            int area = pipe_edge(sv[0]->sc, sv[1]->sc, sv[2]->sc);          \
+            if (area == 0) {                                                \
+                STATS_ADD(triangles_zero_area, 1);                          \
+                continue;                                                   \
+            }                                                               \
+                                                                            \
+            for (int j=0; j < 3; j++) {                                     \
+                if ((varyings) & PIPE_VARYING_POS) {                        \
+                    m33fsetcol(&shader->varying_vertex_pos, j,              \
+                            pipe_attribute(obj.verts, face, j));            \
+                }                                                           \
+                if ((varyings) & PIPE_VARYING_POST) {                       \
+                    m33fsetcol(&shader->varying_vertex_post, j,             \
+                            v4f2v3f(sv[j]->post));                          \
+                }                                                           \
+                if ((varyings) & PIPE_VARYING_NORMAL) {                     \
+                    m33fsetcol(&shader->varying_vertex_normal, j,           \
+                            pipe_attribute(normals,                         \
+                                &obj.faces_normals[i], j));                 \
+                }                                                           \
+                if ((varyings) & PIPE_VARYING_UV) {                         \
+                    m33fsetcol(&shader->varying_vertex_uv, j,               \
+                            pipe_attribute(uvs, &obj.faces_uvs[i], j));     \
+                }                                                           \
+            }                                                               \
+            name##_raster(sv, area, xmin, xmax, ymin, ymax, shader,         \
+                    buffer_rgba, buffer_z);                                 \
+        }                                                                   \
+    }
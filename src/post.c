@@ -0,0 +1,38 @@
+#include "post.h"
+#include "trace.h"
+
+// Passes fused into one parallel loop over the rows.
+typedef struct {
+    const PostPass *passes;
+    int n;
+} PostRun;
+
+static void post_job(void *arg, int index) {
+    PostRun *run = arg;
+    int y0 = index*POST_JOB_ROWS;
+    for (int i=0; i < run->n; i++) {
+        const PostPass *pass = &run->passes[i];
+        int y1 = MIN(y0 + POST_JOB_ROWS, pass->dst->height);
+        if (y0 < y1) {
+            pass->kernel(pass, y0, y1);
+        }
+    }
+}
+
+void post_run(JobPool *jobs, const PostPass *passes, int n) {
+    int first = 0;
+    while (first < n) {
+        TRACE_BEGIN(post_start);
+        int height = passes[first].dst->height;
+        int end = first + 1;
+        while (end < n && (passes[end].flags & POST_ROW_LOCAL)) {
+            height = MAX(height, passes[end].dst->height);
+            end++;
+        }
+        PostRun run = {passes + first, end - first};
+        jobs_parallel_for(jobs, (height + POST_JOB_ROWS - 1)/POST_JOB_ROWS,
+                post_job, &run);
+        first = end;
+        TRACE_END(post_start, "post pass");
+    }
+}
@@ -0,0 +1,72 @@
+#pragma once
+#include "gl.h"
+
+// Full-screen passes. A pass runs a kernel over the rows of its destination
+// buffer, reading its source and any other buffers directly, instead of
+// rasterizing a screen quad. Pixels pay no triangle setup, barycentrics,
+// depth test or varyings, so a pass costs about the memory it touches.
+//
+//     static inline uint32_t invert(const PostPass *pass, int x, int y) {
+//         return ~((const uint32_t *)post_row(pass->src, y))[x];
+//     }
+//     DEFINE_POST_PIXEL(invert_kernel, uint32_t, invert)
+//     ...
+//     PostPass passes[] = {
+//         {blur_kernel, &rgba, &tmp, &radius, 0},
+//         {invert_kernel, &tmp, &tmp, NULL, POST_ROW_LOCAL},
+//     };
+//     post_run(&pool, passes, 2);
+//
+// Passes run in order, each seeing the complete output of the passes before
+// it. POST_ROW_LOCAL passes are fused with the pass before them: each job
+// runs all of them over its rows in turn, so the rows one pass writes are
+// still in cache for the next and no pass waits for the whole image.
+//
+// Rows are memory rows, 0 at the top, unlike set_color() and frag_coord
+// which count from the bottom.
+
+// Rows per job.
+#define POST_JOB_ROWS 16
+
+// Row y of dst depends only on row y of src and of any other buffer the
+// kernel reads. The pass is then fused with the passes before it, which must
+// not read other rows of dst.
+#define POST_ROW_LOCAL 1
+
+typedef struct PostPass PostPass;
+
+// Writes memory rows y0 to y1 - 1 of pass->dst.
+typedef void (*post_kernel)(const PostPass *pass, int y0, int y1);
+
+struct PostPass {
+    post_kernel kernel;
+    ScreenBuffer *src;      // input, may be NULL, or dst for in place passes
+    ScreenBuffer *dst;      // the pass runs over all rows of dst
+    void *data;             // parameters of the kernel
+    int flags;              // POST_* flags
+};
+
+// Start of memory row y of a buffer.
+static inline void *post_row(const ScreenBuffer *buffer, int y) {
+    return (char *)buffer->memory + y*buffer->pitch;
+}
+
+// Defines a kernel name that sets every pixel of dst, of C type type, e.g.
+// uint32_t for BUF_RGBA or Vec4f for BUF_RGBAF, to pixel(pass, x, y). pixel
+// is called directly so a static inline function is inlined into the row
+// loop, which the compiler can then vectorize.
+#define DEFINE_POST_PIXEL(name, type, pixel)                                \
+static void name(const PostPass *pass, int y0, int y1) {                    \
+    int width = pass->dst->width;                                           \
+    for (int y=y0; y < y1; y++) {                                           \
+        type *out = post_row(pass->dst, y);                                 \
+        for (int x=0; x < width; x++) {                                     \
+            out[x] = pixel(pass, x, y);                                     \
+        }                                                                   \
+    }                                                                       \
+}
+
+// Runs the n passes in order and returns when all are done. Rows are split
+// into jobs on the pool, or run serially for a NULL pool. Call from outside
+// the pool's jobs.
+void post_run(JobPool *jobs, const PostPass *passes, int n);
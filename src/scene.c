@@ -0,0 +1,356 @@
+#include "scene.h"
+#include "trace.h"
+
+// Max depth of the traversal stack. Median splits keep the depth at about
+// log2(ninstances).
+#define BVH_STACK_SIZE 64
+
+void scene_init(Scene *scene) {
+    memset(scene, 0, sizeof(*scene));
+    scene->sort = 1;
+}
+
+void scene_free(Scene *scene) {
+    for (int i=0; i < scene->nmeshes; i++) {
+        mesh_clusters_free(&scene->clusters[i]);
+    }
+    free(scene->meshes);
+    free(scene->mesh_bounds);
+    free(scene->clusters);
+    free(scene->instances);
+    free(scene->nodes);
+    free(scene->order);
+    free(scene->visible);
+    free(scene->depth);
+    buffer_free(&scene->occlusion);
+    memset(scene, 0, sizeof(*scene));
+}
+
+int scene_add_mesh(Scene *scene, Mesh mesh) {
+    if (scene->nmeshes == scene->meshes_size) {
+        int size = scene->meshes_size ? 2*scene->meshes_size : 8;
+        Mesh *meshes = realloc(scene->meshes, size*sizeof(Mesh));
+        if (meshes == NULL) {
+            return -1;
+        }
+        scene->meshes = meshes;
+        Aabb *bounds = realloc(scene->mesh_bounds, size*sizeof(Aabb));
+        if (bounds == NULL) {
+            return -1;
+        }
+        scene->mesh_bounds = bounds;
+        MeshClusters *clusters = realloc(scene->clusters,
+                size*sizeof(MeshClusters));
+        if (clusters == NULL) {
+            return -1;
+        }
+        scene->clusters = clusters;
+        scene->meshes_size = size;
+    }
+    scene->meshes[scene->nmeshes] = mesh;
+    scene->mesh_bounds[scene->nmeshes] = mesh_bounds(mesh);
+    memset(&scene->clusters[scene->nmeshes], 0, sizeof(MeshClusters));
+    return scene->nmeshes++;
+}
+
+int scene_add_instance(Scene *scene, int mesh, Mat44f model) {
+    if (scene->ninstances == scene->instances_size) {
+        int size = scene->instances_size ? 2*scene->instances_size : 64;
+        SceneInstance *instances = realloc(scene->instances,
+                size*sizeof(SceneInstance));
+        if (instances == NULL) {
+            return -1;
+        }
+        scene->instances = instances;
+        scene->instances_size = size;
+    }
+    SceneInstance *instance = &scene->instances[scene->ninstances];
+    instance->mesh = mesh;
+    instance->occluder = 0;
+    scene_set_transform(scene, scene->ninstances, model);
+    return scene->ninstances++;
+}
+
+void scene_set_transform(Scene *scene, int instance, Mat44f model) {
+    SceneInstance *inst = &scene->instances[instance];
+    inst->model = model;
+    inst->bounds = aabb_transform(scene->mesh_bounds[inst->mesh], model);
+    scene->dirty = 1;
+}
+
+int scene_build_clusters(Scene *scene, int mesh) {
+    mesh_clusters_free(&scene->clusters[mesh]);
+    return mesh_build_clusters(&scene->meshes[mesh], &scene->clusters[mesh]);
+}
+
+void scene_set_occluder(Scene *scene, int instance, int occluder) {
+    scene->instances[instance].occluder = occluder;
+}
+
+int scene_enable_occlusion(Scene *scene, int width, int height) {
+    buffer_free(&scene->occlusion);
+    return buffer_init(&scene->occlusion, BUF_Z32F, width, height);
+}
+
+static inline Aabb aabb_union(Aabb a, Aabb b) {
+    for (int c=0; c < 3; c++) {
+        a.min.e[c] = MIN(a.min.e[c], b.min.e[c]);
+        a.max.e[c] = MAX(a.max.e[c], b.max.e[c]);
+    }
+    return a;
+}
+
+static inline float centroid(const Scene *scene, int instance, int axis) {
+    const Aabb *b = &scene->instances[instance].bounds;
+    return .5f*(b->min.e[axis] + b->max.e[axis]);
+}
+
+// Partially orders order[0..n) around the k-th smallest centroid along axis,
+// Hoare style quickselect.
+static void select_nth(const Scene *scene, int *order, int n, int k,
+        int axis) {
+    int lo = 0, hi = n - 1;
+    while (lo < hi) {
+        float pivot = centroid(scene, order[(lo + hi)/2], axis);
+        int i = lo, j = hi;
+        while (i <= j) {
+            while (centroid(scene, order[i], axis) < pivot) i++;
+            while (centroid(scene, order[j], axis) > pivot) j--;
+            if (i <= j) {
+                int tmp = order[i];
+                order[i] = order[j];
+                order[j] = tmp;
+                i++;
+                j--;
+            }
+        }
+        if (k <= j) {
+            hi = j;
+        } else if (k >= i) {
+            lo = i;
+        } else {
+            break;
+        }
+    }
+}
+
+static int build_node(Scene *scene, int first, int count) {
+    int index = scene->nnodes++;
+    BvhNode node = {.left = -1, .right = -1, .first = first, .count = count};
+
+    int *order = &scene->order[first];
+    node.bounds = scene->instances[order[0]].bounds;
+    Aabb centers = node.bounds;
+    for (int i=0; i < count; i++) {
+        Aabb *bounds = &scene->instances[order[i]].bounds;
+        node.bounds = aabb_union(node.bounds, *bounds);
+        for (int c=0; c < 3; c++) {
+            float v = centroid(scene, order[i], c);
+            if (i == 0 || v < centers.min.e[c]) centers.min.e[c] = v;
+            if (i == 0 || v > centers.max.e[c]) centers.max.e[c] = v;
+        }
+    }
+
+    if (count > BVH_LEAF_SIZE) {
+        Vec3f extent = v3fsub(centers.max, centers.min);
+        int axis = 0;
+        if (extent.e[1] > extent.e[axis]) axis = 1;
+        if (extent.e[2] > extent.e[axis]) axis = 2;
+
+        int half = count/2;
+        select_nth(scene, order, count, half, axis);
+        node.left = build_node(scene, first, half);
+        node.right = build_node(scene, first + half, count - half);
+    }
+    scene->nodes[index] = node;
+    return index;
+}
+
+int scene_build(Scene *scene) {
+    TRACE_BEGIN(build_start);
+    int n = scene->ninstances;
+    // A binary tree with at least one instance per leaf has < 2n nodes.
+    BvhNode *nodes = realloc(scene->nodes, MAX(2*n, 1)*sizeof(BvhNode));
+    if (nodes == NULL) {
+        return 1;
+    }
+    scene->nodes = nodes;
+    int *order = realloc(scene->order, MAX(n, 1)*sizeof(int));
+    if (order == NULL) {
+        return 1;
+    }
+    scene->order = order;
+    int *visible = realloc(scene->visible, MAX(n, 1)*sizeof(int));
+    if (visible == NULL) {
+        return 1;
+    }
+    scene->visible = visible;
+    float *depth = realloc(scene->depth, MAX(n, 1)*sizeof(float));
+    if (depth == NULL) {
+        return 1;
+    }
+    scene->depth = depth;
+
+    for (int i=0; i < n; i++) {
+        scene->order[i] = i;
+    }
+    scene->nnodes = 0;
+    if (n > 0) {
+        build_node(scene, 0, n);
+    }
+    scene->dirty = 0;
+    TRACE_END(build_start, "scene build");
+    return 0;
+}
+
+void scene_cull(Scene *scene, Mat44f view_proj) {
+    TRACE_BEGIN(cull_start);
+    Frustum frustum = frustum_from_matrix(view_proj);
+    scene->nvisible = 0;
+    STATS_ADD(instances_submitted, scene->ninstances);
+
+    int stack[BVH_STACK_SIZE];
+    int top = 0;
+    if (scene->nnodes > 0) {
+        stack[top++] = 0;
+    }
+    while (top > 0) {
+        const BvhNode *node = &scene->nodes[stack[--top]];
+        if (!frustum_test_aabb(&frustum, node->bounds)) {
+            STATS_ADD(instances_culled, node->count);
+            continue;
+        }
+        if (node->left >= 0 && top + 2 <= BVH_STACK_SIZE) {
+            stack[top++] = node->right;
+            stack[top++] = node->left;
+            continue;
+        }
+
+        // Leaf, or out of stack, test the instances one by one.
+        for (int i=0; i < node->count; i++) {
+            int instance = scene->order[node->first + i];
+            if (frustum_test_aabb(&frustum,
+                        scene->instances[instance].bounds)) {
+                scene->visible[scene->nvisible++] = instance;
+            } else {
+                STATS_ADD(instances_culled, 1);
+            }
+        }
+    }
+    TRACE_END(cull_start, "scene cull");
+}
+
+void scene_occlude(Scene *scene, Mat44f view_proj) {
+    TRACE_BEGIN(occlude_start);
+    ScreenBuffer *buffer_z = &scene->occlusion;
+    buffer_clear(buffer_z);
+    for (int i=0; i < scene->nvisible; i++) {
+        const SceneInstance *inst = &scene->instances[scene->visible[i]];
+        if (inst->occluder) {
+            draw_model_depth(scene->meshes[inst->mesh],
+                    m44fm44f(view_proj, inst->model), buffer_z);
+        }
+    }
+
+    int n = 0;
+    for (int i=0; i < scene->nvisible; i++) {
+        int instance = scene->visible[i];
+        const SceneInstance *inst = &scene->instances[instance];
+        if (inst->occluder ||
+                occlusion_test_aabb(buffer_z, view_proj, inst->bounds)) {
+            scene->visible[n++] = instance;
+        } else {
+            STATS_ADD(instances_occluded, 1);
+        }
+    }
+    scene->nvisible = n;
+    TRACE_END(occlude_start, "scene occlude");
+}
+
+// Sorts the visible instances front to back by the view depth of their
+// bounds centers.
+static void sort_visible(Scene *scene, Mat44f view_proj) {
+    TRACE_BEGIN(sort_start);
+    Vec4f row_w = m44frow(view_proj, 3);
+    for (int i=0; i < scene->nvisible; i++) {
+        int instance = scene->visible[i];
+        const Aabb *b = &scene->instances[instance].bounds;
+        Vec4f center = {{.5f*(b->min.e[0] + b->max.e[0]),
+            .5f*(b->min.e[1] + b->max.e[1]), 
+            .5f*(b->min.e[2] + b->max.e[2]), 1.f}};
+        scene->depth[instance] = v4fdot(row_w, center);
+    }
+    depth_sort(scene->visible, scene->nvisible, scene->depth);
+    TRACE_END(sort_start, "scene sort");
+}
+
+// Culls, occludes and sorts the instances for a frame into scene->visible.
+// Returns 1 if the hierarchy could not be built.
+static int scene_visible(Scene *scene, Mat44f view_proj) {
+    if (scene->dirty && scene_build(scene) != 0) {
+        return 1;
+    }
+    scene_cull(scene, view_proj);
+    if (scene->occlusion.memory != NULL) {
+        scene_occlude(scene, view_proj);
+    }
+    if (scene->sort) {
+        sort_visible(scene, view_proj);
+    }
+    return 0;
+}
+
+int scene_record(Scene *scene, CommandBuffer *cb, ScreenBuffer *buffer_rgba,
+        ScreenBuffer *buffer_z) {
+    ShaderBase *shader = cb->uniforms;
+    if (shader == NULL) {
+        return 0;
+    }
+    TRACE_BEGIN(record_start);
+    Mat44f view = shader->modelview;
+    if (scene_visible(scene, m44fm44f(shader->projection, view)) != 0) {
+        return 0;
+    }
+
+    int recorded = 0;
+    for (int i=0; i < scene->nvisible; i++) {
+        const SceneInstance *inst = &scene->instances[scene->visible[i]];
+        cmdbuf_set_transform(cb, m44fm44f(view, inst->model));
+        recorded += (cmdbuf_draw(cb, &scene->meshes[inst->mesh], buffer_rgba,
+                    buffer_z) == 0);
+    }
+    cmdbuf_set_transform(cb, view);
+    TRACE_END(record_start, "scene_record");
+    return recorded;
+}
+
+int scene_draw(Scene *scene, RenderContext *ctx, ScreenBuffer *buffer_rgba,
+        ScreenBuffer *buffer_z) {
+    ShaderBase *shader = ctx->shader;
+    Mat44f view = shader->modelview;
+    Mat44f mvp = shader->mvp;
+    if (scene_visible(scene, m44fm44f(shader->projection, view)) != 0) {
+        return 0;
+    }
+
+    TRACE_BEGIN(draw_start);
+
+    for (int i=0; i < scene->nvisible; i++) {
+        const SceneInstance *inst = &scene->instances[scene->visible[i]];
+        shader->modelview = m44fm44f(view, inst->model);
+        shader->mvp = m44fm44f(shader->projection, shader->modelview);
+        MeshClusters *clusters = &scene->clusters[inst->mesh];
+        if (scene->sort && clusters->count > 0) {
+            draw_model_sorted(scene->meshes[inst->mesh], clusters, ctx,
+                    buffer_rgba, buffer_z);
+        } else {
+            draw_model(scene->meshes[inst->mesh], ctx, buffer_rgba,
+                    buffer_z);
+        }
+    }
+
+    shader->modelview = view;
+    shader->mvp = mvp;
+    TRACE_END(draw_start, "scene_draw");
+    return scene->nvisible;
+}
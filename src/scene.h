@@ -0,0 +1,121 @@
+#pragma once
+#include "gl.h"
+#include "drawsort.h"
+#include "cmdbuf.h"
+
+// Scene of mesh instances with a bounding volume hierarchy over their world
+// space bounds. scene_draw() walks the hierarchy against the camera frustum
+// and only submits visible instances to draw_model().
+//
+//     Scene scene;
+//     scene_init(&scene);
+//     int duck = scene_add_mesh(&scene, mesh);
+//     scene_add_instance(&scene, duck, model);
+//     ...
+//     scene_draw(&scene, ctx, rgba, z);   // per frame
+//     scene_free(&scene);
+//
+// The hierarchy is rebuilt on the next draw after instances are added or
+// moved.
+//
+// With scene_enable_occlusion(), instances marked as occluders are first
+// rasterized into a small depth buffer with draw_model_depth() and the other
+// visible instances are skipped when their bounds are fully behind them.
+// Good occluders are large and close with few triangles, e.g. walls.
+//
+// Visible instances are drawn front to back, and the faces of meshes with
+// clusters from scene_build_clusters() in front to back cluster order, see
+// drawsort.h. Instances at about the same depth keep the hierarchy order,
+// which is the same every frame.
+
+typedef struct {
+    int mesh;       // index of the mesh in the scene
+    Mat44f model;
+    Aabb bounds;    // world space
+    int occluder;   // rasterized for occlusion culling, always drawn
+} SceneInstance;
+
+// Node of the hierarchy. Every node covers the contiguous range first to
+// first + count of Scene.order. Leaves have left == -1.
+typedef struct {
+    Aabb bounds;
+    int left;
+    int right;
+    int first;
+    int count;
+} BvhNode;
+
+// Instances per leaf, at most.
+#define BVH_LEAF_SIZE 4
+
+typedef struct {
+    Mesh *meshes;       // not owned, free the mesh data separately
+    Aabb *mesh_bounds;  // object space
+    MeshClusters *clusters; // per mesh, count is 0 for meshes without
+    int nmeshes;
+    int meshes_size;
+
+    SceneInstance *instances;
+    int ninstances;
+    int instances_size;
+
+    BvhNode *nodes;
+    int nnodes;
+    int *order;         // instance indices in hierarchy order
+    int dirty;
+
+    int *visible;       // instances found visible by the last traversal
+    int nvisible;
+    float *depth;       // per instance view depth, scratch for sorting
+    int sort;           // draw front to back, on by default
+
+    ScreenBuffer occlusion; // BUF_Z32F, memory is NULL when disabled
+} Scene;
+
+void scene_init(Scene *scene);
+void scene_free(Scene *scene);
+
+// Adds a mesh and returns its index, or -1 if allocation failed.
+int scene_add_mesh(Scene *scene, Mesh mesh);
+
+// Adds an instance of a mesh and returns its index, or -1 if allocation
+// failed.
+int scene_add_instance(Scene *scene, int mesh, Mat44f model);
+
+void scene_set_transform(Scene *scene, int instance, Mat44f model);
+
+// Builds the face clusters of a mesh, reordering its faces in place. The 
+// mesh data is shared with the caller. Returns 1 if allocation failed.
+int scene_build_clusters(Scene *scene, int mesh);
+
+// Marks an instance as an occluder, or not.
+void scene_set_occluder(Scene *scene, int instance, int occluder);
+
+// Enables occlusion culling with a width x height depth buffer. Returns 1 if
+// allocation failed.
+int scene_enable_occlusion(Scene *scene, int width, int height);
+
+// Builds the hierarchy with median splits along the longest axis. Called by
+// scene_draw() when needed. Returns 1 if allocation failed.
+int scene_build(Scene *scene);
+
+// Collects the instances whose bounds intersect the frustum of view_proj
+// into scene->visible.
+void scene_cull(Scene *scene, Mat44f view_proj);
+
+// Removes the instances in scene->visible whose bounds are hidden by the
+// occluders, after rasterizing them with view_proj.
+void scene_occlude(Scene *scene, Mat44f view_proj);
+
+// Records the visible instances into a command buffer, as scene_draw() 
+// would draw them but without the face clusters. The current shader of the
+// buffer provides the projection and view. Returns the number of instances
+// recorded.
+int scene_record(Scene *scene, CommandBuffer *cb, ScreenBuffer *buffer_rgba,
+        ScreenBuffer *buffer_z);
+
+// Draws the visible instances. The frustum comes from the shader projection
+// and modelview, which is taken as the view matrix and restored when done.
+// Returns the number of instances drawn.
+int scene_draw(Scene *scene, RenderContext *ctx, ScreenBuffer *buffer_rgba,
+        ScreenBuffer *buffer_z);
@@ -0,0 +1,105 @@
+#include "stats.h"
+#include <string.h>
+#include <stdatomic.h>
+
+_Thread_local RenderStats *stats_slot;
+
+static RenderStats stats_threads[STATS_MAX_THREADS];
+static atomic_int stats_nthreads;
+
+// Where threads without a block count, never collected.
+static _Thread_local RenderStats stats_uncounted;
+
+RenderStats *stats_register_thread(void) {
+    int i = atomic_fetch_add(&stats_nthreads, 1);
+    // Sharing a block would race on the counters.
+    stats_slot = i < STATS_MAX_THREADS ? &stats_threads[i] : &stats_uncounted;
+    return stats_slot;
+}
+
+void stats_reset(RenderStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+}
+
+void stats_collect(RenderStats *total) {
+    int n = atomic_load(&stats_nthreads);
+    total->threads_uncounted = 0;
+    if (n > STATS_MAX_THREADS) {
+        total->threads_uncounted = n - STATS_MAX_THREADS;
+        n = STATS_MAX_THREADS;
+    }
+
+    for (int i=0; i < n; i++) {
+        RenderStats *s = &stats_threads[i];
+        total->instances_submitted += s->instances_submitted;
+        total->instances_culled += s->instances_culled;
+        total->instances_occluded += s->instances_occluded;
+        total->triangles_submitted += s->triangles_submitted;
+        total->triangles_culled += s->triangles_culled;
+        total->triangles_clipped += s->triangles_clipped;
+        total->triangles_zero_area += s->triangles_zero_area;
+        total->triangles_empty += s->triangles_empty;
+        total->blocks_full += s->blocks_full;
+        total->blocks_empty += s->blocks_empty;
+        total->samples_visited += s->samples_visited;
+        total->samples_covered += s->samples_covered;
+        total->depth_pass += s->depth_pass;
+        total->depth_fail += s->depth_fail;
+        total->fragment_shader_calls += s->fragment_shader_calls;
+        for (int j=0; j < STAGE_COUNT; j++) {
+            total->stage_time[j] += s->stage_time[j];
+        }
+        stats_reset(s);
+    }
+}
+
+void stats_write_json(FILE *fp, const RenderStats *stats, int frames) {
+    double n = frames > 0 ? frames : 1;
+#if defined(__x86_64__) || defined(__i386__)
+    const char *unit = "cycles";
+#else
+    const char *unit = "ns";
+#endif
+    // Raster time is measured around the whole loop, report it without the
+    // shading done inside it.
+    uint64_t raster = stats->stage_time[STAGE_RASTER] - 
+        stats->stage_time[STAGE_SHADE];
+
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"enabled\": %s,\n",
+#ifdef SOFTRAST_STATS
+            "true"
+#else
+            "false"
+#endif
+            );
+    fprintf(fp, "  \"frames\": %d,\n", frames);
+    fprintf(fp, "  \"threads_uncounted\": %d,\n", stats->threads_uncounted);
+    fprintf(fp, "  \"per_frame\": {\n");
+    fprintf(fp, "    \"instances_submitted\": %.1f,\n",
+            stats->instances_submitted/n);
+    fprintf(fp, "    \"instances_culled\": %.1f,\n", stats->instances_culled/n);
+    fprintf(fp, "    \"instances_occluded\": %.1f,\n",
+            stats->instances_occluded/n);
+    fprintf(fp, "    \"triangles_submitted\": %.1f,\n", stats->triangles_submitted/n);
+    fprintf(fp, "    \"triangles_culled\": %.1f,\n", stats->triangles_culled/n);
+    fprintf(fp, "    \"triangles_clipped\": %.1f,\n", stats->triangles_clipped/n);
+    fprintf(fp, "    \"triangles_zero_area\": %.1f,\n", stats->triangles_zero_area/n);
+    fprintf(fp, "    \"triangles_empty\": %.1f,\n", stats->triangles_empty/n);
+    fprintf(fp, "    \"blocks_full\": %.1f,\n", stats->blocks_full/n);
+    fprintf(fp, "    \"blocks_empty\": %.1f,\n", stats->blocks_empty/n);
+    fprintf(fp, "    \"samples_visited\": %.1f,\n", stats->samples_visited/n);
+    fprintf(fp, "    \"samples_covered\": %.1f,\n", stats->samples_covered/n);
+    fprintf(fp, "    \"depth_pass\": %.1f,\n", stats->depth_pass/n);
+    fprintf(fp, "    \"depth_fail\": %.1f,\n", stats->depth_fail/n);
+    fprintf(fp, "    \"fragment_shader_calls\": %.1f\n", stats->fragment_shader_calls/n);
+    fprintf(fp, "  },\n");
+    fprintf(fp, "  \"timer_unit\": \"%s\",\n", unit);
+    fprintf(fp, "  \"stage_time_per_frame\": {\n");
+    fprintf(fp, "    \"vertex\": %.1f,\n", stats->stage_time[STAGE_VERTEX]/n);
+    fprintf(fp, "    \"setup\": %.1f,\n", stats->stage_time[STAGE_SETUP]/n);
+    fprintf(fp, "    \"raster\": %.1f,\n", raster/n);
+    fprintf(fp, "    \"shade\": %.1f\n", stats->stage_time[STAGE_SHADE]/n);
+    fprintf(fp, "  }\n");
+    fprintf(fp, "}\n");
+}
@@ -0,0 +1,84 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+// Opt-in pipeline statistics. Counters and stage timers are only compiled in
+// when SOFTRAST_STATS is defined, otherwise the STATS_ macros expand to 
+// nothing. Each thread counts into its own block. stats_collect() sums the
+// blocks at frame end. Blocks are never reused, threads started after
+// STATS_MAX_THREADS others are not counted and only reported as such.
+
+typedef enum {
+    STAGE_VERTEX,   // vertex shader, perspective divide, viewport
+    STAGE_SETUP,    // varyings, bounding box, culling
+    STAGE_RASTER,   // raster loop, excluding fragment shading
+    STAGE_SHADE,    // fragment shader and color write
+    STAGE_COUNT
+} stats_stage;
+
+typedef struct {
+    uint64_t instances_submitted;   // instances given to instanced draws
+    uint64_t instances_culled;      // bounds fully outside the frustum
+    uint64_t instances_occluded;    // bounds fully behind occluders
+    uint64_t triangles_submitted;
+    uint64_t triangles_culled;      // bounding box fully outside the target
+    uint64_t triangles_clipped;     // bounding box clamped to the target
+    uint64_t triangles_zero_area;
+    uint64_t triangles_empty;       // no sample covered, dropped in setup
+    uint64_t blocks_full;           // raster blocks inside the triangle
+    uint64_t blocks_empty;          // raster blocks skipped
+    uint64_t samples_visited;       // samples in the bounding box
+    uint64_t samples_covered;       // samples inside the triangle
+    uint64_t depth_pass;
+    uint64_t depth_fail;
+    uint64_t fragment_shader_calls;
+    uint64_t stage_time[STAGE_COUNT];
+    int threads_uncounted;          // threads past STATS_MAX_THREADS, set by
+                                    // stats_collect()
+} RenderStats;
+
+#define STATS_MAX_THREADS 64
+
+// Timer used for stage times. Cycles on x86, nanoseconds elsewhere.
+static inline uint64_t stats_now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ull + ts.tv_nsec;
+#endif
+}
+
+// Returns the counter block of the calling thread.
+extern _Thread_local RenderStats *stats_slot;
+RenderStats *stats_register_thread(void);
+static inline RenderStats *stats_thread(void) {
+    return stats_slot ? stats_slot : stats_register_thread();
+}
+
+#ifdef SOFTRAST_STATS
+#define STATS_ADD(field, n) (stats_thread()->field += (n))
+#define STATS_TIME_BEGIN(var) uint64_t var = stats_now()
+#define STATS_TIME_END(stage, var) \
+    (stats_thread()->stage_time[stage] += stats_now() - (var))
+#else
+#define STATS_ADD(field, n) ((void)0)
+#define STATS_TIME_BEGIN(var) ((void)0)
+#define STATS_TIME_END(stage, var) ((void)0)
+#endif
+
+// Adds the counters of every thread into total and resets them. Call at frame
+// end, when no thread is rendering.
+void stats_collect(RenderStats *total);
+
+void stats_reset(RenderStats *stats);
+
+// Writes stats as a JSON object. Counters are divided by frames, pass 1 for
+// totals.
+void stats_write_json(FILE *fp, const RenderStats *stats, int frames);
@@ -0,0 +1,113 @@
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+typedef struct {
+    const char *name;
+    uint64_t start;
+    uint64_t end;
+} TraceEvent;
+
+// Single producer ring. Only the owning thread writes events and head, 
+// readers load head with acquire ordering and read the events behind it.
+typedef struct {
+    atomic_uint head;
+    TraceEvent events[TRACE_RING_SIZE];
+} TraceRing;
+
+static TraceRing *trace_rings[TRACE_MAX_THREADS];
+static atomic_int trace_nthreads;
+static _Thread_local TraceRing *trace_ring;
+
+static TraceRing *trace_register_thread(void) {
+    int i = atomic_fetch_add(&trace_nthreads, 1);
+    if (i >= TRACE_MAX_THREADS) {
+        return NULL; // Out of rings, this thread is not traced.
+    }
+    TraceRing *ring = calloc(1, sizeof(TraceRing));
+    trace_rings[i] = ring;
+    trace_ring = ring;
+    return ring;
+}
+
+void trace_event(const char *name, uint64_t start, uint64_t end) {
+    TraceRing *ring = trace_ring ? trace_ring : trace_register_thread();
+    if (ring == NULL) {
+        return;
+    }
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    TraceEvent *e = &ring->events[head & (TRACE_RING_SIZE - 1)];
+    e->name = name;
+    e->start = start;
+    e->end = end;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+int trace_write_json(const char *path) {
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        printf("Could not open %s for writing.\n", path);
+        return 1;
+    }
+
+    int nrings = atomic_load(&trace_nthreads);
+    if (nrings > TRACE_MAX_THREADS) {
+        nrings = TRACE_MAX_THREADS;
+    }
+
+    // Timestamps are written relative to the earliest event.
+    uint64_t base = UINT64_MAX;
+    for (int t=0; t < nrings; t++) {
+        TraceRing *ring = trace_rings[t];
+        if (ring == NULL) {
+            continue;
+        }
+        unsigned head = atomic_load_explicit(&ring->head,
+                memory_order_acquire);
+        unsigned first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+        for (unsigned i=first; i < head; i++) {
+            TraceEvent *e = &ring->events[i & (TRACE_RING_SIZE - 1)];
+            if (e->start < base) {
+                base = e->start;
+            }
+        }
+    }
+
+    fprintf(fp, "{\"traceEvents\":[\n");
+    int nevents = 0;
+    for (int t=0; t < nrings; t++) {
+        TraceRing *ring = trace_rings[t];
+        if (ring == NULL) {
+            continue;
+        }
+        fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                "\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}",
+                nevents++ ? ",\n" : "", t, t);
+
+        unsigned head = atomic_load_explicit(&ring->head,
+                memory_order_acquire);
+        unsigned first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+        for (unsigned i=first; i < head; i++) {
+            TraceEvent *e = &ring->events[i & (TRACE_RING_SIZE - 1)];
+            fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,"
+                    "\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}", e->name, t,
+                    (e->start - base)/1000.0, (e->end - e->start)/1000.0);
+        }
+    }
+    fprintf(fp, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    fclose(fp);
+    return 0;
+}
+
+void trace_clear(void) {
+    int nrings = atomic_load(&trace_nthreads);
+    if (nrings > TRACE_MAX_THREADS) {
+        nrings = TRACE_MAX_THREADS;
+    }
+    for (int t=0; t < nrings; t++) {
+        if (trace_rings[t] != NULL) {
+            atomic_store(&trace_rings[t]->head, 0);
+        }
+    }
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include <stdint.h>
+#include <time.h>
+
+// Timeline profiler. Scoped markers are recorded into per-thread ring 
+// buffers and written out as Chrome trace event JSON, which can be opened in
+// Perfetto or chrome://tracing. Markers are only compiled in when 
+// SOFTRAST_TRACE is defined, otherwise the TRACE_ macros expand to nothing.
+//
+//     TRACE_BEGIN(t);
+//     ...
+//     TRACE_END(t, "phase name");
+//
+// Names must be string literals. Each ring holds the last TRACE_RING_SIZE
+// events of its thread, older ones are overwritten.
+
+#define TRACE_RING_SIZE (1 << 16)
+#define TRACE_MAX_THREADS 64
+
+static inline uint64_t trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+// Records a completed event on the calling thread. Times in ns.
+void trace_event(const char *name, uint64_t start, uint64_t end);
+
+#ifdef SOFTRAST_TRACE
+#define TRACE_BEGIN(var) uint64_t var = trace_now()
+#define TRACE_END(var, name) trace_event((name), (var), trace_now())
+#else
+#define TRACE_BEGIN(var) ((void)0)
+#define TRACE_END(var, name) ((void)0)
+#endif
+
+// Writes the events of all threads to a Chrome trace JSON file. Call when no
+// thread is recording, events written concurrently may be torn.
+// Returns 1 if the file could not be written.
+int trace_write_json(const char *path);
+
+// Drops all recorded events.
+void trace_clear(void);
@@ -0,0 +1,142 @@
+#include "cmdbuf.h"
+#include "example_shaders.h"
+
+// Checks that cmdbuf_submit() matches executing the recorded commands
+// serially when clears are recorded between draws, both with and without a
+// job pool. Exit status 1 on a mismatch.
+
+#define WIDTH 64
+#define HEIGHT 48
+
+// Quad over x0 to x1 at depth z, colored by uv through the uv shader.
+typedef struct {
+    float verts[18];
+    float uvs[18];
+    int faces[6];
+    Mesh mesh;
+} Quad;
+
+static void make_quad(Quad *q, float x0, float x1, float z, Vec3f color) {
+    float xs[6] = {x0, x0, x1, x1, x0, x1};
+    float ys[6] = {-1.f, 1.f, -1.f, -1.f, 1.f, 1.f};
+    for (int i=0; i < 6; i++) {
+        q->verts[3*i] = xs[i];
+        q->verts[3*i + 1] = ys[i];
+        q->verts[3*i + 2] = z;
+        for (int c=0; c < 3; c++) {
+            q->uvs[3*i + c] = color.e[c];
+        }
+        q->faces[i] = i;
+    }
+    Mesh mesh = {0};
+    mesh.verts = q->verts;
+    mesh.uvs = q->uvs;
+    mesh.faces_verts = q->faces;
+    mesh.faces_uvs = q->faces;
+    mesh.nverts = 18;       // counts of floats, like load_obj()
+    mesh.nuvs = 18;
+    mesh.nfaces_verts = 6;
+    q->mesh = mesh;
+}
+
+static ShaderUV uv_shader;
+
+typedef enum {OP_DRAW, OP_CLEAR_Z, OP_CLEAR_BOTH} OpType;
+
+typedef struct {
+    OpType type;
+    const Quad *quad;
+} Op;
+
+// Runs ops serially with draw_model() or through a command buffer, and
+// returns 1 if the images differ.
+static int check(const char *name, const Op *ops, int nops, JobPool *jobs) {
+    ScreenBuffer rgba[2], z[2];
+    for (int k=0; k < 2; k++) {
+        if (buffer_init(&rgba[k], BUF_RGBA, WIDTH, HEIGHT) ||
+                buffer_init(&z[k], BUF_Z, WIDTH, HEIGHT)) {
+            printf("cmdbuf: could not allocate buffers\n");
+            return 1;
+        }
+        buffer_clear(&rgba[k]);
+        buffer_clear(&z[k]);
+    }
+    RenderContext ctx = {0};
+    ctx.shader = &uv_shader.base;
+    ctx.shader_size = sizeof(uv_shader);
+
+    for (int i=0; i < nops; i++) {
+        if (ops[i].type == OP_DRAW) {
+            draw_model(ops[i].quad->mesh, &ctx, &rgba[0], &z[0]);
+        } else {
+            buffer_clear(&z[0]);
+            if (ops[i].type == OP_CLEAR_BOTH) {
+                buffer_clear(&rgba[0]);
+            }
+        }
+    }
+
+    CommandBuffer cb;
+    cmdbuf_init(&cb);
+    cmdbuf_set_shader(&cb, &uv_shader.base, sizeof(uv_shader));
+    for (int i=0; i < nops; i++) {
+        if (ops[i].type == OP_DRAW) {
+            cmdbuf_draw(&cb, &ops[i].quad->mesh, &rgba[1], &z[1]);
+        } else {
+            cmdbuf_clear(&cb, ops[i].type == OP_CLEAR_BOTH ? &rgba[1] : NULL,
+                    &z[1]);
+        }
+    }
+    CommandBuffer *list[] = {&cb};
+    int failed = cmdbuf_submit(jobs, list, 1, &ctx) != 0 ||
+        memcmp(rgba[0].memory, rgba[1].memory, HEIGHT*rgba[0].pitch) != 0;
+    printf("cmdbuf: %s%s: %s\n", name, jobs ? ", jobs" : "",
+            failed ? "FAILED" : "ok");
+
+    cmdbuf_free(&cb);
+    for (int k=0; k < 2; k++) {
+        buffer_free(&rgba[k]);
+        buffer_free(&z[k]);
+    }
+    return failed;
+}
+
+int main(void) {
+    uv_shader.base.vertex_shader = &shader_uv_vertex;
+    uv_shader.base.vertex_shader_batch = &shader_uv_vertex_batch;
+    uv_shader.base.fragment_shader = &shader_uv_fragment;
+    uv_shader.base.mvp = m44fident();
+    uv_shader.base.modelview = m44fident();
+    uv_shader.base.projection = m44fident();
+    uv_shader.base.viewport = viewport(0, 0, WIDTH, HEIGHT);
+
+    // Overlapping quads, the second behind the first.
+    Quad front, back;
+    make_quad(&front, -1.f, .5f, .5f, (Vec3f){{1.f, 0.f, 0.f}});
+    make_quad(&back, -.5f, 1.f, -.5f, (Vec3f){{0.f, 1.f, 0.f}});
+
+    JobPool pool;
+    if (jobs_init(&pool, 3, 0) != 0) {
+        printf("cmdbuf: could not start the job pool\n");
+        return 1;
+    }
+
+    // An overlay: the back quad is drawn over the front one after a depth
+    // clear.
+    Op overlay[] = {{OP_DRAW, &front}, {OP_CLEAR_Z, NULL}, {OP_DRAW, &back}};
+    // A full clear between draws drops the front quad.
+    Op restart[] = {{OP_DRAW, &front}, {OP_CLEAR_BOTH, NULL},
+        {OP_DRAW, &back}};
+    // No clear, the back quad stays behind.
+    Op depth[] = {{OP_DRAW, &front}, {OP_DRAW, &back}};
+
+    int failed = 0;
+    JobPool *pools[2] = {NULL, &pool};
+    for (int k=0; k < 2; k++) {
+        failed |= check("depth clear between draws", overlay, 3, pools[k]);
+        failed |= check("clear between draws", restart, 3, pools[k]);
+        failed |= check("no clear", depth, 2, pools[k]);
+    }
+    jobs_free(&pool);
+    return failed;
+}
@@ -0,0 +1,126 @@
+#include "gl.h"
+#include "example_shaders.h"
+
+// Checks that a BUF_Z32F buffer with perspective_reversed() and
+// viewport_reversed() stores the near distance over w to float precision and
+// keeps surfaces a small relative distance apart resolved however far from
+// the camera they are. Exit status 1 on a failure.
+
+#define WIDTH 32
+#define HEIGHT 32
+#define ZNEAR .1f
+
+// Screen filling quad at view distance w, colored by uv through the uv
+// shader.
+typedef struct {
+    float verts[18];
+    float uvs[18];
+    int faces[6];
+    Mesh mesh;
+} Quad;
+
+static void make_quad(Quad *q, float w, Vec3f color) {
+    float xs[6] = {-1.f, -1.f, 1.f, 1.f, -1.f, 1.f};
+    float ys[6] = {-1.f, 1.f, -1.f, -1.f, 1.f, 1.f};
+    for (int i=0; i < 6; i++) {
+        q->verts[3*i] = 2.f*w*xs[i];
+        q->verts[3*i + 1] = 2.f*w*ys[i];
+        q->verts[3*i + 2] = w;
+        for (int c=0; c < 3; c++) {
+            q->uvs[3*i + c] = color.e[c];
+        }
+        q->faces[i] = i;
+    }
+    Mesh mesh = {0};
+    mesh.verts = q->verts;
+    mesh.uvs = q->uvs;
+    mesh.faces_verts = q->faces;
+    mesh.faces_uvs = q->faces;
+    mesh.nverts = 18;       // counts of floats, like load_obj()
+    mesh.nuvs = 18;
+    mesh.nfaces_verts = 6;
+    q->mesh = mesh;
+}
+
+static ShaderUV uv_shader;
+
+// Draws the quads in order into fresh buffers and returns the number of
+// pixels not showing the first one, the nearest. If depth is not NULL it
+// receives the depth of the center pixel.
+static int draw(const Quad *quads, int n, float *depth) {
+    ScreenBuffer rgba, z;
+    if (buffer_init(&rgba, BUF_RGBA, WIDTH, HEIGHT) ||
+            buffer_init(&z, BUF_Z32F, WIDTH, HEIGHT)) {
+        printf("depth: could not allocate buffers\n");
+        return WIDTH*HEIGHT;
+    }
+    buffer_clear(&rgba);
+    buffer_clear(&z);
+    RenderContext ctx = {0};
+    ctx.shader = &uv_shader.base;
+    ctx.shader_size = sizeof(uv_shader);
+    for (int i=0; i < n; i++) {
+        draw_model(quads[i].mesh, &ctx, &rgba, &z);
+    }
+
+    // The nearest quad is red, the others are not.
+    int wrong = 0;
+    for (int y=0; y < HEIGHT; y++) {
+        const uint32_t *row = (const uint32_t *)((char *)rgba.memory +
+                y*rgba.pitch);
+        for (int x=0; x < WIDTH; x++) {
+            wrong += (row[x] & 0xffffff) != 0xff0000;
+        }
+    }
+    if (depth != NULL) {
+        *depth = ((const float *)((char *)z.memory +
+                    HEIGHT/2*z.pitch))[WIDTH/2];
+    }
+    buffer_free(&rgba);
+    buffer_free(&z);
+    return wrong;
+}
+
+// Draws a red quad at distance w and a green one just behind it, in both
+// orders. Returns 1 if the red one does not win everywhere.
+static int resolve_gap(float w, float gap) {
+    Quad near, far;
+    make_quad(&near, w, (Vec3f){{1.f, 0.f, 0.f}});
+    make_quad(&far, w*(1.f + gap), (Vec3f){{0.f, 1.f, 0.f}});
+    Quad first[2] = {near, far}, last[2] = {far, near};
+    int wrong = draw(first, 2, NULL) + draw(last, 2, NULL);
+    printf("depth: w %g, gap %g: %s\n", w, gap,
+            wrong ? "FAILED" : "ok");
+    return wrong != 0;
+}
+
+int main(void) {
+    uv_shader.base.vertex_shader = &shader_uv_vertex;
+    uv_shader.base.vertex_shader_batch = &shader_uv_vertex_batch;
+    uv_shader.base.fragment_shader = &shader_uv_fragment;
+    uv_shader.base.modelview = m44fident();
+    uv_shader.base.projection = perspective_reversed(90.f, 1.f, -ZNEAR);
+    uv_shader.base.mvp = uv_shader.base.projection;
+    uv_shader.base.viewport = viewport_reversed(0, 0, WIDTH, HEIGHT);
+
+    int failed = 0;
+
+    // The stored depth is the near distance over w, to a few ulps.
+    float dists[] = {.2f, 1.f, 100.f, 1e4f, 1e6f};
+    for (int i=0; i < 5; i++) {
+        Quad q;
+        make_quad(&q, dists[i], (Vec3f){{1.f, 0.f, 0.f}});
+        float d, expected = ZNEAR/dists[i];
+        int wrong = draw(&q, 1, &d);
+        int ok = !wrong && fabsf(d - expected) <= 4e-7f*expected;
+        printf("depth: w %g, depth %g, expected %g: %s\n", dists[i], d,
+                expected, ok ? "ok" : "FAILED");
+        failed |= !ok;
+    }
+
+    // Relative gaps of 1e-5 stay resolved however far away the surfaces are.
+    failed |= resolve_gap(1.f, 1e-5f);
+    failed |= resolve_gap(1e3f, 1e-5f);
+    failed |= resolve_gap(1e5f, 1e-5f);
+    return failed;
+}
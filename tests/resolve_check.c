@@ -0,0 +1,76 @@
+#include "gl.h"
+
+// Checks resolve() against the scalar formula on every pixel, on widths that
+// are not a multiple of the four pixels the SSE loop handles at a time, so
+// both loops and their boundary are covered. Exit status 1 on a mismatch.
+
+static float expected_channel(float c, tonemap_op op, float exposure) {
+    c *= exposure;
+    if (op == TONEMAP_REINHARD) {
+        c = c/(1.f + max(c, 0.f));
+    }
+    return clamp(c, 0.f, 1.f);
+}
+
+static int check(int width, pixel_format format, tonemap_op op,
+        float exposure) {
+    int height = 3;
+    ScreenBuffer src, dst;
+    if (buffer_init(&src, BUF_RGBAF, width, height) ||
+            buffer_init(&dst, BUF_RGBA, width, height)) {
+        printf("resolve: could not allocate buffers\n");
+        return 1;
+    }
+    dst.format = format;
+    // Colors over and under the clamp range, alpha in and out of it.
+    static const float alphas[] = {1.f, .5f, 0.f, 2.f, -1.f};
+    for (int y=0; y < height; y++) {
+        for (int x=0; x < width; x++) {
+            float t = (float)(x + y*width)/(width*height);
+            Vec4f c = {{4.f*t - 1.f, 2.f*t, 3.f - 2.f*t,
+                alphas[(x + y) % 5]}};
+            set_colorf(&src, x, y, c);
+        }
+    }
+
+    resolve(&src, &dst, op, exposure);
+
+    int failed = 0;
+    for (int y=0; y < height; y++) {
+        const float *in = (const float *)((char *)src.memory + y*src.pitch);
+        const uint32_t *out = (const uint32_t *)((char *)dst.memory +
+                y*dst.pitch);
+        for (int x=0; x < width; x++) {
+            const float *c = &in[4*x];
+            uint32_t want = pack_color(format,
+                    (int)(expected_channel(c[0], op, exposure)*0xff),
+                    (int)(expected_channel(c[1], op, exposure)*0xff),
+                    (int)(expected_channel(c[2], op, exposure)*0xff),
+                    (int)(clamp(c[3], 0.f, 1.f)*0xff));
+            if (out[x] != want && !failed) {
+                printf("resolve: width %d format %d op %d pixel %d,%d: "
+                        "%08x, expected %08x\n", width, format, op, x, y,
+                        out[x], want);
+                failed = 1;
+            }
+        }
+    }
+    buffer_free(&src);
+    buffer_free(&dst);
+    return failed;
+}
+
+int main(void) {
+    static const int widths[] = {1, 3, 7, 13};
+    static const pixel_format formats[] = {PIXEL_ARGB8888, PIXEL_ABGR8888,
+        PIXEL_RGBA8888, PIXEL_BGRA8888};
+    int failed = 0;
+    for (int w=0; w < 4; w++) {
+        for (int f=0; f < 4; f++) {
+            failed |= check(widths[w], formats[f], TONEMAP_CLAMP, 1.f);
+            failed |= check(widths[w], formats[f], TONEMAP_REINHARD, 1.5f);
+        }
+    }
+    printf("resolve: %s\n", failed ? "FAILED" : "ok");
+    return failed;
+}